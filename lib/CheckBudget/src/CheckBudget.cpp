@@ -0,0 +1,61 @@
+#include "CheckBudget.h"
+
+#include <math.h>
+
+static void refill(TokenBucket& bucket, uint32_t now) {
+  uint32_t elapsed = now - bucket.lastRefillMs;
+  bucket.lastRefillMs = now;
+  // perSecond tokens a second is perSecond milli-tokens a millisecond
+  uint64_t tokens = (uint64_t)bucket.milliTokens + (uint64_t)elapsed * bucket.perSecond;
+  bucket.milliTokens = tokens > bucket.capacity ? bucket.capacity : (uint32_t)tokens;
+}
+
+void initTokenBucket(TokenBucket& bucket, uint16_t perSecond, uint16_t burst, uint32_t now) {
+  bucket.perSecond = perSecond;
+  bucket.capacity = (uint32_t)burst * 1000;
+  bucket.milliTokens = bucket.capacity;
+  bucket.lastRefillMs = now;
+}
+
+bool takeToken(TokenBucket& bucket, uint32_t now) {
+  refill(bucket, now);
+  if (bucket.milliTokens < 1000) {
+    return false;
+  }
+  bucket.milliTokens -= 1000;
+  return true;
+}
+
+uint32_t msUntilToken(TokenBucket& bucket, uint32_t now) {
+  refill(bucket, now);
+  if (bucket.milliTokens >= 1000 || bucket.perSecond == 0) {
+    return 0;
+  }
+  return (1000 - bucket.milliTokens + bucket.perSecond - 1) / bucket.perSecond;
+}
+
+void addCheckLoad(CheckLoad& load, uint32_t intervalS, uint32_t durationMs) {
+  if (intervalS == 0) {
+    return;
+  }
+  float rate = 1.0f / intervalS;
+  load.checksPerSecond += rate;
+  load.concurrency += rate * durationMs / 1000.0f;
+}
+
+uint32_t admitInterval(const CheckLoad& load, uint32_t requestedS, uint32_t durationMs, float maxChecksPerSecond,
+    float maxConcurrency, uint32_t maxS) {
+  float rateLeft = maxChecksPerSecond - load.checksPerSecond;
+  float concurrencyLeft = maxConcurrency - load.concurrency;
+  if (rateLeft <= 0 || concurrencyLeft <= 0) {
+    return 0;
+  }
+
+  // 1 / interval <= rateLeft and durationMs / 1000 / interval <= concurrencyLeft
+  float shortest = fmaxf(1.0f / rateLeft, durationMs / 1000.0f / concurrencyLeft);
+  uint32_t interval = requestedS;
+  if (shortest > interval) {
+    interval = (uint32_t)ceilf(shortest);
+  }
+  return interval <= maxS ? interval : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Check budget
+// The device can only start so many checks a second and hold so many connections open at once, so the
+// scheduler takes a token from a bucket for every check it starts and holds off when the bucket is
+// empty or too many checks are still in flight. New services are admitted against the same budget:
+// the load of every service is its rate, 1 / interval, and the connections it keeps busy, rate times
+// how long its checks take (Little's law). A service that doesn't fit is given the shortest interval
+// that does, or refused when even the longest one won't
+
+// Tokens are counted in thousandths so a refill of a few milliseconds isn't rounded away
+struct TokenBucket {
+  uint32_t milliTokens;
+  uint32_t capacity;       // milli-tokens, the burst
+  uint16_t perSecond;
+  uint32_t lastRefillMs;
+};
+
+void initTokenBucket(TokenBucket& bucket, uint16_t perSecond, uint16_t burst, uint32_t now);
+// Takes one token if there is one
+bool takeToken(TokenBucket& bucket, uint32_t now);
+// How long until takeToken() would succeed, 0 when it would now
+uint32_t msUntilToken(TokenBucket& bucket, uint32_t now);
+
+struct CheckLoad {
+  float checksPerSecond;
+  float concurrency;       // connections busy on average
+};
+
+void addCheckLoad(CheckLoad& load, uint32_t intervalS, uint32_t durationMs);
+// The shortest interval from requestedS up to maxS that keeps load within both budgets once a service
+// with checks taking durationMs joins, 0 when none does
+uint32_t admitInterval(const CheckLoad& load, uint32_t requestedS, uint32_t durationMs, float maxChecksPerSecond,
+  float maxConcurrency, uint32_t maxS);
@@ -0,0 +1,265 @@
+#include "CheckRules.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char* skipSpaces(const char* start, const char* end) {
+  while (start < end && isspace((unsigned char)*start)) {
+    start++;
+  }
+  return start;
+}
+
+static const char* trimEnd(const char* start, const char* end) {
+  while (end > start && isspace((unsigned char)end[-1])) {
+    end--;
+  }
+  return end;
+}
+
+// Copies [start, end) without the surrounding spaces, false when that is empty or doesn't fit
+static bool copyTrimmed(const char* start, const char* end, char* out, size_t maxLength) {
+  start = skipSpaces(start, end);
+  end = trimEnd(start, end);
+  size_t length = end - start;
+  if (length == 0 || length > maxLength) {
+    return false;
+  }
+  memcpy(out, start, length);
+  out[length] = '\0';
+  return true;
+}
+
+static bool parseStatusCode(const char* start, const char* end, uint16_t& code) {
+  start = skipSpaces(start, end);
+  end = trimEnd(start, end);
+  if (end - start != 3) {
+    return false;
+  }
+  code = 0;
+  for (const char* c = start; c < end; c++) {
+    if (!isdigit((unsigned char)*c)) {
+      return false;
+    }
+    code = code * 10 + (*c - '0');
+  }
+  return code >= 100 && code <= 599;
+}
+
+static const char* compileStatus(const char* start, const char* end, HttpRules& rules) {
+  while (start < end) {
+    const char* comma = (const char*)memchr(start, ',', end - start);
+    const char* itemEnd = comma != NULL ? comma : end;
+    const char* dash = (const char*)memchr(start, '-', itemEnd - start);
+
+    StatusRange range;
+    bool valid = dash != NULL
+      ? parseStatusCode(start, dash, range.low) && parseStatusCode(dash + 1, itemEnd, range.high)
+      : parseStatusCode(start, itemEnd, range.low);
+    if (dash == NULL) {
+      range.high = range.low;
+    }
+    if (!valid || range.low > range.high) {
+      return "Invalid status range";
+    }
+    if (rules.statusCount == MAX_STATUS_RANGES) {
+      return "Too many status ranges";
+    }
+    rules.status[rules.statusCount++] = range;
+    start = comma != NULL ? comma + 1 : end;
+  }
+  return rules.statusCount > 0 ? NULL : "Invalid status range";
+}
+
+static const char* compileHeader(const char* start, const char* end, HttpRules& rules) {
+  if (rules.headerCount == MAX_HEADER_RULES) {
+    return "Too many header rules";
+  }
+  const char* equals = (const char*)memchr(start, '=', end - start);
+  HeaderRule& rule = rules.headers[rules.headerCount];
+  if (equals == NULL || !copyTrimmed(start, equals, rule.name, MAX_RULE_NAME) ||
+      !copyTrimmed(equals + 1, end, rule.value, MAX_RULE_VALUE)) {
+    return "Invalid header rule";
+  }
+  rules.headerCount++;
+  return NULL;
+}
+
+// "$.data[0].state", the leading "$" and the first dot are optional
+static const char* compileJson(const char* start, const char* end, JsonAssertion& json) {
+  if (json.depth > 0) {
+    return "Only one JSON rule is allowed";
+  }
+  const char* equals = (const char*)memchr(start, '=', end - start);
+  const char* pathEnd = trimEnd(start, equals != NULL ? equals : end);
+  const char* p = skipSpaces(start, pathEnd);
+  if (p < pathEnd && *p == '$') {
+    p++;
+  }
+
+  while (p < pathEnd) {
+    if (json.depth == MAX_JSON_PATH_DEPTH) {
+      return "JSON path too deep";
+    }
+    JsonPathStep& step = json.path[json.depth];
+    if (*p == '[') {
+      const char* close = (const char*)memchr(p, ']', pathEnd - p);
+      if (close == NULL || close == p + 1) {
+        return "Invalid JSON path";
+      }
+      int index = 0;
+      for (const char* c = p + 1; c < close; c++) {
+        if (!isdigit((unsigned char)*c) || index > 9999) {
+          return "Invalid JSON path";
+        }
+        index = index * 10 + (*c - '0');
+      }
+      step.index = index;
+      step.key[0] = '\0';
+      p = close + 1;
+    } else {
+      if (*p == '.') {
+        p++;
+      }
+      const char* keyEnd = p;
+      while (keyEnd < pathEnd && *keyEnd != '.' && *keyEnd != '[') {
+        keyEnd++;
+      }
+      if (keyEnd == p || (size_t)(keyEnd - p) > MAX_RULE_NAME) {
+        return "Invalid JSON path";
+      }
+      step.index = -1;
+      memcpy(step.key, p, keyEnd - p);
+      step.key[keyEnd - p] = '\0';
+      p = keyEnd;
+    }
+    json.depth++;
+  }
+  if (json.depth == 0) {
+    return "Invalid JSON path";
+  }
+
+  json.hasValue = equals != NULL;
+  if (json.hasValue && !copyTrimmed(equals + 1, end, json.value, MAX_RULE_VALUE)) {
+    return "Invalid JSON value";
+  }
+  return NULL;
+}
+
+const char* compileCheckRules(const char* text, CheckRules& rules) {
+  memset(&rules, 0, sizeof(rules));
+  size_t length = strnlen(text, MAX_RULES_LENGTH + 1);
+  if (length > MAX_RULES_LENGTH) {
+    return "Rules too long";
+  }
+
+  const char* end = text + length;
+  const char* start = text;
+  while (start < end) {
+    const char* semicolon = (const char*)memchr(start, ';', end - start);
+    const char* clauseEnd = semicolon != NULL ? semicolon : end;
+    const char* clause = skipSpaces(start, clauseEnd);
+    size_t clauseLength = clauseEnd - clause;
+
+    const char* error = NULL;
+    if (clauseLength == 0) {
+      // Empty clause, a trailing ';' is fine
+    } else if (clauseLength > 7 && strncasecmp(clause, "status=", 7) == 0) {
+      error = compileStatus(clause + 7, clauseEnd, rules.http);
+    } else if (clauseLength > 7 && strncasecmp(clause, "header:", 7) == 0) {
+      error = compileHeader(clause + 7, clauseEnd, rules.http);
+    } else if (clauseLength > 5 && strncasecmp(clause, "json:", 5) == 0) {
+      error = compileJson(clause + 5, clauseEnd, rules.json);
+    } else {
+      error = "Unknown rule";
+    }
+    if (error != NULL) {
+      return error;
+    }
+    start = semicolon != NULL ? semicolon + 1 : end;
+  }
+  return NULL;
+}
+
+bool statusInRanges(const HttpRules& rules, int status) {
+  for (int i = 0; i < rules.statusCount; i++) {
+    if (status >= rules.status[i].low && status <= rules.status[i].high) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool containsIgnoreCase(const char* haystack, size_t haystackLength, const char* needle) {
+  size_t needleLength = strlen(needle);
+  for (size_t i = 0; i + needleLength <= haystackLength; i++) {
+    if (strncasecmp(haystack + i, needle, needleLength) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void matchHeaderLine(const HttpRules& rules, const char* line, uint8_t& matched) {
+  const char* colon = strchr(line, ':');
+  if (colon == NULL) {
+    return;
+  }
+  const char* nameEnd = trimEnd(line, colon);
+  size_t nameLength = nameEnd - line;
+  const char* end = line + strlen(line);
+  const char* value = skipSpaces(colon + 1, end);
+
+  for (int i = 0; i < rules.headerCount; i++) {
+    const HeaderRule& rule = rules.headers[i];
+    if (strlen(rule.name) == nameLength && strncasecmp(line, rule.name, nameLength) == 0 &&
+        containsIgnoreCase(value, end - value, rule.value)) {
+      matched |= 1 << i;
+    }
+  }
+}
+
+bool headersSatisfied(const HttpRules& rules, uint8_t matched) {
+  uint8_t all = (1 << rules.headerCount) - 1;
+  return (matched & all) == all;
+}
+
+// A filter array applies its first element to every element of the document's array
+void buildJsonFilter(const JsonAssertion& json, JsonDocument& filter) {
+  JsonVariant node = filter.to<JsonVariant>();
+  for (int i = 0; i < json.depth; i++) {
+    const JsonPathStep& step = json.path[i];
+    node = step.index >= 0 ? node[0].to<JsonVariant>() : node[step.key].to<JsonVariant>();
+  }
+  node.set(true);
+}
+
+// Strings compare exactly, numbers by value and booleans as true/false
+bool jsonAssertionHolds(const JsonAssertion& json, JsonVariantConst root) {
+  JsonVariantConst node = root;
+  for (int i = 0; i < json.depth; i++) {
+    const JsonPathStep& step = json.path[i];
+    node = step.index >= 0 ? node[step.index] : node[step.key];
+  }
+  if (node.isNull()) {
+    return false;
+  }
+  if (!json.hasValue) {
+    return true;
+  }
+
+  if (node.is<const char*>()) {
+    return strcmp(node.as<const char*>(), json.value) == 0;
+  }
+  if (node.is<bool>()) {
+    return strcmp(node.as<bool>() ? "true" : "false", json.value) == 0;
+  }
+  if (node.is<double>()) {
+    char* end;
+    double expected = strtod(json.value, &end);
+    return end != json.value && *end == '\0' && node.as<double>() == expected;
+  }
+  return false;
+}
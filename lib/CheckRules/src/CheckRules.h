@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ArduinoJson.h>
+
+// A service can replace its type's idea of success with a compact rule string, compiled once when the
+// service is added so a check only compares numbers and fixed strings. Clauses are separated by ';':
+//   status=200-299,304           accepted status codes, single codes or ranges
+//   header:Content-Type=json     the header has to be there and contain the value, case-insensitive
+//   json:$.data[0].state=on      the field has to equal the value, without "=value" it only has to exist
+// The JSON clause is evaluated by parsing the body through an ArduinoJson filter built from the path,
+// only that one field is kept however large the document is (an index keeps the field of every element)
+const size_t MAX_RULES_LENGTH = 159;
+const int MAX_STATUS_RANGES = 4;
+const int MAX_HEADER_RULES = 2;
+const int MAX_JSON_PATH_DEPTH = 6;
+const size_t MAX_RULE_NAME = 31;
+const size_t MAX_RULE_VALUE = 47;
+
+struct StatusRange {
+  uint16_t low;
+  uint16_t high;
+};
+
+struct HeaderRule {
+  char name[MAX_RULE_NAME + 1];
+  char value[MAX_RULE_VALUE + 1];
+};
+
+// Everything that is decided by the status line and the headers, small enough for every async probe to carry
+struct HttpRules {
+  uint8_t statusCount;     // 0 keeps the type's own status rule
+  StatusRange status[MAX_STATUS_RANGES];
+  uint8_t headerCount;
+  HeaderRule headers[MAX_HEADER_RULES];
+};
+
+struct JsonPathStep {
+  int16_t index;           // -1 for an object key
+  char key[MAX_RULE_NAME + 1];
+};
+
+struct JsonAssertion {
+  uint8_t depth;           // 0 without a JSON clause
+  bool hasValue;
+  JsonPathStep path[MAX_JSON_PATH_DEPTH];
+  char value[MAX_RULE_VALUE + 1];
+};
+
+struct CheckRules {
+  HttpRules http;
+  JsonAssertion json;
+};
+
+// Clears rules and compiles text into it. Returns NULL or what was wrong with the text
+const char* compileCheckRules(const char* text, CheckRules& rules);
+bool statusInRanges(const HttpRules& rules, int status);
+// Takes one header line as received ("Name: value") and sets the bit of every rule it satisfies
+void matchHeaderLine(const HttpRules& rules, const char* line, uint8_t& matched);
+bool headersSatisfied(const HttpRules& rules, uint8_t matched);
+// The filter for deserializeJson() that keeps only the asserted field
+void buildJsonFilter(const JsonAssertion& json, JsonDocument& filter);
+// Follows the path through a document parsed with that filter
+bool jsonAssertionHolds(const JsonAssertion& json, JsonVariantConst root);
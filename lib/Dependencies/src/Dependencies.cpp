@@ -0,0 +1,31 @@
+#include "Dependencies.h"
+
+int breakDependencyCycles(int16_t* parents, int count) {
+  int cleared = 0;
+  for (int i = 0; i < count; i++) {
+    // Any chain longer than count steps has gone round a loop, whether or not i is on it
+    int node = parents[i];
+    for (int steps = 0; node != NO_PARENT && steps < count; steps++) {
+      if (node == i) {
+        parents[i] = NO_PARENT;
+        cleared++;
+        break;
+      }
+      node = parents[node];
+    }
+  }
+  return cleared;
+}
+
+ParentReach parentReach(bool checked, bool up, uint8_t failures, bool unreachable) {
+  if (unreachable) {
+    return PARENT_UNREACHABLE;
+  }
+  if (!checked) {
+    return PARENT_REACHABLE;
+  }
+  if (!up) {
+    return PARENT_UNREACHABLE;
+  }
+  return failures > 0 ? PARENT_IN_DOUBT : PARENT_REACHABLE;
+}
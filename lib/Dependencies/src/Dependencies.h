@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// Service dependencies
+// A service can name a parent it sits behind, a ping on the hypervisor or the switch for the services
+// running on it. While the parent is down its children aren't probed at all, and a child failing while
+// its parent confirms a failure of its own waits for the parent's verdict, so one outage is one DOWN
+// transition instead of a timeout and an alert per service behind it
+const int16_t NO_PARENT = -1;
+
+enum ParentReach : uint8_t {
+  PARENT_REACHABLE,    // no parent, a parent that is up, or one that hasn't been checked yet
+  PARENT_IN_DOUBT,     // up, but confirming a failure
+  PARENT_UNREACHABLE   // down, or unreachable behind its own parent
+};
+
+// parents[i] is the index of service i's parent or NO_PARENT. Clears one link in every loop so walking
+// up from any service ends, returns how many links were cleared
+int breakDependencyCycles(int16_t* parents, int count);
+ParentReach parentReach(bool checked, bool up, uint8_t failures, bool unreachable);
@@ -0,0 +1,65 @@
+#include "History.h"
+
+#include <string.h>
+
+bool pushHistoryRecord(HistoryRing& ring, const HistoryRecord& record) {
+  ring.records[ring.head] = record;
+  ring.head = (ring.head + 1) % HISTORY_RING_SIZE;
+  if (ring.count < HISTORY_RING_SIZE) {
+    ring.count++;
+  }
+  if (ring.unflushed < HISTORY_RING_SIZE) {
+    ring.unflushed++;
+    return true;
+  }
+  return false;
+}
+
+const HistoryRecord& historyRingRecord(const HistoryRing& ring, int index) {
+  return ring.records[(ring.head + HISTORY_RING_SIZE - ring.count + index) % HISTORY_RING_SIZE];
+}
+
+const HistoryRecord& unflushedHistoryRecord(const HistoryRing& ring, int index) {
+  return ring.records[(ring.head + HISTORY_RING_SIZE - ring.unflushed + index) % HISTORY_RING_SIZE];
+}
+
+void countUptime(UptimeWindow* windows, const HistoryRecord& record) {
+  for (int i = 0; i < UPTIME_WINDOWS; i++) {
+    UptimeWindow& window = windows[i];
+    uint32_t bucket = record.time / UPTIME_BUCKET_SECONDS[i];
+    int count = UPTIME_BUCKET_COUNT[i];
+
+    if (window.checks == 0 || bucket >= window.head + count) {
+      // Empty or entirely out of date, start over from this bucket
+      memset(&window, 0, sizeof(window));
+      window.head = bucket;
+    } else if (bucket + count <= window.head) {
+      continue; // older than the window
+    }
+
+    // Moving forward drops the buckets that fall out of the window from the running totals
+    while (window.head < bucket) {
+      window.head++;
+      int expired = window.head % count;
+      window.checks -= window.bucketChecks[expired];
+      window.up -= window.bucketUp[expired];
+      window.bucketChecks[expired] = 0;
+      window.bucketUp[expired] = 0;
+    }
+
+    int index = bucket % count;
+    window.bucketChecks[index]++;
+    window.checks++;
+    if (record.status & HISTORY_UP) {
+      window.bucketUp[index]++;
+      window.up++;
+    }
+  }
+}
+
+float uptimePercent(const UptimeWindow& window) {
+  if (window.checks == 0) {
+    return -1;
+  }
+  return window.up * 100.0f / window.checks;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+// Per service check history kept in RAM, the flash segments and the replay stay in main.cpp
+// Uptime over 1h/24h/7d comes from bucketed counters bumped with every check, nothing is rescanned
+#ifndef HISTORY_RING_SIZE
+#define HISTORY_RING_SIZE 64
+#endif
+
+enum HistoryStatus : uint8_t {
+  HISTORY_UP = 1,
+  HISTORY_DEGRADED = 2
+};
+
+struct HistoryRecord {
+  uint32_t time;       // epoch seconds
+  uint16_t latencyMs;  // saturates at 65535
+  uint8_t status;      // HistoryStatus bits
+  uint8_t error;       // CheckError
+};
+
+struct HistoryRing {
+  HistoryRecord records[HISTORY_RING_SIZE];
+  uint16_t head;       // next write
+  uint16_t count;
+  uint16_t unflushed;  // newest records that aren't on flash yet
+};
+
+const int UPTIME_WINDOWS = 3;
+const char* const UPTIME_WINDOW_NAMES[UPTIME_WINDOWS] = { "1h", "24h", "7d" };
+const uint32_t UPTIME_BUCKET_SECONDS[UPTIME_WINDOWS] = { 300, 3600, 21600 };
+const int UPTIME_BUCKET_COUNT[UPTIME_WINDOWS] = { 12, 24, 28 };
+const int UPTIME_MAX_BUCKETS = 28;
+
+struct UptimeWindow {
+  uint32_t head;    // absolute number of the newest bucket, time / bucket width
+  uint32_t checks;
+  uint32_t up;
+  uint16_t bucketChecks[UPTIME_MAX_BUCKETS];
+  uint16_t bucketUp[UPTIME_MAX_BUCKETS];
+};
+
+// Overwrites the oldest record once the ring is full, returns false when that one had never been flushed
+bool pushHistoryRecord(HistoryRing& ring, const HistoryRecord& record);
+// index 0 is the oldest record still in the ring
+const HistoryRecord& historyRingRecord(const HistoryRing& ring, int index);
+// The flush position, index 0 is the oldest record that isn't on flash yet
+const HistoryRecord& unflushedHistoryRecord(const HistoryRing& ring, int index);
+
+void countUptime(UptimeWindow* windows, const HistoryRecord& record);
+// -1 while the window is empty
+float uptimePercent(const UptimeWindow& window);
@@ -0,0 +1,109 @@
+#include "PeerRing.h"
+
+// Murmur3 finalizer, spreads node ids that only differ in a few bits around the whole ring
+static uint32_t mixHash(uint32_t value) {
+  value ^= value >> 16;
+  value *= 0x85ebca6b;
+  value ^= value >> 13;
+  value *= 0xc2b2ae35;
+  value ^= value >> 16;
+  return value;
+}
+
+static bool pointBefore(const PeerRingPoint& a, const PeerRingPoint& b) {
+  return a.hash < b.hash || (a.hash == b.hash && a.node < b.node);
+}
+
+void buildPeerRing(PeerRing& ring, const uint32_t* nodeIds, int count) {
+  if (count > PEER_RING_MAX_NODES) {
+    count = PEER_RING_MAX_NODES;
+  }
+
+  // Insertion sort, the ring is rebuilt only when a peer comes or goes
+  ring.size = 0;
+  for (int node = 0; node < count; node++) {
+    for (int v = 0; v < PEER_RING_VNODES; v++) {
+      PeerRingPoint point;
+      point.hash = mixHash(nodeIds[node] ^ mixHash(v + 1));
+      point.node = node;
+
+      int pos = ring.size++;
+      while (pos > 0 && pointBefore(point, ring.points[pos - 1])) {
+        ring.points[pos] = ring.points[pos - 1];
+        pos--;
+      }
+      ring.points[pos] = point;
+    }
+  }
+}
+
+void peerRingOwners(const PeerRing& ring, uint32_t key, int& primary, int& secondary) {
+  primary = -1;
+  secondary = -1;
+  if (ring.size == 0) {
+    return;
+  }
+
+  // First point at or after the key, wrapping to the start of the ring
+  int low = 0;
+  int high = ring.size;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (ring.points[mid].hash < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  for (int i = 0; i < ring.size; i++) {
+    int node = ring.points[(low + i) % ring.size].node;
+    if (primary < 0) {
+      primary = node;
+    } else if (node != primary) {
+      secondary = node;
+      return;
+    }
+  }
+}
+
+uint32_t peerServiceKey(uint8_t type, const char* host, uint16_t port, const char* path) {
+  // FNV-1a over the fields that make two devices' services the same target
+  uint32_t hash = 2166136261u;
+  uint8_t head[3] = { type, (uint8_t)(port >> 8), (uint8_t)port };
+  for (uint8_t byte : head) {
+    hash ^= byte;
+    hash *= 16777619u;
+  }
+  for (const char* c = host; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  hash ^= '\n';
+  hash *= 16777619u;
+  for (const char* c = path; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  return mixHash(hash);
+}
+
+QuorumState quorumState(int observers, int up) {
+  if (observers <= 0) {
+    return QUORUM_UNKNOWN;
+  }
+  int down = observers - up;
+  if (down == 0) {
+    return QUORUM_UP;
+  }
+  return down * 2 > observers ? QUORUM_DOWN : QUORUM_DISPUTED;
+}
+
+const char* quorumStateName(QuorumState state) {
+  switch (state) {
+    case QUORUM_UP: return "up";
+    case QUORUM_DISPUTED: return "disputed";
+    case QUORUM_DOWN: return "down";
+    default: return "unknown";
+  }
+}
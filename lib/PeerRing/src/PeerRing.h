@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// Consistent hashing for peer mode
+// Every node puts PEER_RING_VNODES points on a 32 bit ring, a service belongs to the first node found
+// clockwise from its key and the next different node is its secondary. A node joining or leaving only
+// moves the services next to its own points, everything else keeps its probers
+const int PEER_RING_VNODES = 16;
+const int PEER_RING_MAX_NODES = 9;  // this node and up to 8 peers
+
+struct PeerRingPoint {
+  uint32_t hash;
+  uint8_t node;  // index into the node list the ring was built from
+};
+
+struct PeerRing {
+  PeerRingPoint points[PEER_RING_MAX_NODES * PEER_RING_VNODES];
+  int size;
+};
+
+void buildPeerRing(PeerRing& ring, const uint32_t* nodeIds, int count);
+// secondary is -1 while the ring holds a single node, both are -1 for an empty ring
+void peerRingOwners(const PeerRing& ring, uint32_t key, int& primary, int& secondary);
+
+// A service's identity across devices, ids are generated per device so they can't be used
+uint32_t peerServiceKey(uint8_t type, const char* host, uint16_t port, const char* path);
+
+// Quorum over every fresh observation of a service, this node's own included. DOWN needs a strict
+// majority, a split means one side's network is the likelier culprit than the service
+enum QuorumState : uint8_t {
+  QUORUM_UNKNOWN,
+  QUORUM_UP,
+  QUORUM_DISPUTED,
+  QUORUM_DOWN
+};
+
+QuorumState quorumState(int observers, int up);
+const char* quorumStateName(QuorumState state);
@@ -0,0 +1,52 @@
+#include "ResponseMatcher.h"
+
+#include <string.h>
+
+// Builds the KMP failure table, failure[i] is the length of the longest proper prefix of pattern[0..i] that is also its suffix
+// Longer patterns are cut at MAX_EXPECTED_RESPONSE, parseServiceJson() refuses them before they get here
+void initResponseMatcher(ResponseMatcher& matcher, const char* pattern) {
+  size_t length = strnlen(pattern, MAX_EXPECTED_RESPONSE);
+  memcpy(matcher.pattern, pattern, length);
+  matcher.pattern[length] = '\0';
+  matcher.length = length;
+  matcher.matched = 0;
+  if (matcher.length == 0) {
+    return;
+  }
+
+  matcher.failure[0] = 0;
+  uint8_t k = 0;
+  for (uint8_t i = 1; i < matcher.length; i++) {
+    while (k > 0 && matcher.pattern[i] != matcher.pattern[k]) {
+      k = matcher.failure[k - 1];
+    }
+    if (matcher.pattern[i] == matcher.pattern[k]) {
+      k++;
+    }
+    matcher.failure[i] = k;
+  }
+}
+
+// Consumes the next piece of the body, the partial match carries over so a needle split across reads is still found
+bool feedResponseMatcher(ResponseMatcher& matcher, const uint8_t* data, size_t len) {
+  if (matcher.length == 0) {
+    return true;
+  }
+
+  uint8_t k = matcher.matched;
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    while (k > 0 && c != matcher.pattern[k]) {
+      k = matcher.failure[k - 1];
+    }
+    if (c == matcher.pattern[k]) {
+      k++;
+    }
+    if (k == matcher.length) {
+      matcher.matched = 0;
+      return true;
+    }
+  }
+  matcher.matched = k;
+  return false;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// expectedResponse is searched for while the body streams in, with Knuth-Morris-Pratt so a fixed
+// failure table is all the state needed no matter how large the response is. Scanning stops at the
+// first match or after the service's maxScanBytes
+const size_t MAX_EXPECTED_RESPONSE = 127;
+
+struct ResponseMatcher {
+  char pattern[MAX_EXPECTED_RESPONSE + 1];
+  uint8_t length;    // 0 accepts any body
+  uint8_t matched;
+  uint8_t failure[MAX_EXPECTED_RESPONSE];
+};
+
+void initResponseMatcher(ResponseMatcher& matcher, const char* pattern);
+bool feedResponseMatcher(ResponseMatcher& matcher, const uint8_t* data, size_t len);
@@ -0,0 +1,87 @@
+#include "Scheduler.h"
+
+static bool dueBefore(const DeadlineEntry& a, const DeadlineEntry& b) {
+  return (int32_t)(a.due - b.due) < 0;
+}
+
+void initDeadlineHeap(DeadlineHeap& heap, DeadlineEntry* entries, int capacity) {
+  heap.entries = entries;
+  heap.capacity = capacity;
+  heap.size = 0;
+}
+
+bool appendDeadline(DeadlineHeap& heap, int slot, uint32_t due) {
+  if (heap.size >= heap.capacity) {
+    return false;
+  }
+  heap.entries[heap.size].due = due;
+  heap.entries[heap.size].slot = slot;
+  heap.size++;
+  return true;
+}
+
+void heapifyDeadlines(DeadlineHeap& heap) {
+  for (int i = heap.size / 2 - 1; i >= 0; i--) {
+    siftDeadlineDown(heap, i);
+  }
+}
+
+void rescheduleRoot(DeadlineHeap& heap, uint32_t due) {
+  heap.entries[0].due = due;
+  siftDeadlineDown(heap, 0);
+}
+
+void siftDeadlineDown(DeadlineHeap& heap, int pos) {
+  DeadlineEntry* entries = heap.entries;
+  for (;;) {
+    int smallest = pos;
+    int left = pos * 2 + 1;
+    int right = left + 1;
+
+    if (left < heap.size && dueBefore(entries[left], entries[smallest])) {
+      smallest = left;
+    }
+    if (right < heap.size && dueBefore(entries[right], entries[smallest])) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      return;
+    }
+
+    DeadlineEntry swap = entries[pos];
+    entries[pos] = entries[smallest];
+    entries[smallest] = swap;
+    pos = smallest;
+  }
+}
+
+uint32_t nextDeadline(uint32_t due, uint32_t intervalMs, uint32_t now) {
+  uint32_t next = due + intervalMs;
+  if ((int32_t)(next - now) <= 0) {
+    next = now + intervalMs;
+  }
+  return next;
+}
+
+uint32_t retryDelayMs(uint8_t failures, uint8_t confirmChecks, uint32_t intervalMs, uint16_t retryInterval,
+    uint32_t maxBackoff) {
+  if (failures == 0) {
+    return intervalMs;
+  }
+  if (failures <= confirmChecks) {
+    uint32_t retryMs = (uint32_t)retryInterval * 1000;
+    return retryMs < intervalMs ? retryMs : intervalMs;
+  }
+
+  // Doubles from the normal interval, the shift is capped so it can't overflow
+  int doublings = failures - confirmChecks - 1;
+  if (doublings > 16) {
+    doublings = 16;
+  }
+  uint64_t delay = (uint64_t)intervalMs << doublings;
+  uint64_t cap = (uint64_t)maxBackoff * 1000;
+  if (delay > cap) {
+    delay = cap;
+  }
+  return delay > intervalMs ? (uint32_t)delay : intervalMs;
+}
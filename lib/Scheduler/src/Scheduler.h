@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+// Deadline heap
+// Slots kept in a min-heap ordered by their due time. The due times are copied into the heap entries,
+// so the comparisons walk one dense array instead of chasing every slot's state, and whoever owns the
+// slots has to rebuild the heap after changing a deadline behind its back
+// Deadlines are millis() values, they are compared by signed difference so wrapping is harmless
+struct DeadlineEntry {
+  uint32_t due;
+  int16_t slot;
+};
+
+struct DeadlineHeap {
+  DeadlineEntry* entries;
+  int capacity;
+  int size;
+};
+
+void initDeadlineHeap(DeadlineHeap& heap, DeadlineEntry* entries, int capacity);
+// Unordered append, call heapifyDeadlines() once every slot is in
+bool appendDeadline(DeadlineHeap& heap, int slot, uint32_t due);
+void heapifyDeadlines(DeadlineHeap& heap);
+// Moves the root to a new deadline and restores the heap order
+void rescheduleRoot(DeadlineHeap& heap, uint32_t due);
+void siftDeadlineDown(DeadlineHeap& heap, int pos);
+
+// The deadline after due, keeping the phase unless we fell a whole interval behind
+uint32_t nextDeadline(uint32_t due, uint32_t intervalMs, uint32_t now);
+
+// Retry policy
+// A failed check doesn't take a service down on its own: it is re-checked confirmChecks more times,
+// retryInterval apart, and only then declared DOWN. While it stays down the interval doubles with
+// every further failure up to maxBackoff, and the first success puts it straight back on its normal
+// interval. Failed confirmation checks count as errors but not as downtime
+const uint8_t DEFAULT_CONFIRM_CHECKS = 2;
+const uint16_t DEFAULT_RETRY_INTERVAL = 5;
+const uint32_t DEFAULT_MAX_BACKOFF = 600;
+const uint8_t MAX_CONFIRM_CHECKS = 10;
+
+// How long until the next check given the failures so far, retryInterval and maxBackoff are in seconds
+uint32_t retryDelayMs(uint8_t failures, uint8_t confirmChecks, uint32_t intervalMs, uint16_t retryInterval,
+  uint32_t maxBackoff);
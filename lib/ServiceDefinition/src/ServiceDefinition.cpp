@@ -0,0 +1,161 @@
+#include "ServiceDefinition.h"
+
+#include <string.h>
+
+bool parseServiceType(const char* type, ServiceType& out) {
+  if (strcmp(type, "home_assistant") == 0) {
+    out = TYPE_HOME_ASSISTANT;
+  } else if (strcmp(type, "jellyfin") == 0) {
+    out = TYPE_JELLYFIN;
+  } else if (strcmp(type, "http_get") == 0) {
+    out = TYPE_HTTP_GET;
+  } else if (strcmp(type, "ping") == 0) {
+    out = TYPE_PING;
+  } else if (strcmp(type, "tcp") == 0) {
+    out = TYPE_TCP;
+  } else if (strcmp(type, "tls") == 0) {
+    out = TYPE_TLS;
+  } else if (strcmp(type, "https") == 0) {
+    out = TYPE_HTTPS;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* serviceTypeName(ServiceType type) {
+  switch (type) {
+    case TYPE_HOME_ASSISTANT: return "home_assistant";
+    case TYPE_JELLYFIN: return "jellyfin";
+    case TYPE_HTTP_GET: return "http_get";
+    case TYPE_PING: return "ping";
+    case TYPE_TCP: return "tcp";
+    case TYPE_TLS: return "tls";
+    case TYPE_HTTPS: return "https";
+    default: return "unknown";
+  }
+}
+
+bool isTlsServiceType(ServiceType type) {
+  return type == TYPE_TLS || type == TYPE_HTTPS;
+}
+
+const char* checkServiceLengths(const ServiceDefinition& definition) {
+  if (strlen(definition.expectedResponse) > MAX_EXPECTED_RESPONSE) {
+    return "Expected response too long";
+  }
+  if (strlen(definition.host) > MAX_HOST_LENGTH) {
+    return "Host too long";
+  }
+  if (strlen(definition.path) > MAX_PATH_LENGTH) {
+    return "Path too long";
+  }
+  if (strlen(definition.authToken) > MAX_AUTH_TOKEN_LENGTH) {
+    return "Auth token too long";
+  }
+  if (strlen(definition.parent) > MAX_SERVICE_ID_LENGTH) {
+    return "Parent id too long";
+  }
+  if (strlen(definition.group) > MAX_GROUP_LENGTH) {
+    return "Group too long";
+  }
+  return NULL;
+}
+
+const char* parseServiceJson(JsonObjectConst obj, ServiceDefinition& definition) {
+  if (!parseServiceType(obj["type"] | "", definition.type)) {
+    return "Invalid service type";
+  }
+
+  definition.id = "";
+  definition.name = obj["name"] | "";
+  definition.host = obj["host"] | "";
+  definition.port = obj["port"] | (isTlsServiceType(definition.type) ? 443 : 80);
+  definition.path = obj["path"] | "/";
+  definition.expectedResponse = obj["expectedResponse"] | "*";
+  definition.checkInterval = obj["checkInterval"] | 60;
+  definition.maxScanBytes = obj["maxScanBytes"] | DEFAULT_MAX_SCAN_BYTES;
+  definition.degradedMs = obj["degradedMs"] | 0;
+  definition.confirmChecks = obj["confirmChecks"] | DEFAULT_CONFIRM_CHECKS;
+  definition.retryInterval = obj["retryInterval"] | DEFAULT_RETRY_INTERVAL;
+  definition.maxBackoff = obj["maxBackoff"] | DEFAULT_MAX_BACKOFF;
+  definition.rules = obj["rules"] | "";
+  definition.authToken = obj["authToken"] | "";
+  definition.parent = obj["parent"] | "";
+  definition.group = obj["group"] | "";
+  definition.connectTimeoutMs = obj["connectTimeoutMs"] | 0;
+  definition.readTimeoutMs = obj["readTimeoutMs"] | 0;
+  definition.pingCount = obj["pingCount"] | 0;
+
+  const char* tooLong = checkServiceLengths(definition);
+  if (tooLong != NULL) {
+    return tooLong;
+  }
+  if ((obj["confirmChecks"] | 0) > MAX_CONFIRM_CHECKS) {
+    return "Too many confirmation checks";
+  }
+  for (const char* key : { "connectTimeoutMs", "readTimeoutMs" }) {
+    long timeout = obj[key] | 0L;
+    if (timeout != 0 && (timeout < MIN_TIMEOUT_MS || timeout > MAX_TIMEOUT_MS)) {
+      return "Timeout out of range";
+    }
+  }
+  if ((obj["pingCount"] | 0) > MAX_PING_COUNT) {
+    return "Too many pings";
+  }
+  CheckRules rules;
+  return compileCheckRules(definition.rules, rules);
+}
+
+void serializeServiceDefinition(const ServiceDefinition& definition, JsonObject obj) {
+  obj["id"] = definition.id;
+  obj["name"] = definition.name;
+  obj["type"] = serviceTypeName(definition.type);
+  obj["host"] = definition.host;
+  obj["port"] = definition.port;
+  obj["path"] = definition.path;
+  obj["expectedResponse"] = definition.expectedResponse;
+  obj["checkInterval"] = definition.checkInterval;
+  obj["maxScanBytes"] = definition.maxScanBytes;
+  obj["degradedMs"] = definition.degradedMs;
+  obj["confirmChecks"] = definition.confirmChecks;
+  obj["retryInterval"] = definition.retryInterval;
+  obj["maxBackoff"] = definition.maxBackoff;
+  // Only when set, most services have none of these
+  if (definition.rules[0] != '\0') {
+    obj["rules"] = definition.rules;
+  }
+  if (definition.authToken[0] != '\0') {
+    obj["authToken"] = definition.authToken;
+  }
+  if (definition.parent[0] != '\0') {
+    obj["parent"] = definition.parent;
+  }
+  if (definition.group[0] != '\0') {
+    obj["group"] = definition.group;
+  }
+  if (definition.connectTimeoutMs != 0) {
+    obj["connectTimeoutMs"] = definition.connectTimeoutMs;
+  }
+  if (definition.readTimeoutMs != 0) {
+    obj["readTimeoutMs"] = definition.readTimeoutMs;
+  }
+  if (definition.pingCount != 0) {
+    obj["pingCount"] = definition.pingCount;
+  }
+}
+
+uint16_t effectiveConnectTimeout(uint16_t connectTimeoutMs) {
+  return connectTimeoutMs != 0 ? connectTimeoutMs : DEFAULT_CONNECT_TIMEOUT_MS;
+}
+
+uint16_t effectiveReadTimeout(ServiceType type, uint16_t readTimeoutMs) {
+  if (readTimeoutMs != 0) {
+    return readTimeoutMs;
+  }
+  return type == TYPE_PING ? DEFAULT_PING_TIMEOUT_MS : DEFAULT_READ_TIMEOUT_MS;
+}
+
+uint8_t effectivePingCount(uint8_t pingCount) {
+  return pingCount != 0 ? pingCount : DEFAULT_PING_COUNT;
+}
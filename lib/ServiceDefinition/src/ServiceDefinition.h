@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <ArduinoJson.h>
+#include "ResponseMatcher.h"
+#include "Scheduler.h"
+#include "CheckRules.h"
+
+// Service types
+// Right now the behavior for each is rudimentary
+// However, you can use this to expand and add services with more complex checks
+enum ServiceType {
+  TYPE_HOME_ASSISTANT,
+  TYPE_JELLYFIN,
+  TYPE_HTTP_GET,
+  TYPE_PING,
+  TYPE_TCP,    // connect only
+  TYPE_TLS,    // connect and TLS handshake
+  TYPE_HTTPS   // HTTP_GET over TLS
+};
+
+const uint32_t DEFAULT_MAX_SCAN_BYTES = 65536;
+// A full DNS name is at most 253 characters. Paths, query string included, are sized for health
+// endpoints; the probe request and the DNS cache are sized from these
+const size_t MAX_HOST_LENGTH = 253;
+const size_t MAX_PATH_LENGTH = 255;
+// Home Assistant long-lived tokens are around 180 characters
+const size_t MAX_AUTH_TOKEN_LENGTH = 255;
+// Service ids are generated as 8 hex digits, imported ones can be longer
+const size_t MAX_SERVICE_ID_LENGTH = 15;
+const size_t MAX_GROUP_LENGTH = 31;
+// Timeouts and the ping count, 0 in a definition takes the type's default
+const uint16_t DEFAULT_CONNECT_TIMEOUT_MS = 5000;
+const uint16_t DEFAULT_READ_TIMEOUT_MS = 5000;
+const uint16_t DEFAULT_PING_TIMEOUT_MS = 1000;  // ping's read timeout, the wait after the last echo
+const uint16_t MIN_TIMEOUT_MS = 100;
+const uint16_t MAX_TIMEOUT_MS = 30000;
+const uint8_t DEFAULT_PING_COUNT = 3;
+const uint8_t MAX_PING_COUNT = 10;
+
+// A service as it comes from the API or services.json, the strings only need to outlive addService()
+struct ServiceDefinition {
+  const char* id;
+  const char* name;
+  ServiceType type;
+  const char* host;
+  uint16_t port;
+  const char* path;
+  const char* expectedResponse;
+  uint32_t checkInterval;  // seconds
+  uint32_t maxScanBytes;
+  uint32_t degradedMs;
+  uint8_t confirmChecks;
+  uint16_t retryInterval;
+  uint32_t maxBackoff;
+  const char* rules;       // CheckRules text, empty keeps the type's own checks
+  const char* authToken;   // sent as a bearer token, empty for none
+  const char* parent;      // id of the service this one sits behind, see Dependencies.h, empty for none
+  const char* group;       // dashboard grouping, empty for none
+  uint16_t connectTimeoutMs;
+  uint16_t readTimeoutMs;  // everything after the connect, the handshake included
+  uint8_t pingCount;
+};
+
+bool parseServiceType(const char* type, ServiceType& out);
+bool isTlsServiceType(ServiceType type);
+const char* serviceTypeName(ServiceType type);
+// NULL when every string fits its limit, otherwise which one doesn't. parseServiceJson() runs it, services
+// read from anywhere else have to call it themselves
+const char* checkServiceLengths(const ServiceDefinition& definition);
+// Fills everything but the id, the strings point into obj. Returns NULL or what was wrong with it
+const char* parseServiceJson(JsonObjectConst obj, ServiceDefinition& definition);
+// The counterpart of parseServiceJson() plus the id, the strings are copied into obj's document
+void serializeServiceDefinition(const ServiceDefinition& definition, JsonObject obj);
+// The timeouts and the ping count with the defaults filled in for a 0
+uint16_t effectiveConnectTimeout(uint16_t connectTimeoutMs);
+uint16_t effectiveReadTimeout(ServiceType type, uint16_t readTimeoutMs);
+uint8_t effectivePingCount(uint8_t pingCount);
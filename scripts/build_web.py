@@ -0,0 +1,52 @@
+# Pre-build step, gzips web/index.html into include/web_page.h so the dashboard is served
+# from flash without ever being copied into the heap. The ETag is derived from the compressed
+# bytes, so it only changes when the page does.
+import gzip
+import hashlib
+import os
+
+Import("env")
+
+project_dir = env.subst("$PROJECT_DIR")
+source = os.path.join(project_dir, "web", "index.html")
+target = os.path.join(project_dir, "include", "web_page.h")
+
+
+def build_web_page():
+    with open(source, "rb") as f:
+        html = f.read()
+
+    # mtime=0 keeps the output, and therefore the ETag, reproducible between builds
+    compressed = gzip.compress(html, compresslevel=9, mtime=0)
+    etag = hashlib.sha1(compressed).hexdigest()[:16]
+
+    lines = []
+    for i in range(0, len(compressed), 16):
+        lines.append("  " + ", ".join("0x%02x" % b for b in compressed[i:i + 16]) + ",")
+
+    header = "\n".join([
+        "// Generated by scripts/build_web.py from web/index.html, do not edit",
+        "#pragma once",
+        "",
+        "#include <Arduino.h>",
+        "",
+        "const char WEB_PAGE_ETAG[] = \"\\\"%s\\\"\";" % etag,
+        "const size_t WEB_PAGE_GZ_LEN = %d;" % len(compressed),
+        "const uint8_t WEB_PAGE_GZ[] PROGMEM = {",
+    ] + lines + [
+        "};",
+        "",
+    ])
+
+    # Only touch the header when it changes so unrelated builds stay incremental
+    if os.path.exists(target):
+        with open(target) as f:
+            if f.read() == header:
+                return
+
+    with open(target, "w") as f:
+        f.write(header)
+    print("Generated %s (%d bytes gzipped, etag %s)" % (os.path.relpath(target, project_dir), len(compressed), etag))
+
+
+build_web_page()
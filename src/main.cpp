@@ -1,63 +1,1288 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <ESPAsyncWebServer.h>
+#include <AsyncTCP.h>
 #include <ArduinoJson.h>
 #include <FS.h>
 #include <LittleFS.h>
 #include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <PubSubClient.h>
+#include <ESPmDNS.h>
 #include <ESP32Ping.h>
+#include <lwip/sockets.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/icmp.h>
+#include <lwip/ip.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+// mbedtls 3 (IDF 5) made the handshake state and the certificate dates private, reachable only
+// through its MBEDTLS_PRIVATE() accessor. mbedtls 2 has no such macro and the fields are public
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+#include <esp_system.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_freertos_hooks.h>
+#include <atomic>
+#include <memory>
+
+#include "web_page.h"
+#include "ServiceDefinition.h"
+#include "Scheduler.h"
+#include "ResponseMatcher.h"
+#include "CheckRules.h"
+#include "Dependencies.h"
+#include "History.h"
+#include "PeerRing.h"
+#include "CheckBudget.h"
 
 // WiFi credentials, need to update these with your network details
 const char* WIFI_SSID = "xxx";
 const char* WIFI_PASSWORD = "xxx";
 
+// Alert destinations, leave a URL empty to turn that destination off
+// The webhook gets one JSON POST per batch, ntfy takes the full topic URL (https://ntfy.sh/<topic>)
+const char* ALERT_WEBHOOK_URL = "";
+const char* ALERT_NTFY_URL = "";
+
+// MQTT broker, leave the host empty to turn MQTT off
+const char* MQTT_HOST = "";
+const uint16_t MQTT_PORT = 1883;
+const char* MQTT_USER = "";
+const char* MQTT_PASSWORD = "";
+const char* MQTT_BASE_TOPIC = "uptime-monitor";
+const char* MQTT_DISCOVERY_PREFIX = "homeassistant";
+
+// Peer mode, monitors with the same group name on one network split the checks between them
+// Configure the same services on every device, leave the group empty to run standalone
+const char* PEER_GROUP = "";
+
+// Low-power mode for monitors on batteries or PoE splitters: the radio sleeps between DTIM beacons and
+// the CPU light sleeps whenever nothing is due. The web interface stays up but answers a beacon later
+const bool LOW_POWER_MODE = false;
+
 AsyncWebServer server(80);
 
-// Service types
-// Right now the behavior for each is rudimentary
-// However, you can use this to expand and add services with more complex checks
-enum ServiceType {
-  TYPE_HOME_ASSISTANT,
-  TYPE_JELLYFIN,
-  TYPE_HTTP_GET,
-  TYPE_PING
+// WiFi connection manager
+// setup() only starts connecting, WiFi events drive everything after that. While the link is down the
+// scheduler holds every check, so an AP outage is recorded as a link-down window here rather than as
+// an outage of every service, and failed results that land while offline are dropped. The loop task
+// retries the connection with a backoff doubling from WIFI_RETRY_MIN_MS up to WIFI_RETRY_MAX_MS
+const unsigned long WIFI_CONNECT_TIMEOUT_MS = 10000;
+const unsigned long WIFI_RETRY_MIN_MS = 1000;
+const unsigned long WIFI_RETRY_MAX_MS = 60000;
+const int LINK_DOWN_WINDOWS = 16;
+
+struct LinkDownWindow {
+  uint32_t start;       // NTP time, 0 if the clock hadn't synced yet
+  uint32_t durationMs;  // 0 while the link is still down
+  uint8_t reason;       // last disconnect reason reported by the WiFi driver
+};
+
+std::atomic<bool> wifiOnline(false);
+std::atomic<bool> wifiResumed(false);     // set on reconnect, the loop task re-spreads the schedule
+portMUX_TYPE wifiLock = portMUX_INITIALIZER_UNLOCKED;
+LinkDownWindow linkDownWindows[LINK_DOWN_WINDOWS];
+int linkDownNewest = -1;
+int linkDownCount = 0;
+bool linkDownOpen = false;
+unsigned long linkDownSince = 0;
+uint64_t linkDownTotalMs = 0;
+uint32_t wifiDisconnects = 0;
+unsigned long wifiRetryAt = 0;
+unsigned long wifiRetryMs = WIFI_RETRY_MIN_MS;
+
+// Capacity, set with -DMAX_SERVICES=<n> in the build_flags of platformio.ini
+#ifndef MAX_SERVICES
+#define MAX_SERVICES 64
+#endif
+
+// Service storage
+// Hot scheduling state sits in one dense array the scheduler walks without touching any strings
+// Cold config lives in a separately allocated array (in PSRAM when the board has it) with its strings
+// interned into the string arena
+// Slots are stable for the life of a service, a delete pushes the slot onto the free list and bumps its
+// generation so checks still in flight for the old occupant are dropped when they report back
+enum ServiceFlags : uint8_t {
+  SERVICE_IN_USE = 1,
+  SERVICE_UP = 2,
+  SERVICE_CHECK_PENDING = 4,
+  SERVICE_DEGRADED = 8,   // up, but slower than the service's degradedMs
+  SERVICE_BENCHMARK = 16, // synthetic, never saved, exported, alerted or sent to MQTT
+  SERVICE_SUPPRESSED = 32, // its parent is down, checks wait until the parent recovers
+  SERVICE_DEFERRED = 64    // held back by the check budget, plannedDue is the deadline it missed
+};
+
+struct ServiceState {
+  uint32_t nextCheckDue;
+  uint32_t intervalMs;
+  uint32_t lastCheck;
+  uint32_t lastUptime;
+  uint16_t generation;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t failures;       // consecutive failed checks, see the retry policy in Scheduler.h
+  uint8_t peerRole;       // PeerRole, who probes this service in peer mode
+  int16_t parentSlot;     // NO_PARENT, or the slot the config's parent id resolved to
+  uint32_t plannedDue;    // with SERVICE_DEFERRED, the next deadline is computed from this one
+};
+
+typedef uint16_t StringRef; // 0 is the empty string
+
+struct ServiceConfig {
+  char id[16];
+  StringRef name;
+  StringRef host;
+  StringRef path;
+  StringRef expectedResponse;
+  StringRef rules;
+  StringRef authToken;
+  StringRef group;
+  char parent[16];         // service id, resolved by relinkDependencies()
+  uint16_t port;
+  uint32_t maxScanBytes;
+  uint32_t degradedMs;     // 0 turns the degraded state off
+  uint8_t confirmChecks;
+  uint16_t retryInterval;  // seconds
+  uint32_t maxBackoff;     // seconds
+  uint16_t connectTimeoutMs;  // 0 for the default, see effectiveConnectTimeout() and friends
+  uint16_t readTimeoutMs;
+  uint8_t pingCount;
+  uint32_t peerKey;        // peerServiceKey(), the same on every device configured with this target
+  uint32_t certExpiry;     // TLS types, epoch seconds of the certificate's notAfter, 0 until read
+  unsigned long certCheckedMs;  // when certExpiry was last read, 0 never
+  char lastError[48];
+};
+
+// Where the time of one check went, in microseconds. 0 means the phase didn't happen or wasn't
+// measured: a reused connection has no DNS or connect, and the async engine resolves inside connect()
+struct CheckTiming {
+  uint32_t dnsUs;
+  uint32_t connectUs;
+  uint32_t firstByteUs;
+  uint32_t tlsUs;      // TLS types, the handshake
+  uint32_t totalUs;    // ping reports its average round trip here
+  uint32_t jitterUs;   // ping only, mean difference between consecutive round trips
+  uint8_t lossPercent; // ping only
+  bool tlsResumed;     // TLS types, the handshake resumed a saved session
+};
+
+// Fixed bucket latency histogram, two buckets per power of two from 1 ms up (1, 1.5, 2, 3, 4, 6 ms...)
+// so percentiles are good to within a bucket at any scale. The counts are halved when one saturates,
+// which lets old samples fade instead of freezing the histogram
+const int LATENCY_BUCKETS = 32;
+
+struct ServiceLatency {
+  CheckTiming last;
+  uint16_t buckets[LATENCY_BUCKETS];
+  uint32_t samples;
+  // Never halved, these back the Prometheus histogram whose buckets have to be monotonic
+  uint32_t counts[LATENCY_BUCKETS];
+  uint64_t sumUs;
+};
+
+ServiceState serviceState[MAX_SERVICES];
+ServiceConfig* serviceConfig = NULL;
+ServiceLatency* serviceLatency = NULL;
+int16_t freeSlots[MAX_SERVICES];
+int freeSlotCount = 0;
+int serviceCount = 0;
+
+// addService() failures
+const int ADD_SERVICE_FULL = -1;
+const int ADD_SERVICE_NO_STRING_SPACE = -2;
+
+// Check history
+// Every check leaves an 8 byte record in its service's RAM ring. The rings are drained into 4 KiB blocks
+// appended to a few rotating segment files, so flash is only ever written a whole block at a time and
+// wear is spread by truncating the oldest segment when the newest fills up
+// Uptime over 1h/24h/7d comes from bucketed counters bumped with every check, nothing is rescanned
+// Records are stamped with NTP time, until the clock has synced no history is kept
+#ifndef HISTORY_SEGMENTS
+#define HISTORY_SEGMENTS 6
+#endif
+const int HISTORY_SEGMENT_BLOCKS = 32;
+const size_t HISTORY_BLOCK_SIZE = 4096;
+const uint32_t HISTORY_BLOCK_MAGIC = 0x54534948; // "HIST"
+const unsigned long HISTORY_FLUSH_INTERVAL_MS = 3600000;
+const uint32_t HISTORY_MIN_EPOCH = 1700000000; // anything earlier means NTP hasn't synced yet
+
+enum CheckError : uint8_t {
+  CHECK_ERROR_NONE,
+  CHECK_ERROR_TIMEOUT,
+  CHECK_ERROR_CONNECT,
+  CHECK_ERROR_HTTP_STATUS,
+  CHECK_ERROR_MISMATCH,
+  CHECK_ERROR_CLOSED,
+  CHECK_ERROR_INVALID,
+  CHECK_ERROR_PING,
+  CHECK_ERROR_OTHER,
+  CHECK_ERROR_DNS,
+  CHECK_ERROR_TLS,
+  CHECK_ERROR_COUNT
+};
+
+struct ServiceCounters {
+  uint32_t checks;
+  uint32_t errors[CHECK_ERROR_COUNT];
+};
+
+ServiceCounters* serviceCounters = NULL;
+
+// On flash a record carries a hash of its service id, slots get reused
+struct HistoryFlashRecord {
+  uint32_t serviceHash;
+  HistoryRecord record;
+};
+
+struct HistoryBlockHeader {
+  uint32_t magic;
+  uint32_t segmentSequence;  // bumped on every rotation, the highest one is the segment being appended to
+  uint16_t count;
+  uint16_t reserved;
+  uint32_t reserved2;
+};
+
+const int HISTORY_RECORDS_PER_BLOCK = (HISTORY_BLOCK_SIZE - sizeof(HistoryBlockHeader)) / sizeof(HistoryFlashRecord);
+
+struct ServiceHistory {
+  uint32_t serviceHash;
+  HistoryRing ring;
+  UptimeWindow windows[UPTIME_WINDOWS];
+};
+
+ServiceHistory* serviceHistory = NULL;
+int historySegment = 0;         // segment being appended to
+int historySegmentBlocks = 0;   // blocks it already holds
+uint32_t historySegmentSequence = 0;
+int historyUnflushed = 0;
+bool historyFlushWanted = false;
+unsigned long historyLastFlush = 0;
+uint8_t* historyBlock = NULL;   // scratch for flushes and the boot replay, loop task only
+
+// Streaming state for /api/services/<id>/history, flash first, then the copy of the ring
+struct HistoryCursor {
+  uint32_t serviceHash;
+  uint32_t from;
+  uint32_t to;
+  uint32_t flashBefore;   // flash records from here on are also in the ring copy
+  int segment;
+  int segmentsLeft;
+  File file;
+  size_t blockStart;
+  int blockRecordsLeft;
+  HistoryRecord ring[HISTORY_RING_SIZE];
+  int ringCount;
+  int ringPos;
+};
+
+// String arena
+// Identical strings (a shared host, "/" or "*") are stored once and refcounted, freed bytes are
+// reclaimed by compacting the pool when an intern doesn't fit
+// StringRefs index the entry table so they survive compaction, the pointers from arenaString() don't,
+// only use them under servicesMutex and before the next arenaIntern()
+#ifndef STRING_ARENA_SIZE
+#define STRING_ARENA_SIZE (MAX_SERVICES * 256)
+#endif
+const int STRING_ARENA_ENTRIES = MAX_SERVICES * 7;
+const StringRef ARENA_FULL = 0xFFFF;
+
+struct ArenaEntry {
+  uint32_t offset;
+  uint16_t length;
+  uint16_t refs;
 };
 
-// Service structure
-struct Service {
-  String id;
-  String name;
+char* arenaPool = NULL;
+ArenaEntry* arenaEntries = NULL;
+uint32_t arenaUsed = 0;
+
+// Published service state
+// Fixed-size plain copies of every slot that the web handlers read without taking servicesMutex
+// Every entry is a seqlock, the writer (always holding servicesMutex) makes seq odd while copying and even
+// when done, readers retry if seq was odd or moved underneath them
+// stateVersion bumps on every publish and is stamped into the entry, listVersion records the last add or
+// delete, so a client that knows a version can ask for just what changed since
+struct ServiceSnapshot {
+  bool inUse;
+  char id[16];
+  char name[48];
   ServiceType type;
-  String host;
+  char host[MAX_HOST_LENGTH + 1];
   int port;
-  String path;
-  String expectedResponse;
+  char path[MAX_PATH_LENGTH + 1];
+  char expectedResponse[128];
+  char rules[MAX_RULES_LENGTH + 1];
+  bool hasAuthToken;   // the token itself is never published
+  char parent[16];
+  char group[MAX_GROUP_LENGTH + 1];
+  bool suppressed;
   int checkInterval;
+  uint32_t maxScanBytes;
+  uint32_t degradedMs;
+  uint8_t confirmChecks;
+  uint16_t retryInterval;
+  uint32_t maxBackoff;
+  uint16_t connectTimeoutMs;  // effective
+  uint16_t readTimeoutMs;
+  uint8_t pingCount;
   bool isUp;
+  bool isDegraded;
+  bool dnsStale;       // checks are running against the last good address
+  uint8_t failures;
+  uint32_t nextCheckMs;  // from the time of publishing
+  float uptime[UPTIME_WINDOWS];  // percent, -1 without data
+  CheckTiming timing;
+  uint32_t p50Us;
+  uint32_t p95Us;
+  uint32_t p99Us;
+  uint32_t latencyCounts[LATENCY_BUCKETS];
+  uint64_t latencySumUs;
+  ServiceCounters counters;
   unsigned long lastCheck;
-  unsigned long lastUptime;
+  char lastError[48];
+  uint32_t certExpiry;   // TLS types, 0 until read
+  uint8_t peerRole;
+  uint8_t observers;     // fresh results behind the quorum, this node's own included
+  uint8_t observersUp;
+  uint8_t quorum;        // QuorumState
+  char primary[24];      // node that probes the service first
+  uint32_t version;
+};
+
+// The sequence counters stay in internal RAM for the atomics, the copies go wherever cold data goes
+std::atomic<uint32_t> publishedSeq[MAX_SERVICES];
+ServiceSnapshot* publishedServices = NULL;
+// publishService() fills this first so the write window is only the copy, servicesMutex guards it
+ServiceSnapshot* publishStaging = NULL;
+// A reader that keeps finding the entry mid-write sleeps a tick, it may have preempted the writer on its core
+const int PUBLISH_READ_SPINS = 4;
+std::atomic<uint32_t> stateVersion(0);
+std::atomic<uint32_t> listVersion(0);
+
+// Dashboard live updates, every published change is pushed as a "service" event and adds or deletes
+// as a "list" event telling the page to refetch
+AsyncEventSource events("/api/events");
+
+// Chunked response source
+// refill() writes the next piece of the body into scratch and returns false once there is nothing left,
+// the response filler drains scratch into whatever room AsyncTCP offers, so a body of any size is
+// produced with one scratch buffer of memory
+struct ChunkedSource {
+  char scratch[2048];  // one full service, longest host, path and rules included
+  size_t length;
+  size_t pos;
+  int cursor;   // where refill() carries on from, -1 once the last piece was written
+  int emitted;  // items written so far, for separators
+  bool finished;
+  std::function<bool(ChunkedSource&)> refill;
+};
+
+// Prometheus metrics
+// /metrics is written line by line with snprintf straight into the chunk scratch buffer, service
+// values come from the published snapshots so a scrape never takes servicesMutex
+// Families are emitted one after another, each with its HELP/TYPE header and then every service
+enum MetricFamilyId {
+  METRIC_SERVICE_INFO,
+  METRIC_UP,
+  METRIC_DEGRADED,
+  METRIC_LAST_LATENCY,
+  METRIC_CHECKS,
+  METRIC_CHECK_ERRORS,
+  METRIC_LATENCY,
+  METRIC_FREE_HEAP,
+  METRIC_MIN_FREE_HEAP,
+  METRIC_LARGEST_FREE_BLOCK,
+  METRIC_SCHEDULER_LAG,
+  METRIC_SCHEDULER_MAX_LAG,
+  METRIC_WIFI_RSSI,
+  METRIC_WIFI_CONNECTED,
+  METRIC_WIFI_DISCONNECTS,
+  METRIC_LINK_DOWN,
+  METRIC_ALERTS_SENT,
+  METRIC_ALERTS_FAILED,
+  METRIC_ALERTS_PENDING,
+  METRIC_ALERTS_DROPPED,
+  METRIC_UPTIME,
+  METRIC_FAMILY_COUNT
+};
+
+struct MetricFamily {
+  const char* name;
+  const char* type;
+  const char* help;
+  bool perService;
+};
+
+const MetricFamily METRIC_FAMILIES[METRIC_FAMILY_COUNT] = {
+  { "uptime_monitor_service_info", "gauge", "Configured service, always 1", true },
+  { "uptime_monitor_up", "gauge", "1 if the last check succeeded", true },
+  { "uptime_monitor_degraded", "gauge", "1 if the last check was slower than the degraded threshold", true },
+  { "uptime_monitor_last_latency_seconds", "gauge", "Duration of the last check", true },
+  { "uptime_monitor_checks_total", "counter", "Checks run", true },
+  { "uptime_monitor_check_errors_total", "counter", "Failed checks by error class", true },
+  { "uptime_monitor_latency_seconds", "histogram", "Duration of successful checks", true },
+  { "uptime_monitor_free_heap_bytes", "gauge", "Free heap", false },
+  { "uptime_monitor_min_free_heap_bytes", "gauge", "Lowest free heap since boot", false },
+  { "uptime_monitor_largest_free_block_bytes", "gauge", "Largest allocatable heap block", false },
+  { "uptime_monitor_scheduler_lag_seconds", "gauge", "How late the last due check was dispatched", false },
+  { "uptime_monitor_scheduler_max_lag_seconds", "gauge", "Worst scheduler lag since boot", false },
+  { "uptime_monitor_wifi_rssi_dbm", "gauge", "WiFi signal strength", false },
+  { "uptime_monitor_wifi_connected", "gauge", "1 while the WiFi link is up", false },
+  { "uptime_monitor_wifi_disconnects_total", "counter", "Times the WiFi link was lost", false },
+  { "uptime_monitor_link_down_seconds_total", "counter", "Time spent without a WiFi link, checks are held meanwhile", false },
+  { "uptime_monitor_alerts_sent_total", "counter", "Alert batches delivered", false },
+  { "uptime_monitor_alerts_failed_total", "counter", "Alert deliveries that failed and were retried", false },
+  { "uptime_monitor_alerts_pending", "gauge", "Alerts waiting for delivery", false },
+  { "uptime_monitor_alerts_dropped_total", "counter", "Alerts lost to a full queue or spool", false },
+  { "uptime_monitor_uptime_seconds", "counter", "Time since boot", false }
+};
+
+// Longest line any family writes: the service info line with the escaped name and host (each up to twice
+// their length), the id, and the metric name, type and label text
+const size_t METRIC_LINE_MAX = 2 * sizeof(ServiceSnapshot::host) + 2 * sizeof(ServiceSnapshot::name) +
+  sizeof(ServiceSnapshot::id) + 128;
+
+struct MetricsCursor {
+  int family;
+  int slot;
+  int line;             // 0 until the slot's snapshot is loaded, then the next line plus one
+  bool headerWritten;
+  ServiceSnapshot service;
+};
+
+// Diagnostics
+// Cheap counters kept all the time so /api/diagnostics can show how close the device is to its limits:
+// the lag of every service's last dispatch behind its deadline, check durations per service type
+// (failed checks included, unlike the latency histograms), task stack high-water marks, a heap sample
+// every HEAP_SAMPLE_MS, and the time the main web handlers spend on the AsyncTCP task. For the
+// streamed routes that is the setup only, the chunks are produced later
+// The benchmark adds synthetic services checking a stub HTTP server on BENCHMARK_PORT of the device
+// itself, and when the run ends reports how many checks per second actually completed against the
+// planned rate. Benchmark services live in RAM only and are removed when the run ends
+const int SERVICE_TYPE_COUNT = TYPE_HTTPS + 1;
+const int HEAP_SAMPLES = 60;
+const unsigned long HEAP_SAMPLE_MS = 60000;
+const uint16_t BENCHMARK_PORT = 8080;
+const uint32_t BENCHMARK_MAX_DURATION_S = 600;
+
+enum HandlerRoute {
+  ROUTE_DASHBOARD,
+  ROUTE_LIST,
+  ROUTE_ADD,
+  ROUTE_DELETE,
+  ROUTE_COUNT
+};
+
+const char* const HANDLER_ROUTE_NAMES[ROUTE_COUNT] = {
+  "GET /", "GET /api/services", "POST /api/services", "DELETE /api/services"
+};
+
+struct HandlerStats {
+  uint32_t count;
+  uint64_t totalUs;
+  uint32_t maxUs;
+};
+
+// Times a handler until it goes out of scope, so early returns are counted too
+struct HandlerTimer {
+  HandlerRoute route;
+  uint32_t startedUs;
+  HandlerTimer(HandlerRoute route) : route(route), startedUs(micros()) {}
+  ~HandlerTimer();
+};
+
+struct HeapSample {
+  uint32_t uptimeS;
+  uint32_t freeHeap;
+  uint32_t largestBlock;
+};
+
+struct ServiceLag {
+  uint32_t lastMs;
+  uint32_t maxMs;
+};
+
+struct BenchmarkRun {
+  bool running;
+  bool finished;        // the fields below hold a complete result
+  int services;
+  uint32_t intervalS;
+  unsigned long startedMs;
+  unsigned long endsMs;
+  uint32_t elapsedMs;
+  uint32_t checks;
+  uint32_t failures;
+  uint32_t maxLagMs;
+  uint32_t p50Us;
+  uint32_t p95Us;
+};
+
+ServiceLag* serviceLag = NULL;
+// Guarded by servicesMutex
+uint32_t typeDurationCounts[SERVICE_TYPE_COUNT][LATENCY_BUCKETS];
+uint32_t typeDurationMaxUs[SERVICE_TYPE_COUNT];
+BenchmarkRun benchmark;
+// Only touched on the AsyncTCP task
+HandlerStats handlerStats[ROUTE_COUNT];
+AsyncServer* benchmarkServer = NULL;
+// Written by the loop task
+portMUX_TYPE heapSamplesLock = portMUX_INITIALIZER_UNLOCKED;
+HeapSample heapSamples[HEAP_SAMPLES];
+int heapSampleNewest = -1;
+int heapSampleCount = 0;
+unsigned long nextHeapSample = 0;
+
+// Power management
+// In LOW_POWER_MODE the radio runs in modem sleep and wakes for every DTIM beacon, so frames the access
+// point buffered (requests to the web interface included) still arrive, and esp_pm scales the CPU down
+// to POWER_MIN_FREQ_MHZ and light sleeps it whenever every task is blocked. The loop task already
+// blocks until the next deadline. Light sleep needs an IDF built with tickless idle, without one only
+// the frequency scaling applies
+// The duty cycle is measured in any mode with a tick hook on each core that samples whether it
+// interrupted the idle task. Ticks stop while tickless idle sleeps, so ticks seen is time awake and
+// busy ticks is time working. The current estimate weighs those fractions with rough ESP32-S3
+// datasheet figures, it is meant for comparing configurations, not for sizing a battery
+const int POWER_MAX_FREQ_MHZ = 240;
+const int POWER_MIN_FREQ_MHZ = 80;
+const float POWER_ACTIVE_MA = 100.0f;       // CPU running, radio receiving
+const float POWER_IDLE_MA = 68.0f;          // CPU idle, radio always on
+const float POWER_MODEM_SLEEP_MA = 22.0f;   // CPU idle, radio asleep between beacons
+const float POWER_LIGHT_SLEEP_MA = 2.5f;    // averaged over the beacon wakeups
+
+struct PowerWindow {
+  float busyFraction;    // both cores averaged
+  float awakeFraction;
+  uint32_t durationMs;
+};
+
+// Each core's counters are only written by its own tick interrupt
+volatile uint32_t powerTicks[portNUM_PROCESSORS];
+volatile uint32_t powerBusyTicks[portNUM_PROCESSORS];
+TaskHandle_t powerIdleTasks[portNUM_PROCESSORS];
+// Written by the loop task, a window closes with every heap sample
+portMUX_TYPE powerLock = portMUX_INITIALIZER_UNLOCKED;
+PowerWindow powerWindow;
+uint32_t powerLastTicks[portNUM_PROCESSORS];
+uint32_t powerLastBusyTicks[portNUM_PROCESSORS];
+int64_t powerLastUs = 0;
+bool powerLightSleep = false;
+
+// Configuration storage
+// Services are saved as a compact binary file: a header with a format version and a CRC32 of the
+// payload, then one length-prefixed record per service so newer fields can be appended and older
+// files still read. Saves are written to a temp file and renamed over the real one, a power cut
+// leaves either the old or the new file but never half of one
+// Changes only mark the config dirty, the loop task writes it once things have been quiet for
+// CONFIG_SAVE_DELAY_MS so a burst of edits costs one flash write
+const char* const CONFIG_PATH = "/services.bin";
+const char* const CONFIG_TEMP_PATH = "/services.tmp";
+const char* const LEGACY_CONFIG_PATH = "/services.json";
+const uint32_t CONFIG_MAGIC = 0x31435653; // "SVC1"
+const uint16_t CONFIG_VERSION = 5;
+const unsigned long CONFIG_SAVE_DELAY_MS = 2000;
+
+struct ConfigHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t payloadLength;
+  uint32_t crc;
+};
+
+// Serializes into data, or only counts the bytes when data is NULL
+struct ConfigWriter {
+  uint8_t* data;
+  size_t pos;
+};
+
+// Bounds checked, ok drops to false on the first read past the end
+struct ConfigReader {
+  const uint8_t* data;
+  size_t length;
+  size_t pos;
+  bool ok;
+};
+
+bool configDirty = false;
+unsigned long configDirtySince = 0;
+
+// Request bodies
+// POST bodies arrive in as many pieces as TCP delivers them, they are collected into one buffer hung
+// off the request (the server frees it with the request) and only parsed once complete
+const size_t MAX_SERVICE_BODY_SIZE = 4096;
+const size_t MAX_BATCH_BODY_SIZE = 32768;
+
+// Check worker pool
+// Due checks are queued by slot and picked up by whichever worker is free, so one slow host only ties up one worker
+// Workers are spread across both cores, the web server and WiFi stack keep running alongside them
+const int CHECK_WORKER_COUNT = 4;
+const uint32_t CHECK_WORKER_STACK_SIZE = 12288;  // a TLS handshake needs about 4 KB past the HTTP checks
+const UBaseType_t CHECK_WORKER_PRIORITY = 1;
+
+struct CheckJob {
+  int16_t slot;
+  uint16_t generation;
+};
+
+// Private copy of what a check needs, filled under servicesMutex so the network call runs without the lock
+struct CheckTarget {
+  int16_t slot;
+  uint16_t generation;
+  ServiceType type;
+  bool (*check)(CheckTarget& target);
+  char host[MAX_HOST_LENGTH + 1];
+  uint16_t port;
+  char path[MAX_PATH_LENGTH + 1];
+  ResponseMatcher matcher;      // precompiled, length 0 accepts any body
+  CheckRules rules;
+  char authToken[MAX_AUTH_TOKEN_LENGTH + 1];
+  uint32_t maxScanBytes;
+  uint16_t connectTimeoutMs;  // effective, the defaults filled in
+  uint16_t readTimeoutMs;
+  uint8_t pingCount;
+  bool certDue;        // TLS types, skip the saved session so the certificate is read again
   String lastError;
-  int secondsSinceLastCheck;
+  CheckTiming timing;
+  uint32_t startedUs;
+  bool deferred;       // handed to an engine that reports the result itself
+  struct WorkerConnection* connection;
 };
 
-// Store up to 20 services
-const int MAX_SERVICES = 20;
-Service services[MAX_SERVICES];
-int serviceCount = 0;
+// Each worker keeps its last HTTP connection open so back to back fallback checks against the
+// same host skip the handshake, it is dropped when the host changes or after HTTP_KEEPALIVE_IDLE_MS
+struct WorkerConnection {
+  WiFiClient client;
+  HTTPClient http;
+  char host[MAX_HOST_LENGTH + 1];
+  uint16_t port;
+};
+
+// Probe descriptors
+// Everything a check sends is built once when the service is added or loaded: the complete GET
+// request, the response matcher with its failure table, and the checker the worker pool runs for the
+// service type. Checks copy these bytes as they are instead of formatting strings on every round, so
+// nothing on the check path allocates
+// A service with check rules compiles them here too, a JSON rule keeps the service off the async engine
+// since only the worker can hand the body to the parser
+const size_t PROBE_REQUEST_SIZE = MAX_PATH_LENGTH + MAX_HOST_LENGTH + MAX_AUTH_TOKEN_LENGTH + 96;
+// Home Assistant answers /api/ with {"message": "API running."} once the token is accepted
+const char* const HOME_ASSISTANT_TOKEN_RULES = "status=200;json:message=API running.";
+
+struct ServiceProbe {
+  bool (*check)(CheckTarget& target);
+  uint16_t requestLength;
+  char request[PROBE_REQUEST_SIZE];
+  ResponseMatcher matcher;
+  CheckRules rules;
+};
+
+ServiceProbe* serviceProbes = NULL;
+
+// Feeds the body of a worker check into a matcher, HTTPClient::writeToStream takes care of chunked
+// encoding and gives up on the response as soon as write() stops accepting bytes
+class MatchingStream : public Stream {
+public:
+  ResponseMatcher matcher;
+  uint32_t scanned;
+  uint32_t limit;
+  bool found;
+
+  size_t write(const uint8_t* data, size_t len) override;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+QueueHandle_t checkQueue = NULL;
+TaskHandle_t checkWorkerHandles[CHECK_WORKER_COUNT];
+// Guards the service storage and the string arena, never hold it across a network call
+SemaphoreHandle_t servicesMutex = NULL;
+
+// Deadline scheduler
+// Slots kept in a min-heap (lib/Scheduler) ordered by nextCheckDue, the loop task sleeps until the root is due
+// Adding or removing a service, or moving a deadline outside checkServices(), rebuilds the heap and wakes the
+// loop task with a notification
+DeadlineEntry scheduleEntries[MAX_SERVICES];
+DeadlineHeap scheduleHeap = { scheduleEntries, MAX_SERVICES, 0 };
+TaskHandle_t schedulerTaskHandle = NULL;
+const unsigned long SCHEDULE_IDLE = 0xFFFFFFFF;
+// How late the last due check was picked up, written by the loop task only
+uint32_t schedulerLagMs = 0;
+uint32_t schedulerMaxLagMs = 0;
+
+// Check budget
+// A global limit on how fast checks are started and how many are in flight at once (lib/CheckBudget),
+// so a long list of short intervals can't exhaust the sockets the web server and MQTT need. A check
+// over the budget is deferred by CHECK_DEFER_MS or until the next token instead of skipping its round.
+// Adding a service projects the load with it: an interval that doesn't fit is stretched to the
+// shortest one that does, and the service is refused when nothing up to MAX_ADMITTED_INTERVAL_S fits.
+// Admission keeps CHECK_BUDGET_HEADROOM in reserve for retries, which run faster than the interval.
+// Benchmark services only talk to the device itself and are left out of both
+const uint16_t CHECK_RATE_PER_SECOND = 20;
+const uint16_t CHECK_RATE_BURST = 32;
+const int MAX_CHECKS_IN_FLIGHT = 24;
+const float CHECK_BUDGET_HEADROOM = 0.8;
+const unsigned long CHECK_DEFER_MS = 250;
+const uint32_t MAX_ADMITTED_INTERVAL_S = 3600;
+TokenBucket checkTokens;
+uint32_t checksDeferred = 0;   // written by the loop task only
+
+// Async HTTP probe engine
+// HTTP checks run as event driven probes on the AsyncTCP task instead of blocking a worker
+// Each probe sends one GET, reads the status line and only streams the body when expectedResponse is set
+// Status and header rules are decided here too, services with a JSON rule always go to the worker pool
+// When every probe slot is busy the check falls back to the blocking HTTPClient on the worker pool
+// Every slot owns one connection. After a complete keep-alive response it is parked as idle, and the next
+// probe to the same host and port reuses it instead of paying for DNS and a new handshake. Idle
+// connections are closed after HTTP_KEEPALIVE_IDLE_MS, or straight away once MAX_IDLE_CONNECTIONS are
+// parked, so the pool never sits on sockets the web server needs
+const int MAX_ASYNC_PROBES = 32;
+const int MAX_IDLE_CONNECTIONS = 8;
+const unsigned long HTTP_KEEPALIVE_IDLE_MS = 30000;
+// Bodies longer than this are not worth reading to the end just to keep the connection
+const size_t HTTP_KEEPALIVE_MAX_DRAIN = 16384;
+
+enum ProbeSlotState {
+  SLOT_FREE,    // no connection
+  SLOT_BUSY,    // claimed by a probe
+  SLOT_IDLE     // connected and parked for reuse
+};
+
+enum ProbePhase {
+  PROBE_STATUS_LINE,
+  PROBE_HEADERS,
+  PROBE_BODY,
+  PROBE_CHUNK_SIZE,
+  PROBE_CHUNK_DATA,
+  PROBE_CHUNK_END,
+  PROBE_TRAILERS,
+  PROBE_COMPLETE
+};
+
+struct AsyncProbe {
+  ProbeSlotState state;
+  bool finished;      // result recorded, the rest of the response is only drained
+  bool reused;        // running on a parked connection
+  bool redispatched;  // handed to a worker after the parked connection turned out to be dead
+  AsyncClient* client;
+  int16_t slot;
+  uint16_t generation;
+  ServiceType type;
+  uint16_t port;
+  uint32_t address;   // network byte order, from the DNS cache, parked connections are matched on it
+  uint16_t requestLength;
+  char request[PROBE_REQUEST_SIZE];
+  unsigned long deadline;   // the connect timeout first, moved to the read timeout once connected
+  uint16_t readTimeoutMs;
+  unsigned long idleSince;
+  uint32_t startedUs;
+  uint32_t connectedUs;
+  uint32_t firstByteUs;
+  int8_t errorCode;
+  ProbePhase phase;
+  char line[128];
+  size_t lineLength;
+  size_t bytesReceived;
+  int statusCode;
+  bool keepAlive;
+  bool chunked;
+  long contentLength;   // -1 when not given
+  long remaining;       // bytes left in the body or the current chunk, -1 reads until close
+  size_t drained;
+  uint32_t maxScanBytes;
+  uint32_t scanned;
+  ResponseMatcher matcher;
+  HttpRules rules;
+  uint8_t headersMatched;  // a bit per header rule
+};
+
+AsyncProbe asyncProbes[MAX_ASYNC_PROBES];
+portMUX_TYPE asyncProbesLock = portMUX_INITIALIZER_UNLOCKED;
+
+// ICMP engine
+// One task owns a raw ICMP socket and runs every ping check at once: each probe sends the service's pingCount echo
+// requests PING_INTERVAL_MS apart, and replies are matched back to their probe by identifier and
+// sequence number. Hosts given as an IP are started straight from the scheduler, names are resolved on
+// a worker first. The blocking ESP32Ping path is only used when every probe slot is taken
+const int MAX_PING_PROBES = 32;
+const unsigned long PING_INTERVAL_MS = 200;
+const size_t PING_PAYLOAD_SIZE = 32;
+const uint32_t PING_TASK_STACK_SIZE = 4096;
+const UBaseType_t PING_TASK_PRIORITY = 2;     // above the workers so replies are timestamped promptly
+
+struct PingProbe {
+  bool inUse;
+  int16_t slot;
+  uint16_t generation;
+  uint32_t address;       // network byte order
+  uint32_t dnsUs;
+  uint16_t firstSequence;
+  uint8_t count;
+  uint8_t sent;
+  uint8_t received;
+  unsigned long nextSendMs;
+  unsigned long deadlineMs;
+  uint32_t sentUs[MAX_PING_COUNT];
+  uint32_t rttUs[MAX_PING_COUNT];  // 0 until the reply arrives
+};
+
+PingProbe pingProbes[MAX_PING_PROBES];
+portMUX_TYPE pingProbesLock = portMUX_INITIALIZER_UNLOCKED;
+int pingSocket = -1;
+uint16_t pingIdentifier = 0;
+uint16_t pingSequence = 0;
+TaskHandle_t pingTaskHandle = NULL;
+
+// TCP and TLS checks
+// A TCP check only connects, it goes through the async engine like HTTP and the socket is closed as
+// soon as the handshake completes. TLS and HTTPS checks run on the workers with mbedtls driven
+// directly, WiFiClientSecure has no way to offer a saved session. The last session of every TLS
+// service is kept so the next check resumes it (a ticket or session id, whatever the server gave)
+// instead of paying for a full handshake each interval. The certificate only comes with a full
+// handshake, so at most once every TLS_CERT_RECHECK_MS a check skips the saved session to read its
+// expiry again. Certificates aren't verified, like the alert sender this only watches the service.
+// Handshakes are limited to TLS_MAX_HANDSHAKES at once, each one needs about 40 KB of heap
+const int TLS_SESSION_CACHE_SIZE = 16;
+const int TLS_MAX_HANDSHAKES = 2;
+const unsigned long TLS_SLOT_WAIT_MS = 5000;  // for a handshake slot, the service's own timeouts start after it
+const unsigned long TLS_CERT_RECHECK_MS = 86400000;
+// Holds the request first, so never smaller than the longest one a probe can build
+const size_t TLS_HEADER_BUFFER_SIZE = PROBE_REQUEST_SIZE > 768 ? PROBE_REQUEST_SIZE : 768;
+
+struct TlsSessionEntry {
+  int16_t slot;        // -1 when free
+  uint16_t generation;
+  unsigned long lastUsed;
+  mbedtls_ssl_session session;
+};
+
+mbedtls_ssl_config tlsConfig;
+bool tlsReady = false;
+TlsSessionEntry* tlsSessions = NULL;
+SemaphoreHandle_t tlsSessionsMutex = NULL;
+SemaphoreHandle_t tlsHandshakes = NULL;
+
+// Feeds an HTTPS body to the JSON parser, starting with the bytes that came in with the headers and
+// refilling the same buffer from the TLS session. Reads give up at the check's deadline
+class TlsBodyStream : public Stream {
+public:
+  TlsBodyStream(mbedtls_ssl_context& ssl, uint8_t* buffer, size_t size, size_t pos, size_t length, unsigned long deadline)
+    : ssl(ssl), buffer(buffer), size(size), pos(pos), length(length), deadline(deadline), ended(false) {
+    setTimeout(0); // read() waits on its own, Stream would otherwise retry a finished body for a second
+  }
+
+  int read() override;
+  int peek() override;
+  int available() override { return length - pos; }
+  size_t write(uint8_t c) override { return 0; }
+
+private:
+  mbedtls_ssl_context& ssl;
+  uint8_t* buffer;
+  size_t size;
+  size_t pos;
+  size_t length;
+  unsigned long deadline;
+  bool ended;
+};
+
+// DNS cache
+// Every check type resolves through one cache. Lookups send their own A query so the record's TTL is
+// known, and a resolver task refreshes entries once DNS_REFRESH_PERCENT of the TTL has passed, well
+// before they expire. When a refresh fails the last good address keeps being served and the entry is
+// marked stale, a DNS outage shouldn't make every service look down. Hosts that no check has asked
+// for in DNS_IDLE_EVICT_MS are dropped
+const int DNS_CACHE_SIZE = MAX_SERVICES;
+const uint32_t DNS_MIN_TTL_S = 30;
+const uint32_t DNS_MAX_TTL_S = 3600;
+const int DNS_REFRESH_PERCENT = 80;
+const unsigned long DNS_RETRY_MS = 30000;
+const unsigned long DNS_QUERY_TIMEOUT_MS = 2000;
+const unsigned long DNS_IDLE_EVICT_MS = 600000;
+const uint32_t DNS_TASK_STACK_SIZE = 4096;
+
+struct DnsCacheEntry {
+  bool inUse;
+  bool resolved;     // address holds a good answer, possibly a stale one
+  bool stale;        // the last refresh failed
+  char host[MAX_HOST_LENGTH + 1];
+  uint32_t address;  // network byte order
+  unsigned long refreshAt;
+  unsigned long lastUsed;
+};
+
+DnsCacheEntry dnsCache[DNS_CACHE_SIZE];
+portMUX_TYPE dnsCacheLock = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t dnsTaskHandle = NULL;
+
+// Alert pipeline
+// State changes are put on alertQueue without blocking and handled by one sender task, so a slow
+// destination never holds up a check. Events arriving within ALERT_BATCH_WINDOW_MS of each other go
+// out as one message (a switch reboot takes ten services down at once, that should be one alert).
+// Every destination delivers on its own: failures back off from ALERT_RETRY_MIN_MS to
+// ALERT_RETRY_MAX_MS, sends are rate limited with a token bucket, and whatever hasn't been delivered
+// is spooled to LittleFS so it survives a reboot. When ALERT_PENDING_MAX events are waiting the
+// oldest is dropped
+// TLS certificates aren't verified, there is no CA store on the device
+enum AlertDestinationId {
+  ALERT_WEBHOOK,
+  ALERT_NTFY,
+  ALERT_DESTINATION_COUNT
+};
+
+enum AlertState : uint8_t {
+  ALERT_DOWN,
+  ALERT_UP,
+  ALERT_DEGRADED
+};
+
+const int ALERT_QUEUE_LENGTH = 32;
+const int ALERT_PENDING_MAX = 32;
+const int ALERT_BATCH_MAX = 16;
+const unsigned long ALERT_BATCH_WINDOW_MS = 3000;
+const unsigned long ALERT_RETRY_MIN_MS = 5000;
+const unsigned long ALERT_RETRY_MAX_MS = 600000;
+const unsigned long ALERT_OFFLINE_POLL_MS = 5000;
+const uint8_t ALERT_RATE_BURST = 10;
+const unsigned long ALERT_RATE_REFILL_MS = 30000;  // one more send allowed per interval
+const uint16_t ALERT_TIMEOUT_MS = 5000;
+const uint32_t ALERT_TASK_STACK_SIZE = 10240;
+const char* const ALERT_SPOOL_PATH = "/alerts.bin";
+const char* const ALERT_SPOOL_TEMP_PATH = "/alerts.tmp";
+const uint32_t ALERT_SPOOL_MAGIC = 0x31524c41; // "ALR1"
+
+struct AlertEvent {
+  char serviceId[16];
+  char name[48];
+  uint8_t state;
+  char error[48];
+  uint32_t time;      // NTP time, 0 if the clock hadn't synced yet
+};
+
+struct AlertPending {
+  AlertEvent event;
+  uint8_t undelivered;  // one bit per destination
+};
+
+struct AlertDestination {
+  const char* name;
+  const char* url;
+  unsigned long nextAttempt;
+  unsigned long backoffMs;
+  uint8_t tokens;
+  unsigned long refilledAt;
+  uint32_t sent;
+  uint32_t failed;
+};
+
+struct AlertSpoolHeader {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t recordSize;
+  uint32_t crc;
+};
+
+QueueHandle_t alertQueue = NULL;
+TaskHandle_t alertTaskHandle = NULL;
+AlertDestination alertDestinations[ALERT_DESTINATION_COUNT];
+uint8_t alertDestinationMask = 0;
+// Only touched by the sender task
+AlertPending alertPending[ALERT_PENDING_MAX];
+int alertPendingCount = 0;
+std::atomic<uint32_t> alertsDropped(0);
+std::atomic<uint32_t> alertsPendingPublished(0);
+
+// MQTT publisher
+// One task owns the broker connection. Each service has a retained message on
+// <base>/<id>/state that is only republished when its MQTT class changes (down, degraded, or one of the
+// latency bands below), so traffic follows events instead of checks. Home Assistant discovery config
+// is published when a service is added or loaded and removed again with the service
+// The checking side only queues slots, the task reads the published snapshots itself. If the queue
+// overflows, or the broker or Home Assistant comes back, everything is republished
+enum MqttUpdateKind : uint8_t {
+  MQTT_STATE,
+  MQTT_DISCOVERY,
+  MQTT_REMOVE
+};
+
+const int MQTT_QUEUE_LENGTH = MAX_SERVICES * 2;
+const uint32_t MQTT_LATENCY_BANDS_MS[] = { 100, 1000 };  // fast below the first, slow from the last
+const uint8_t MQTT_CLASS_UNKNOWN = 0xFF;
+const unsigned long MQTT_LOOP_MS = 250;
+const unsigned long MQTT_RETRY_MIN_MS = 1000;
+const unsigned long MQTT_RETRY_MAX_MS = 60000;
+const uint16_t MQTT_BUFFER_SIZE = 1024;
+const uint32_t MQTT_TASK_STACK_SIZE = 6144;
+
+struct MqttUpdate {
+  MqttUpdateKind kind;
+  int16_t slot;
+  char serviceId[16];  // MQTT_REMOVE only, the slot may already be reused
+};
+
+QueueHandle_t mqttQueue = NULL;
+TaskHandle_t mqttTaskHandle = NULL;
+std::atomic<bool> mqttResync(false);
+// Last class queued per slot, guarded by servicesMutex
+uint8_t mqttClass[MAX_SERVICES];
+
+// Peer mode
+// Devices sharing PEER_GROUP announce _uptime._udp over mDNS and put themselves on a consistent hash
+// ring (lib/PeerRing). Services are keyed by type, host, port and path, so the same target configured
+// on every device is probed by its primary and secondary only, the other devices skip it. Every
+// PEER_DIGEST_INTERVAL_MS each node sends every peer a UDP digest of the services it probes, 12 bytes
+// a service, and any dashboard shows the merged view with a quorum over the fresh observations: one
+// node failing a service its secondary still reaches is reported as disputed rather than down
+// A peer is also learned from its first digest, and dropped after PEER_TIMEOUT_MS without one, which
+// hands its services to the next node on the ring. Only the primary sends alerts
+const uint16_t PEER_PORT = 47810;
+const int PEER_MAX = PEER_RING_MAX_NODES - 1;
+const unsigned long PEER_DIGEST_INTERVAL_MS = 10000;
+const unsigned long PEER_TIMEOUT_MS = 35000;
+const unsigned long PEER_DISCOVERY_INTERVAL_MS = 60000;
+const unsigned long PEER_OBSERVATION_MAX_AGE_MS = 35000;
+const uint32_t PEER_DIGEST_MAGIC = 0x31445055; // "UPD1"
+const uint32_t PEER_TASK_STACK_SIZE = 6144;
+
+enum PeerRole : uint8_t {
+  PEER_ROLE_STANDALONE,  // peer mode off, no peers, or a benchmark service
+  PEER_ROLE_PRIMARY,
+  PEER_ROLE_SECONDARY,
+  PEER_ROLE_REMOTE       // probed by two other nodes
+};
+const char* const PEER_ROLE_NAMES[] = { "standalone", "primary", "secondary", "remote" };
+
+enum PeerStatus : uint8_t {
+  PEER_STATUS_UP = 1,
+  PEER_STATUS_DEGRADED = 2
+};
+
+struct PeerNode {
+  bool active;
+  uint32_t nodeId;
+  uint32_t address;         // as IPAddress stores it
+  unsigned long lastSeen;   // last digest, or the mDNS answer that introduced it
+  uint32_t digests;
+  char name[24];
+};
+
+// Sent as is, every node runs this firmware on the same architecture
+struct PeerDigestHeader {
+  uint32_t magic;
+  uint32_t group;           // hashServiceId(PEER_GROUP)
+  uint32_t nodeId;
+  uint16_t count;
+  uint16_t reserved;
+};
+
+struct PeerDigestEntry {
+  uint32_t key;
+  uint16_t latencyMs;       // saturates at 65535
+  uint16_t ageS;            // since the sender's last check
+  uint8_t status;           // PeerStatus bits
+  uint8_t reserved[3];
+};
+
+struct PeerObservation {
+  unsigned long checkedAt;  // our millis()
+  uint16_t latencyMs;
+  uint8_t status;
+  bool valid;
+};
+
+const size_t PEER_DIGEST_MAX_SIZE = sizeof(PeerDigestHeader) + MAX_SERVICES * sizeof(PeerDigestEntry);
+
+// All guarded by servicesMutex
+PeerNode peerNodes[PEER_MAX];
+PeerObservation* peerObservations = NULL;   // [slot * PEER_MAX + peer]
+PeerRing peerRing;
+int8_t peerRingNodes[PEER_RING_MAX_NODES];  // ring node -> peerNodes index, -1 for this node
+uint32_t peerNodeId = 0;
+uint32_t peerGroupHash = 0;
+char peerName[24];
+TaskHandle_t peerTaskHandle = NULL;
 
 // prototype declarations
 void initWiFi();
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info);
+unsigned long maintainWiFi();
+uint64_t linkDownMs();
+void sendWiFiStatus(AsyncWebServerRequest* request);
 void initWebServer();
 void initFileSystem();
+void initServiceStorage();
+void* allocCold(size_t size);
+void initCheckWorkers();
+void checkWorkerTask(void* parameter);
+HTTPClient* beginWorkerRequest(CheckTarget& target, const char* path);
+int findServiceSlot(const char* serviceId);
+int addService(const ServiceDefinition& definition, uint8_t flags = 0);
+void removeService(int slot);
+void relinkDependencies();
+ParentReach serviceParentReach(int slot);
+bool releaseDependents(int slot);
+void compileServiceProbe(int slot, const ServiceDefinition& definition);
+StringRef arenaIntern(const char* str);
+void arenaRelease(StringRef ref);
+const char* arenaString(StringRef ref);
+void arenaCompact();
+void publishService(int slot);
+void markListChanged();
+bool readPublishedService(int slot, ServiceSnapshot& out);
+AsyncWebServerResponse* beginChunkedSource(AsyncWebServerRequest* request, const char* contentType,
+  std::shared_ptr<ChunkedSource> source);
+bool refillServiceList(ChunkedSource& source, uint32_t since);
+void pushServiceEvents();
+void serializeServiceSnapshot(const ServiceSnapshot& service, JsonObject obj);
+void fillCheckTarget(int slot, CheckTarget& target);
+bool runCheck(CheckTarget& target);
+void recordCheckResult(int slot, uint16_t generation, bool isUp, const String& error, const CheckTiming& timing);
+uint32_t retryDelayMs(const ServiceState& state, const ServiceConfig& config);
+int latencyBucket(uint32_t us);
+uint32_t latencyBucketUpperUs(int bucket);
+uint32_t latencyPercentile(const ServiceLatency& latency, int percent);
+void sendServiceLatency(AsyncWebServerRequest* request, int slot);
+void initHistory();
+uint32_t historyNow();
+uint32_t hashServiceId(const char* serviceId);
+uint8_t classifyCheckError(const String& error);
+const char* checkErrorName(uint8_t error);
+void recordHistory(int slot, const HistoryRecord& record);
+String historySegmentPath(int segment);
+unsigned long flushHistoryIfDue();
+void flushHistory();
+void replayHistory();
+void sendServiceHistory(AsyncWebServerRequest* request, int slot);
+bool nextHistoryRecord(HistoryCursor& cursor, HistoryRecord& record);
+bool refillHistory(ChunkedSource& source, HistoryCursor& cursor);
+bool refillMetrics(ChunkedSource& source, MetricsCursor& cursor);
+size_t formatServiceMetric(int family, const ServiceSnapshot& service, int line, char* buffer, size_t size);
+size_t formatDeviceMetric(int family, char* buffer, size_t size);
+size_t escapeLabelValue(const char* value, char* buffer, size_t size);
+void dispatchToWorker(const CheckJob& job);
+void initAsyncProbes();
+void initPingEngine();
+void initDnsCache();
+bool resolveCached(const char* host, uint32_t& address);
+bool resolveHost(const char* host, uint32_t& address, String& error);
+bool isDnsStale(const char* host);
+DnsCacheEntry* findDnsEntry(const char* host);
+void storeDnsResult(const char* host, bool ok, uint32_t address, uint32_t ttl);
+void dnsTask(void* parameter);
+bool queryDns(const char* host, uint32_t& address, uint32_t& ttl, String& error);
+bool queryDnsServer(IPAddress server, const char* host, uint32_t& address, uint32_t& ttl, String& error);
+size_t skipDnsName(const uint8_t* packet, size_t length, size_t pos);
+void initAlerts();
+void queueAlert(int slot, AlertState state);
+void alertTask(void* parameter);
+void addPendingAlert(const AlertEvent& event);
+bool deliverPendingAlerts();
+unsigned long nextAlertAttemptMs();
+bool sendAlertBatch(int destination, const AlertEvent* events, int count);
+const char* alertStateName(uint8_t state);
+void saveAlertSpool();
+void loadAlertSpool();
+void initMqtt();
+void queueMqttUpdate(MqttUpdateKind kind, int slot);
+uint8_t mqttClassFor(uint8_t flags, uint32_t totalUs);
+void mqttTask(void* parameter);
+bool connectMqtt(PubSubClient& mqtt);
+void publishMqttDiscovery(PubSubClient& mqtt, const ServiceSnapshot& service);
+void publishMqttState(PubSubClient& mqtt, const ServiceSnapshot& service);
+void clearMqttService(PubSubClient& mqtt, const char* serviceId);
+String mqttDeviceId();
+void initPeers();
+void peerTask(void* parameter);
+bool startPeerAnnouncement();
+void discoverPeers();
+int notePeer(uint32_t nodeId, uint32_t address, const char* name);
+void handlePeerDigest(const uint8_t* packet, size_t length, uint32_t address);
+void sendPeerDigests(int sock);
+void expirePeers();
+void assignPeerRoles();
+uint8_t peerRoleFor(int slot);
+int findPeerServiceSlot(uint32_t key);
+void fillPeerQuorum(int slot, ServiceSnapshot& data);
+void sendPeerStatus(AsyncWebServerRequest* request);
+uint32_t bucketPercentile(const uint32_t* counts, int percent);
+unsigned long sampleHeapIfDue();
+void initPower();
+void powerTickHook();
+void samplePower();
+float estimatedCurrentMa(const PowerWindow& window, bool modemSleep);
+void sendDiagnostics(AsyncWebServerRequest* request);
+void addTaskStack(JsonArray stacks, const char* name, TaskHandle_t handle);
+void startBenchmark(AsyncWebServerRequest* request, const char* body, size_t length);
+unsigned long finishBenchmarkIfDue();
+void serializeBenchmark(JsonObject obj);
+void startBenchmarkServer();
+bool startPing(int slot, uint16_t generation, uint32_t address, uint32_t dnsUs, uint8_t count,
+  uint16_t timeoutMs);
+void pingTask(void* parameter);
+void sendPingEcho(PingProbe& probe);
+void receivePingReplies();
+void finishPingProbe(PingProbe& probe);
+AsyncProbe* claimAsyncProbe(int slot);
+bool launchAsyncProbe(AsyncProbe* probe);
+void releaseAsyncProbe(AsyncProbe* probe);
+void finishAsyncProbe(AsyncProbe* probe, bool isUp, const String& error);
+void handleAsyncProbeData(AsyncProbe* probe, const uint8_t* data, size_t len);
+void handleAsyncProbeLine(AsyncProbe* probe);
+void handleAsyncProbeBody(AsyncProbe* probe, const uint8_t* data, size_t len);
+void completeAsyncProbe(AsyncProbe* probe, AsyncClient* client);
 void loadServices();
-void saveServices();
+bool loadLegacyServices();
+bool saveServices();
+void markConfigDirty();
+unsigned long saveServicesIfDue();
+int writeServiceRecords(ConfigWriter& writer);
+bool parseServiceConfig(const uint8_t* data, size_t length, bool apply);
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length);
+void configWrite(ConfigWriter& writer, const void* value, size_t length);
+void configWriteString(ConfigWriter& writer, const char* value);
+bool configRead(ConfigReader& reader, void* value, size_t length);
+const char* configReadString(ConfigReader& reader);
 String generateServiceId();
-void checkServices();
-bool checkHomeAssistant(Service& service);
-bool checkJellyfin(Service& service);
-bool checkHttpGet(Service& service);
-bool checkPing(Service& service);
-String getWebPage();
+const char* collectRequestBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total,
+  size_t maxSize);
+void sendJsonError(AsyncWebServerRequest* request, int code, const char* message);
+void exportServiceJson(int slot, JsonObject obj);
+bool refillServiceExport(ChunkedSource& source);
+void applyServiceBatch(AsyncWebServerRequest* request, const char* body, size_t length);
+unsigned long checkServices();
+int countChecksInFlight();
+uint32_t worstCaseCheckMs(ServiceType type, uint16_t connectTimeoutMs, uint16_t readTimeoutMs, uint8_t pingCount);
+uint32_t expectedCheckMs(int slot);
+CheckLoad currentCheckLoad(const bool* leaving = NULL);
+uint32_t admitServiceInterval(const ServiceDefinition& definition, CheckLoad& load);
+void spreadInitialSchedule();
+void rebuildSchedule();
+void notifyScheduler();
+bool checkHomeAssistant(CheckTarget& target);
+bool checkJellyfin(CheckTarget& target);
+bool checkHttpGet(CheckTarget& target);
+bool runHttpCheck(CheckTarget& target, const char* path);
+bool acceptsStatus(ServiceType type, const HttpRules& rules, int status);
+bool collectedHeadersMatch(HTTPClient& http, const HttpRules& rules);
+bool checkJsonBody(CheckTarget& target, Stream& body);
+bool checkPing(CheckTarget& target);
+bool checkTcp(CheckTarget& target);
+bool checkTls(CheckTarget& target);
+void initTlsChecks();
+int connectTlsSocket(CheckTarget& target, uint32_t address);
+int tlsSend(void* context, const unsigned char* data, size_t length);
+int tlsRecv(void* context, unsigned char* data, size_t length);
+int tlsRandom(void* context, unsigned char* output, size_t length);
+bool runTlsHandshake(mbedtls_ssl_context& ssl, unsigned long deadline, bool& fullHandshake, String& error);
+bool offerTlsSession(int slot, uint16_t generation, mbedtls_ssl_context& ssl);
+void saveTlsSession(int slot, uint16_t generation, const mbedtls_ssl_context& ssl);
+void storeCertExpiry(int slot, uint16_t generation, const mbedtls_x509_crt* cert);
+uint32_t x509TimeToEpoch(const mbedtls_x509_time& time);
+bool readHttpsResponse(CheckTarget& target, mbedtls_ssl_context& ssl, unsigned long deadline);
 String getServiceTypeString(ServiceType type);
 
 void setup() {
@@ -69,52 +1294,185 @@ void setup() {
   // Initialize filesystem
   initFileSystem();
 
-  // Initialize WiFi
+  // Allocate service storage
+  initServiceStorage();
+  initTokenBucket(checkTokens, CHECK_RATE_PER_SECOND, CHECK_RATE_BURST, millis());
+
+  // Start connecting to WiFi, everything below runs without waiting for it
   initWiFi();
+  initPower();
 
   // Load saved services
   loadServices();
+  spreadInitialSchedule();
+  initHistory();
+
+  // Start check workers, the loop task doubles as the scheduler
+  schedulerTaskHandle = xTaskGetCurrentTaskHandle();
+  initCheckWorkers();
+  initAsyncProbes();
+  initPingEngine();
+  initTlsChecks();
+  initDnsCache();
+  initAlerts();
+  initMqtt();
+  initPeers();
 
   // Initialize web server
   initWebServer();
 
   Serial.println("System ready!");
-  Serial.print("Access web interface at: http://");
-  Serial.println(WiFi.localIP());
 }
 
 void loop() {
-  static unsigned long lastCheckTime = 0;
-  unsigned long currentTime = millis();
-
-  // Check services every 5 seconds
-  if (currentTime - lastCheckTime >= 5000) {
-    checkServices();
-    lastCheckTime = currentTime;
-  }
-
-  delay(10);
+  unsigned long waitMs = checkServices();
+  waitMs = min(waitMs, maintainWiFi());
+  pushServiceEvents();
+  waitMs = min(waitMs, flushHistoryIfDue());
+  waitMs = min(waitMs, saveServicesIfDue());
+  waitMs = min(waitMs, sampleHeapIfDue());
+  waitMs = min(waitMs, finishBenchmarkIfDue());
+
+  // Sleep until the next deadline, a schedule change or a new result wakes us early
+  ulTaskNotifyTake(pdTRUE, waitMs == SCHEDULE_IDLE ? portMAX_DELAY : pdMS_TO_TICKS(waitMs));
 }
 
+// Returns straight away, onWiFiEvent() reports the connection and maintainWiFi() retries if it doesn't come up
 void initWiFi() {
   Serial.println("Connecting to WiFi...");
+  WiFi.onEvent(onWiFiEvent);
   WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);
+  if (LOW_POWER_MODE) {
+    // Minimum modem sleep wakes for every DTIM beacon, the maximum one would skip beacons and drop requests
+    WiFi.setSleep(WIFI_PS_MIN_MODEM);
+  }
+  wifiRetryAt = millis() + WIFI_CONNECT_TIMEOUT_MS;
   WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+}
+
+// Runs on the WiFi event task
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      portENTER_CRITICAL(&wifiLock);
+      if (linkDownOpen) {
+        uint32_t duration = millis() - linkDownSince;
+        linkDownWindows[linkDownNewest].durationMs = max(duration, (uint32_t)1);
+        linkDownTotalMs += duration;
+        linkDownOpen = false;
+      }
+      wifiRetryMs = WIFI_RETRY_MIN_MS;
+      portEXIT_CRITICAL(&wifiLock);
+
+      wifiOnline = true;
+      wifiResumed = true;
+      Serial.printf("WiFi connected, web interface at http://%s\n", WiFi.localIP().toString().c_str());
+      notifyScheduler();
+      break;
+
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP: {
+      uint8_t reason = event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED ? info.wifi_sta_disconnected.reason : 0;
+      bool wasOnline = wifiOnline.exchange(false);
+      // Read outside the critical section, time() takes a lock of its own
+      uint32_t start = historyNow();
+      portENTER_CRITICAL(&wifiLock);
+      if (wasOnline) {
+        linkDownNewest = (linkDownNewest + 1) % LINK_DOWN_WINDOWS;
+        linkDownCount = min(linkDownCount + 1, LINK_DOWN_WINDOWS);
+        linkDownWindows[linkDownNewest].start = start;
+        linkDownWindows[linkDownNewest].durationMs = 0;
+        linkDownOpen = true;
+        linkDownSince = millis();
+        wifiDisconnects++;
+        wifiRetryAt = linkDownSince + wifiRetryMs;
+      }
+      // Every failed retry reports again, the window just keeps the latest reason
+      if (linkDownOpen && reason != 0) {
+        linkDownWindows[linkDownNewest].reason = reason;
+      }
+      portEXIT_CRITICAL(&wifiLock);
+
+      if (wasOnline) {
+        Serial.printf("WiFi lost (reason %d), holding checks until it's back\n", reason);
+        notifyScheduler();
+      }
+      break;
+    }
 
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 30) {
-    delay(1000);
-    Serial.print(".");
-    attempts++;
+    default:
+      break;
   }
+}
 
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("\nWiFi connected!");
-    Serial.print("IP address: ");
-    Serial.println(WiFi.localIP());
-  } else {
-    Serial.println("\nFailed to connect to WiFi!");
+// Called from the loop task, returns how long until the next reconnect attempt
+unsigned long maintainWiFi() {
+  if (wifiOnline) {
+    return SCHEDULE_IDLE;
+  }
+
+  unsigned long now = millis();
+  portENTER_CRITICAL(&wifiLock);
+  long untilRetry = (long)(wifiRetryAt - now);
+  unsigned long retryMs = wifiRetryMs;
+  if (untilRetry <= 0) {
+    wifiRetryAt = now + retryMs;
+    wifiRetryMs = min(retryMs * 2, WIFI_RETRY_MAX_MS);
+  }
+  portEXIT_CRITICAL(&wifiLock);
+
+  if (untilRetry > 0) {
+    return untilRetry;
+  }
+  Serial.printf("Reconnecting to WiFi, next attempt in %lu s\n", retryMs / 1000);
+  WiFi.reconnect();
+  return retryMs;
+}
+
+// Total time spent offline since boot, including the window that is still open
+uint64_t linkDownMs() {
+  portENTER_CRITICAL(&wifiLock);
+  uint64_t total = linkDownTotalMs + (linkDownOpen ? millis() - linkDownSince : 0);
+  portEXIT_CRITICAL(&wifiLock);
+  return total;
+}
+
+void sendWiFiStatus(AsyncWebServerRequest* request) {
+  LinkDownWindow windows[LINK_DOWN_WINDOWS];
+  portENTER_CRITICAL(&wifiLock);
+  int count = linkDownCount;
+  int newest = linkDownNewest;
+  bool open = linkDownOpen;
+  unsigned long since = linkDownSince;
+  uint32_t disconnects = wifiDisconnects;
+  memcpy(windows, linkDownWindows, sizeof(windows));
+  portEXIT_CRITICAL(&wifiLock);
+
+  JsonDocument doc;
+  doc["connected"] = (bool)wifiOnline;
+  if (wifiOnline) {
+    doc["ip"] = WiFi.localIP().toString();
+    doc["rssi"] = WiFi.RSSI();
   }
+  doc["disconnects"] = disconnects;
+  doc["linkDownSeconds"] = linkDownMs() / 1000;
+
+  // Newest first
+  JsonArray list = doc["linkDown"].to<JsonArray>();
+  for (int i = 0; i < count; i++) {
+    const LinkDownWindow& window = windows[(newest - i + LINK_DOWN_WINDOWS) % LINK_DOWN_WINDOWS];
+    bool ongoing = open && i == 0;
+    JsonObject entry = list.add<JsonObject>();
+    entry["start"] = window.start;
+    entry["durationSeconds"] = (ongoing ? millis() - since : window.durationMs) / 1000;
+    entry["ongoing"] = ongoing;
+    entry["reason"] = window.reason;
+  }
+
+  String response;
+  serializeJson(doc, response);
+  request->send(200, "application/json", response);
 }
 
 void initFileSystem() {
@@ -125,96 +1483,185 @@ void initFileSystem() {
   Serial.println("LittleFS mounted successfully");
 }
 
+void initCheckWorkers() {
+  checkQueue = xQueueCreate(MAX_SERVICES, sizeof(CheckJob));
+
+  for (int i = 0; i < CHECK_WORKER_COUNT; i++) {
+    char taskName[16];
+    snprintf(taskName, sizeof(taskName), "check%d", i);
+    xTaskCreatePinnedToCore(checkWorkerTask, taskName, CHECK_WORKER_STACK_SIZE, NULL,
+      CHECK_WORKER_PRIORITY, &checkWorkerHandles[i], i % 2);
+  }
+
+  Serial.printf("Started %d check workers\n", CHECK_WORKER_COUNT);
+}
+
 void initWebServer() {
 
+  // Dashboard, served straight from flash as the pre-gzipped bytes generated by scripts/build_web.py
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(200, "text/html", getWebPage());
+    HandlerTimer timer(ROUTE_DASHBOARD);
+    if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == WEB_PAGE_ETAG) {
+      AsyncWebServerResponse *response = request->beginResponse(304);
+      response->addHeader("ETag", WEB_PAGE_ETAG);
+      request->send(response);
+      return;
+    }
+
+    AsyncWebServerResponse *response = request->beginResponse(200, "text/html", WEB_PAGE_GZ, WEB_PAGE_GZ_LEN);
+    response->addHeader("Content-Encoding", "gzip");
+    response->addHeader("ETag", WEB_PAGE_ETAG);
+    // Always revalidate, an unchanged page costs a 304 with no body
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response);
   });
 
-  // get services
-  server.on("/api/services", HTTP_GET, [](AsyncWebServerRequest *request) {
-    JsonDocument doc;
-    JsonArray array = doc["services"].to<JsonArray>();
+  // Streamed export in the batch import format, one service per chunk
+  server.on("/api/services/export", HTTP_GET, [](AsyncWebServerRequest *request) {
+    std::shared_ptr<ChunkedSource> source = std::make_shared<ChunkedSource>();
+    source->length = strlcpy(source->scratch, "[", sizeof(source->scratch));
+    source->refill = [](ChunkedSource& source) {
+      return refillServiceExport(source);
+    };
+    request->send(beginChunkedSource(request, "application/json", source));
+  });
 
-    unsigned long currentTime = millis();
+  // Registered first, "/api/services" would otherwise match these paths too
+  server.on("/api/services/*", HTTP_GET, [](AsyncWebServerRequest *request) {
+    String path = request->url().substring(strlen("/api/services/"));
+    int separator = path.indexOf('/');
+    String serviceId = separator >= 0 ? path.substring(0, separator) : path;
+    String action = separator >= 0 ? path.substring(separator + 1) : "";
 
-    for (int i = 0; i < serviceCount; i++) {
-      if (services[i].lastCheck > 0) {
-        services[i].secondsSinceLastCheck = (currentTime - services[i].lastCheck) / 1000;
-      } else {
-        services[i].secondsSinceLastCheck = -1; // Never checked
-      }
+    if (action != "latency" && action != "history") {
+      request->send(404, "application/json", "{\"error\":\"Not found\"}");
+      return;
+    }
 
-      JsonObject obj = array.add<JsonObject>();
-      obj["id"] = services[i].id;
-      obj["name"] = services[i].name;
-      obj["type"] = getServiceTypeString(services[i].type);
-      obj["host"] = services[i].host;
-      obj["port"] = services[i].port;
-      obj["path"] = services[i].path;
-      obj["expectedResponse"] = services[i].expectedResponse;
-      obj["checkInterval"] = services[i].checkInterval;
-      obj["isUp"] = services[i].isUp;
-      obj["secondsSinceLastCheck"] = services[i].secondsSinceLastCheck;
-      obj["lastError"] = services[i].lastError;
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    int slot = findServiceSlot(serviceId.c_str());
+    if (slot == -1) {
+      xSemaphoreGive(servicesMutex);
+      request->send(404, "application/json", "{\"error\":\"Service not found\"}");
+      return;
+    }
+    if (action == "latency") {
+      sendServiceLatency(request, slot);
+    } else {
+      sendServiceHistory(request, slot);
     }
+    xSemaphoreGive(servicesMutex);
+  });
 
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+  // get services
+  // Streamed one service at a time from the published copies, peak memory doesn't grow with the service count
+  // ?since=<version> returns only services published after that version, unless a service was added or
+  // deleted since, in which case the full list comes back with "full":true
+  server.on("/api/services", HTTP_GET, [](AsyncWebServerRequest *request) {
+    HandlerTimer timer(ROUTE_LIST);
+    uint32_t version = stateVersion.load(std::memory_order_acquire);
+    uint32_t currentListVersion = listVersion.load(std::memory_order_acquire);
+    uint32_t since = 0;
+    if (request->hasParam("since")) {
+      since = strtoul(request->getParam("since")->value().c_str(), NULL, 10);
+    }
+    if (since < currentListVersion || since > version) {
+      since = 0;
+    }
+
+    // Projected from the intervals and check durations, inFlight and deferred are what the scheduler sees now
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    CheckLoad load = currentCheckLoad();
+    int inFlight = countChecksInFlight();
+    xSemaphoreGive(servicesMutex);
+
+    std::shared_ptr<ChunkedSource> source = std::make_shared<ChunkedSource>();
+    source->length = snprintf(source->scratch, sizeof(source->scratch),
+      "{\"version\":%lu,\"full\":%s,\"utilisation\":{\"checksPerSecond\":%.2f,\"rateBudget\":%d,"
+      "\"connections\":%.2f,\"connectionBudget\":%d,\"inFlight\":%d,\"deferred\":%lu},\"services\":[",
+      (unsigned long)version, since == 0 ? "true" : "false", load.checksPerSecond, CHECK_RATE_PER_SECOND,
+      load.concurrency, MAX_CHECKS_IN_FLIGHT, inFlight, (unsigned long)checksDeferred);
+    source->refill = [since](ChunkedSource& source) {
+      return refillServiceList(source, since);
+    };
+    request->send(beginChunkedSource(request, "application/json", source));
   });
 
+  // Batch import, registered first since "/api/services" would otherwise match it
+  // Takes an array of services to add, or {"add":[...],"delete":[ids]}. An added service that carries
+  // the id of an existing one replaces it. Everything is applied under one lock with a single save,
+  // and nothing is applied if any entry is rejected
+  server.on("/api/services/batch", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      const char* body = collectRequestBody(request, data, len, index, total, MAX_BATCH_BODY_SIZE);
+      if (body == NULL) {
+        return;
+      }
+      applyServiceBatch(request, body, total);
+    }
+  );
+
   // add service
   server.on("/api/services", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
     [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
-      if (serviceCount >= MAX_SERVICES) {
-        request->send(400, "application/json", "{\"error\":\"Maximum services reached\"}");
+      const char* body = collectRequestBody(request, data, len, index, total, MAX_SERVICE_BODY_SIZE);
+      if (body == NULL) {
         return;
       }
+      HandlerTimer timer(ROUTE_ADD);
 
       JsonDocument doc;
-      DeserializationError error = deserializeJson(doc, data, len);
+      DeserializationError error = deserializeJson(doc, body, total);
 
       if (error) {
         request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
         return;
       }
 
-      Service newService;
-      newService.id = generateServiceId();
-      newService.name = doc["name"].as<String>();
-
-      String typeStr = doc["type"].as<String>();
-      if (typeStr == "home_assistant") {
-        newService.type = TYPE_HOME_ASSISTANT;
-      } else if (typeStr == "jellyfin") {
-        newService.type = TYPE_JELLYFIN;
-      } else if (typeStr == "http_get") {
-        newService.type = TYPE_HTTP_GET;
-      } else if (typeStr == "ping") {
-        newService.type = TYPE_PING;
-      } else {
-        request->send(400, "application/json", "{\"error\":\"Invalid service type\"}");
+      String serviceId = generateServiceId();
+      ServiceDefinition definition;
+      const char* invalid = parseServiceJson(doc.as<JsonObjectConst>(), definition);
+      if (invalid != NULL) {
+        sendJsonError(request, 400, invalid);
         return;
       }
+      definition.id = serviceId.c_str();
+      uint32_t requestedInterval = definition.checkInterval;
+
+      xSemaphoreTake(servicesMutex, portMAX_DELAY);
+      CheckLoad load = currentCheckLoad();
+      definition.checkInterval = admitServiceInterval(definition, load);
+      if (definition.checkInterval == 0) {
+        xSemaphoreGive(servicesMutex);
+        sendJsonError(request, 503, "Check budget exhausted");
+        return;
+      }
+      int slot = addService(definition);
+      if (slot >= 0) {
+        // Check it straight away
+        serviceState[slot].nextCheckDue = millis();
+        rebuildSchedule();
+        markConfigDirty();
+      }
+      xSemaphoreGive(servicesMutex);
 
-      newService.host = doc["host"].as<String>();
-      newService.port = doc["port"] | 80;
-      newService.path = doc["path"] | "/";
-      newService.expectedResponse = doc["expectedResponse"] | "*";
-      newService.checkInterval = doc["checkInterval"] | 60;
-      newService.isUp = false;
-      newService.lastCheck = 0;
-      newService.lastUptime = 0;
-      newService.lastError = "";
-      newService.secondsSinceLastCheck = -1;
-
-      services[serviceCount++] = newService;
-      saveServices();
+      if (slot == ADD_SERVICE_FULL) {
+        request->send(400, "application/json", "{\"error\":\"Maximum services reached\"}");
+        return;
+      }
+      if (slot == ADD_SERVICE_NO_STRING_SPACE) {
+        request->send(400, "application/json", "{\"error\":\"Service storage full\"}");
+        return;
+      }
+      notifyScheduler();
 
       JsonDocument response;
       response["success"] = true;
-      response["id"] = newService.id;
+      response["id"] = serviceId;
+      if (definition.checkInterval != requestedInterval) {
+        // Stretched to fit the check budget
+        response["checkInterval"] = definition.checkInterval;
+      }
 
       String responseStr;
       serializeJson(response, responseStr);
@@ -224,32 +1671,94 @@ void initWebServer() {
 
   // delete service
   server.on("/api/services/*", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+    HandlerTimer timer(ROUTE_DELETE);
     String path = request->url();
     String serviceId = path.substring(path.lastIndexOf('/') + 1);
 
-    int foundIndex = -1;
-    for (int i = 0; i < serviceCount; i++) {
-      if (services[i].id == serviceId) {
-        foundIndex = i;
-        break;
-      }
-    }
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    int slot = findServiceSlot(serviceId.c_str());
 
-    if (foundIndex == -1) {
+    if (slot == -1) {
+      xSemaphoreGive(servicesMutex);
       request->send(404, "application/json", "{\"error\":\"Service not found\"}");
       return;
     }
 
-    // Shift services array
-    for (int i = foundIndex; i < serviceCount - 1; i++) {
-      services[i] = services[i + 1];
+    // The slot goes back on the free list, nothing else moves
+    removeService(slot);
+    rebuildSchedule();
+
+    markConfigDirty();
+    xSemaphoreGive(servicesMutex);
+    notifyScheduler();
+    request->send(200, "application/json", "{\"success\":true}");
+  });
+
+  server.on("/api/wifi", HTTP_GET, [](AsyncWebServerRequest *request) {
+    sendWiFiStatus(request);
+  });
+
+  server.on("/api/peers", HTTP_GET, [](AsyncWebServerRequest *request) {
+    sendPeerStatus(request);
+  });
+
+  // Benchmark, registered before "/api/diagnostics" which would match it too
+  // POST {"services":N,"interval":seconds,"duration":seconds} starts a run, DELETE ends it early and GET
+  // returns the running or last result
+  server.on("/api/diagnostics/benchmark", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonDocument doc;
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    serializeBenchmark(doc.to<JsonObject>());
+    xSemaphoreGive(servicesMutex);
+    String response;
+    serializeJson(doc, response);
+    request->send(200, "application/json", response);
+  });
+
+  server.on("/api/diagnostics/benchmark", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      const char* body = collectRequestBody(request, data, len, index, total, MAX_SERVICE_BODY_SIZE);
+      if (body == NULL) {
+        return;
+      }
+      startBenchmark(request, body, total);
     }
-    serviceCount--;
+  );
 
-    saveServices();
+  server.on("/api/diagnostics/benchmark", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    bool running = benchmark.running;
+    benchmark.endsMs = millis();
+    xSemaphoreGive(servicesMutex);
+    if (!running) {
+      request->send(404, "application/json", "{\"error\":\"No benchmark running\"}");
+      return;
+    }
+    notifyScheduler();
     request->send(200, "application/json", "{\"success\":true}");
   });
 
+  server.on("/api/diagnostics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    sendDiagnostics(request);
+  });
+
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    std::shared_ptr<MetricsCursor> cursor = std::make_shared<MetricsCursor>();
+    cursor->family = 0;
+    cursor->slot = 0;
+    cursor->line = 0;
+    cursor->headerWritten = false;
+
+    std::shared_ptr<ChunkedSource> source = std::make_shared<ChunkedSource>();
+    source->length = 0;
+    source->refill = [cursor](ChunkedSource& source) {
+      return refillMetrics(source, *cursor);
+    };
+    request->send(beginChunkedSource(request, "text/plain; version=0.0.4", source));
+  });
+
+  server.addHandler(&events);
+
   server.begin();
   Serial.println("Web server started");
 }
@@ -258,722 +1767,5026 @@ String generateServiceId() {
   return String(millis()) + String(random(1000, 9999));
 }
 
-void checkServices() {
-  unsigned long currentTime = millis();
-
-  for (int i = 0; i < serviceCount; i++) {
-    // Check if it's time to check this service
-    if (currentTime - services[i].lastCheck < services[i].checkInterval * 1000) {
-      continue;
-    }
-
-    services[i].lastCheck = currentTime;
-    bool wasUp = services[i].isUp;
-
-    switch (services[i].type) {
-      case TYPE_HOME_ASSISTANT:
-        services[i].isUp = checkHomeAssistant(services[i]);
-        break;
-      case TYPE_JELLYFIN:
-        services[i].isUp = checkJellyfin(services[i]);
-        break;
-      case TYPE_HTTP_GET:
-        services[i].isUp = checkHttpGet(services[i]);
-        break;
-      case TYPE_PING:
-        services[i].isUp = checkPing(services[i]);
-        break;
+// Returns the whole NUL terminated body once the last piece is in, NULL until then or after an error was sent
+const char* collectRequestBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total,
+    size_t maxSize) {
+  if (index == 0) {
+    if (total > maxSize) {
+      request->send(413, "application/json", "{\"error\":\"Request body too large\"}");
+      return NULL;
     }
-
-    if (services[i].isUp) {
-      services[i].lastUptime = currentTime;
-      services[i].lastError = "";
+    request->_tempObject = malloc(total + 1);
+    if (request->_tempObject == NULL) {
+      request->send(503, "application/json", "{\"error\":\"Out of memory\"}");
+      return NULL;
     }
+  }
 
-    // Log status changes
-    if (wasUp != services[i].isUp) {
-      Serial.printf("Service '%s' is now %s\n",
-        services[i].name.c_str(),
-        services[i].isUp ? "UP" : "DOWN");
-    }
+  char* body = (char*)request->_tempObject;
+  if (body == NULL || index + len > total) {
+    return NULL;
   }
+  memcpy(body + index, data, len);
+  if (index + len < total) {
+    return NULL;
+  }
+  body[total] = '\0';
+  return body;
 }
 
-// technically just detectes any endpoint, so would be good to support auth and check if it's actually home assistant
-// could parse /api/states or something to check there are valid entities and that it's actually HA
-bool checkHomeAssistant(Service& service) {
-  HTTPClient http;
-  String url = "http://" + service.host + ":" + String(service.port) + "/api/";
+void sendJsonError(AsyncWebServerRequest* request, int code, const char* message) {
+  JsonDocument doc;
+  doc["error"] = message;
+  String response;
+  serializeJson(doc, response);
+  request->send(code, "application/json", response);
+}
 
-  http.begin(url);
-  http.setTimeout(5000);
+// Called with servicesMutex held
+void exportServiceJson(int slot, JsonObject obj) {
+  const ServiceConfig& config = serviceConfig[slot];
+  ServiceDefinition definition;
+  definition.id = config.id;
+  definition.name = arenaString(config.name);
+  definition.type = (ServiceType)serviceState[slot].type;
+  definition.host = arenaString(config.host);
+  definition.port = config.port;
+  definition.path = arenaString(config.path);
+  definition.expectedResponse = arenaString(config.expectedResponse);
+  definition.rules = arenaString(config.rules);
+  definition.authToken = arenaString(config.authToken);
+  definition.parent = config.parent;
+  definition.group = arenaString(config.group);
+  definition.checkInterval = serviceState[slot].intervalMs / 1000;
+  definition.maxScanBytes = config.maxScanBytes;
+  definition.degradedMs = config.degradedMs;
+  definition.confirmChecks = config.confirmChecks;
+  definition.retryInterval = config.retryInterval;
+  definition.maxBackoff = config.maxBackoff;
+  definition.connectTimeoutMs = config.connectTimeoutMs;
+  definition.readTimeoutMs = config.readTimeoutMs;
+  definition.pingCount = config.pingCount;
+  serializeServiceDefinition(definition, obj);
+}
 
-  int httpCode = http.GET();
-  bool isUp = false;
+// One service per call, the lock is only held while that one is copied out
+bool refillServiceExport(ChunkedSource& source) {
+  if (source.cursor < 0) {
+    return false;
+  }
 
-  if (httpCode > 0) {
-      // HA returns 404 for /api/, but ANY positive HTTP status means the service is alive
-      isUp = true;
-  } else {
-      service.lastError = "Connection failed: " + String(httpCode);
+  JsonDocument doc;
+  bool found = false;
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  while (source.cursor < MAX_SERVICES && !found) {
+    if ((serviceState[source.cursor].flags & (SERVICE_IN_USE | SERVICE_BENCHMARK)) == SERVICE_IN_USE) {
+      exportServiceJson(source.cursor, doc.to<JsonObject>());
+      found = true;
+    }
+    source.cursor++;
   }
+  xSemaphoreGive(servicesMutex);
 
-  http.end();
-  return isUp;
-}
+  if (!found) {
+    source.length = strlcpy(source.scratch, "]", sizeof(source.scratch));
+    source.cursor = -1;
+    return true;
+  }
 
-bool checkJellyfin(Service& service) {
-  HTTPClient http;
-  String url = "http://" + service.host + ":" + String(service.port) + "/health";
+  size_t offset = 0;
+  if (source.emitted > 0) {
+    source.scratch[offset++] = ',';
+  }
+  source.length = offset + serializeJson(doc, source.scratch + offset, sizeof(source.scratch) - offset);
+  source.emitted++;
+  return true;
+}
 
-  http.begin(url);
-  http.setTimeout(5000);
+void applyServiceBatch(AsyncWebServerRequest* request, const char* body, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, body, length)) {
+    request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+    return;
+  }
 
-  int httpCode = http.GET();
-  bool isUp = false;
+  JsonArrayConst additions = doc.is<JsonArrayConst>() ? doc.as<JsonArrayConst>() : doc["add"].as<JsonArrayConst>();
+  JsonArrayConst deletions = doc["delete"].as<JsonArrayConst>();
+  int addCount = additions.size();
+  int deleteCount = deletions.size();
+  if (addCount > MAX_SERVICES || deleteCount > MAX_SERVICES) {
+    request->send(400, "application/json", "{\"error\":\"Too many services in batch\"}");
+    return;
+  }
+
+  // Parse and validate everything before touching the service list
+  std::unique_ptr<ServiceDefinition[]> definitions(new ServiceDefinition[max(addCount, 1)]);
+  std::unique_ptr<String[]> ids(new String[max(addCount, 1)]);
+  int i = 0;
+  for (JsonObjectConst obj : additions) {
+    const char* invalid = parseServiceJson(obj, definitions[i]);
+    if (invalid != NULL) {
+      sendJsonError(request, 400, (String("Service ") + i + ": " + invalid).c_str());
+      return;
+    }
+    ids[i] = obj["id"] | "";
+    if (ids[i].length() >= sizeof(ServiceConfig::id)) {
+      sendJsonError(request, 400, (String("Service ") + i + ": id too long").c_str());
+      return;
+    }
+    for (int j = 0; j < i && ids[i].length() > 0; j++) {
+      if (ids[j] == ids[i]) {
+        sendJsonError(request, 400, (String("Service ") + i + ": duplicate id").c_str());
+        return;
+      }
+    }
+    // Replacing a service and deleting it in the same batch would delete the replacement too
+    for (JsonVariantConst id : deletions) {
+      if (ids[i].length() > 0 && ids[i] == (id | "")) {
+        sendJsonError(request, 400, (String("Service ") + i + ": also listed for deletion").c_str());
+        return;
+      }
+    }
+    i++;
+  }
+
+  int16_t added[MAX_SERVICES];
+  int16_t replaced[MAX_SERVICES];
+  int addedCount = 0;
+  int replacedCount = 0;
+  const char* failure = NULL;
+  int failureCode = 400;
+  // Services the batch replaces or deletes don't count against the budget the new entries are admitted to
+  bool leaving[MAX_SERVICES] = {};
+
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  for (JsonVariantConst id : deletions) {
+    int slot = findServiceSlot(id | "");
+    if (slot < 0) {
+      failure = "Service to delete not found";
+      break;
+    }
+    leaving[slot] = true;
+  }
+  if (failure == NULL && addCount > freeSlotCount) {
+    failure = "Maximum services reached";
+  }
+  for (i = 0; i < addCount && failure == NULL; i++) {
+    int slot = ids[i].length() > 0 ? findServiceSlot(ids[i].c_str()) : -1;
+    if (slot >= 0) {
+      leaving[slot] = true;
+    }
+  }
+  CheckLoad load = currentCheckLoad(leaving);
+
+  // New entries go in first next to the ones they replace, so a failure can be undone by removing them again
+  unsigned long now = millis();
+  for (i = 0; i < addCount && failure == NULL; i++) {
+    if (ids[i].length() > 0) {
+      int existing = findServiceSlot(ids[i].c_str());
+      if (existing >= 0) {
+        replaced[replacedCount++] = existing;
+      }
+    } else {
+      do {
+        ids[i] = generateServiceId();
+      } while (findServiceSlot(ids[i].c_str()) >= 0);
+    }
 
-  if (httpCode > 0) {
-    if (httpCode == 200) {
-      isUp = true;
+    definitions[i].checkInterval = admitServiceInterval(definitions[i], load);
+    if (definitions[i].checkInterval == 0) {
+      failure = "Check budget exhausted";
+      failureCode = 503;
+      break;
+    }
+    definitions[i].id = ids[i].c_str();
+    int slot = addService(definitions[i]);
+    if (slot < 0) {
+      failure = slot == ADD_SERVICE_FULL ? "Maximum services reached" : "Service storage full";
+      break;
+    }
+    // Staggered a little so a large import doesn't fire every check at once
+    serviceState[slot].nextCheckDue = now + addedCount * 100;
+    added[addedCount++] = slot;
+  }
+
+  if (failure != NULL) {
+    for (int j = addedCount - 1; j >= 0; j--) {
+      removeService(added[j]);
     }
   } else {
-    service.lastError = "Connection failed: " + String(httpCode);
+    for (int j = 0; j < replacedCount; j++) {
+      removeService(replaced[j]);
+    }
+    for (JsonVariantConst id : deletions) {
+      int slot = findServiceSlot(id | "");
+      if (slot >= 0) {
+        removeService(slot);
+      }
+    }
+    rebuildSchedule();
+    markConfigDirty();
   }
+  xSemaphoreGive(servicesMutex);
 
-  http.end();
-  return isUp;
+  if (failure != NULL) {
+    sendJsonError(request, failureCode, failure);
+    return;
+  }
+  notifyScheduler();
+
+  JsonDocument response;
+  response["success"] = true;
+  JsonArray addedIds = response["added"].to<JsonArray>();
+  // The interval each entry was admitted with, longer than asked for when the budget is tight
+  JsonArray intervals = response["checkIntervals"].to<JsonArray>();
+  for (i = 0; i < addCount; i++) {
+    addedIds.add(ids[i]);
+    intervals.add(definitions[i].checkInterval);
+  }
+  response["replaced"] = replacedCount;
+  response["deleted"] = deleteCount;
+
+  String responseStr;
+  serializeJson(response, responseStr);
+  request->send(200, "application/json", responseStr);
 }
 
-bool checkHttpGet(Service& service) {
-  HTTPClient http;
-  String url = "http://" + service.host + ":" + String(service.port) + service.path;
+void* allocCold(size_t size) {
+  if (psramFound()) {
+    void* memory = ps_calloc(1, size);
+    if (memory != NULL) {
+      return memory;
+    }
+  }
+  return calloc(1, size);
+}
 
-  http.begin(url);
-  http.setTimeout(5000);
+void initServiceStorage() {
+  servicesMutex = xSemaphoreCreateMutex();
+
+  serviceConfig = (ServiceConfig*)allocCold(sizeof(ServiceConfig) * MAX_SERVICES);
+  serviceLatency = (ServiceLatency*)allocCold(sizeof(ServiceLatency) * MAX_SERVICES);
+  serviceHistory = (ServiceHistory*)allocCold(sizeof(ServiceHistory) * MAX_SERVICES);
+  serviceCounters = (ServiceCounters*)allocCold(sizeof(ServiceCounters) * MAX_SERVICES);
+  serviceProbes = (ServiceProbe*)allocCold(sizeof(ServiceProbe) * MAX_SERVICES);
+  serviceLag = (ServiceLag*)allocCold(sizeof(ServiceLag) * MAX_SERVICES);
+  historyBlock = (uint8_t*)allocCold(HISTORY_BLOCK_SIZE);
+  publishedServices = (ServiceSnapshot*)allocCold(sizeof(ServiceSnapshot) * MAX_SERVICES);
+  publishStaging = (ServiceSnapshot*)allocCold(sizeof(ServiceSnapshot));
+  arenaPool = (char*)allocCold(STRING_ARENA_SIZE);
+  arenaEntries = (ArenaEntry*)allocCold(sizeof(ArenaEntry) * STRING_ARENA_ENTRIES);
+
+  // Hand out low slots first so the list keeps its order until something is deleted
+  freeSlotCount = 0;
+  for (int slot = MAX_SERVICES - 1; slot >= 0; slot--) {
+    freeSlots[freeSlotCount++] = slot;
+    serviceState[slot].parentSlot = NO_PARENT;
+  }
 
-  int httpCode = http.GET();
-  bool isUp = false;
+  Serial.printf("Service storage ready for %d services (%s)\n", MAX_SERVICES, psramFound() ? "PSRAM" : "internal RAM");
+}
 
-  if (httpCode > 0) {
-    if (httpCode == 200) {
-      if (service.expectedResponse == "*") {
-        isUp = true;
-      } else {
-        String payload = http.getString();
-        isUp = payload.indexOf(service.expectedResponse) >= 0;
-        if (!isUp) {
-          service.lastError = "Response mismatch";
-        }
-      }
-    } else {
-      service.lastError = "HTTP " + String(httpCode);
+int findServiceSlot(const char* serviceId) {
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if ((serviceState[slot].flags & SERVICE_IN_USE) && strcmp(serviceConfig[slot].id, serviceId) == 0) {
+      return slot;
     }
-  } else {
-    service.lastError = "Connection failed: " + String(httpCode);
   }
+  return -1;
+}
 
-  http.end();
-  return isUp;
+// Called with servicesMutex held, returns the new slot or one of the ADD_SERVICE_ failures
+int addService(const ServiceDefinition& definition, uint8_t flags) {
+  if (freeSlotCount == 0) {
+    return ADD_SERVICE_FULL;
+  }
+
+  StringRef name = arenaIntern(definition.name);
+  StringRef host = arenaIntern(definition.host);
+  StringRef path = arenaIntern(definition.path);
+  StringRef expectedResponse = arenaIntern(definition.expectedResponse);
+  StringRef rules = arenaIntern(definition.rules);
+  StringRef authToken = arenaIntern(definition.authToken);
+  StringRef group = arenaIntern(definition.group);
+  if (name == ARENA_FULL || host == ARENA_FULL || path == ARENA_FULL || expectedResponse == ARENA_FULL ||
+      rules == ARENA_FULL || authToken == ARENA_FULL || group == ARENA_FULL) {
+    arenaRelease(name);
+    arenaRelease(host);
+    arenaRelease(path);
+    arenaRelease(expectedResponse);
+    arenaRelease(rules);
+    arenaRelease(authToken);
+    arenaRelease(group);
+    return ADD_SERVICE_NO_STRING_SPACE;
+  }
+
+  int slot = freeSlots[--freeSlotCount];
+  ServiceConfig& config = serviceConfig[slot];
+  strlcpy(config.id, definition.id, sizeof(config.id));
+  config.name = name;
+  config.host = host;
+  config.path = path;
+  config.expectedResponse = expectedResponse;
+  config.rules = rules;
+  config.authToken = authToken;
+  config.group = group;
+  strlcpy(config.parent, definition.parent, sizeof(config.parent));
+  config.port = definition.port;
+  config.maxScanBytes = definition.maxScanBytes > 0 ? definition.maxScanBytes : DEFAULT_MAX_SCAN_BYTES;
+  config.degradedMs = definition.degradedMs;
+  config.confirmChecks = min(definition.confirmChecks, MAX_CONFIRM_CHECKS);
+  config.retryInterval = max(definition.retryInterval, (uint16_t)1);
+  config.maxBackoff = definition.maxBackoff;
+  config.connectTimeoutMs = definition.connectTimeoutMs;
+  config.readTimeoutMs = definition.readTimeoutMs;
+  config.pingCount = min(definition.pingCount, MAX_PING_COUNT);
+  config.certExpiry = 0;
+  config.certCheckedMs = 0;
+  memset(&serviceLatency[slot], 0, sizeof(ServiceLatency));
+  memset(&serviceHistory[slot], 0, sizeof(ServiceHistory));
+  memset(&serviceCounters[slot], 0, sizeof(ServiceCounters));
+  serviceHistory[slot].serviceHash = hashServiceId(definition.id);
+  config.lastError[0] = '\0';
+  compileServiceProbe(slot, definition);
+
+  ServiceState& state = serviceState[slot];
+  state.intervalMs = max(definition.checkInterval, (uint32_t)1) * 1000;
+  state.nextCheckDue = 0;
+  state.lastCheck = 0;
+  state.lastUptime = 0;
+  state.failures = 0;
+  state.type = definition.type;
+  state.flags = SERVICE_IN_USE | flags;
+  serviceCount++;
+  memset(&serviceLag[slot], 0, sizeof(ServiceLag));
+  config.peerKey = peerServiceKey(definition.type, definition.host, definition.port, definition.path);
+  if (peerObservations != NULL) {
+    memset(&peerObservations[slot * PEER_MAX], 0, sizeof(PeerObservation) * PEER_MAX);
+  }
+  state.peerRole = peerRoleFor(slot);
+  relinkDependencies();
+
+  publishService(slot);
+  markListChanged();
+  mqttClass[slot] = MQTT_CLASS_UNKNOWN;
+  queueMqttUpdate(MQTT_DISCOVERY, slot);
+  return slot;
 }
 
-bool checkPing(Service& service) {
-  bool success = Ping.ping(service.host.c_str(), 3);
-  if (!success) {
-    service.lastError = "Ping timeout";
+// Called with servicesMutex held from addService(). Every caller has run checkServiceLengths(), the
+// request is still clamped to the buffer so nothing can be written past it
+void compileServiceProbe(int slot, const ServiceDefinition& definition) {
+  ServiceProbe& probe = serviceProbes[slot];
+
+  const char* path = definition.path;
+  const char* expectedResponse = "";
+  const char* rules = definition.rules;
+  switch (definition.type) {
+    case TYPE_HOME_ASSISTANT:
+      probe.check = checkHomeAssistant;
+      path = "/api/";
+      // With a token the API itself can answer, so check that it does instead of accepting any status
+      if (rules[0] == '\0' && definition.authToken[0] != '\0') {
+        rules = HOME_ASSISTANT_TOKEN_RULES;
+      }
+      break;
+    case TYPE_JELLYFIN:
+      probe.check = checkJellyfin;
+      path = "/health";
+      break;
+    case TYPE_HTTP_GET:
+    case TYPE_HTTPS:
+      probe.check = definition.type == TYPE_HTTPS ? checkTls : checkHttpGet;
+      // "*" accepts any body, it compiles to an empty pattern
+      if (strcmp(definition.expectedResponse, "*") != 0) {
+        expectedResponse = definition.expectedResponse;
+      }
+      break;
+    case TYPE_TCP:
+      probe.check = checkTcp;
+      break;
+    case TYPE_TLS:
+      probe.check = checkTls;
+      break;
+    default:
+      probe.check = checkPing;
+      break;
+  }
+
+  const size_t room = sizeof(probe.request) - 1;
+  size_t length = min((size_t)snprintf(probe.request, sizeof(probe.request), "GET %s HTTP/1.1\r\nHost: %s\r\n", path,
+    definition.host), room);
+  if (definition.authToken[0] != '\0') {
+    length = min(length + snprintf(probe.request + length, sizeof(probe.request) - length,
+      "Authorization: Bearer %s\r\n", definition.authToken), room);
+  }
+  length = min(length + snprintf(probe.request + length, sizeof(probe.request) - length,
+    "Connection: keep-alive\r\n\r\n"), room);
+  probe.requestLength = length;
+  initResponseMatcher(probe.matcher, expectedResponse);
+  // parseServiceJson() has already compiled rules from the API once, records loaded by
+  // parseServiceConfig() never went through it, so a record that doesn't compile checks without rules
+  if (compileCheckRules(rules, probe.rules) != NULL) {
+    Serial.printf("Ignoring invalid check rules of service '%s'\n", definition.name);
+    memset(&probe.rules, 0, sizeof(probe.rules));
   }
-  return success;
 }
 
-void saveServices() {
-  File file = LittleFS.open("/services.json", "w");
-  if (!file) {
-    Serial.println("Failed to open services.json for writing");
-    return;
+// Called with servicesMutex held
+void removeService(int slot) {
+  ServiceConfig& config = serviceConfig[slot];
+  arenaRelease(config.name);
+  arenaRelease(config.host);
+  arenaRelease(config.path);
+  arenaRelease(config.expectedResponse);
+  arenaRelease(config.rules);
+  arenaRelease(config.authToken);
+  arenaRelease(config.group);
+
+  queueMqttUpdate(MQTT_REMOVE, slot);
+  serviceState[slot].flags = 0;
+  serviceState[slot].generation++;
+  freeSlots[freeSlotCount++] = slot;
+  serviceCount--;
+  relinkDependencies();
+
+  publishService(slot);
+  markListChanged();
+}
+
+// Called with servicesMutex held after every add and remove, parents can come and go in any order
+void relinkDependencies() {
+  int16_t parents[MAX_SERVICES];
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    parents[slot] = NO_PARENT;
+    if ((serviceState[slot].flags & SERVICE_IN_USE) && serviceConfig[slot].parent[0] != '\0') {
+      int parent = findServiceSlot(serviceConfig[slot].parent);
+      parents[slot] = parent >= 0 ? parent : NO_PARENT;
+    }
+  }
+  int cleared = breakDependencyCycles(parents, MAX_SERVICES);
+  if (cleared > 0) {
+    Serial.printf("Ignoring %d service parents that would form a loop\n", cleared);
   }
 
-  JsonDocument doc;
-  JsonArray array = doc["services"].to<JsonArray>();
+  bool released = false;
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    ServiceState& state = serviceState[slot];
+    state.parentSlot = parents[slot];
+    // Its parent is gone, so nothing holds it back any more
+    if (state.parentSlot == NO_PARENT && (state.flags & SERVICE_SUPPRESSED)) {
+      state.flags &= ~SERVICE_SUPPRESSED;
+      state.nextCheckDue = millis();
+      publishService(slot);
+      released = true;
+    }
+  }
+  if (released) {
+    rebuildSchedule();
+  }
+}
 
-  for (int i = 0; i < serviceCount; i++) {
-    JsonObject obj = array.add<JsonObject>();
-    obj["id"] = services[i].id;
-    obj["name"] = services[i].name;
-    obj["type"] = (int)services[i].type;
-    obj["host"] = services[i].host;
-    obj["port"] = services[i].port;
-    obj["path"] = services[i].path;
-    obj["expectedResponse"] = services[i].expectedResponse;
-    obj["checkInterval"] = services[i].checkInterval;
+// Called with servicesMutex held
+ParentReach serviceParentReach(int slot) {
+  int parent = serviceState[slot].parentSlot;
+  if (parent == NO_PARENT) {
+    return PARENT_REACHABLE;
   }
+  const ServiceState& state = serviceState[parent];
+  return parentReach(serviceCounters[parent].checks > 0, state.flags & SERVICE_UP, state.failures,
+    state.flags & SERVICE_SUPPRESSED);
+}
 
-  serializeJson(doc, file);
-  file.close();
-  Serial.println("Services saved");
+// Called with servicesMutex held once slot is up, its suppressed children are checked straight away
+// True when any was, the caller rebuilds the schedule
+bool releaseDependents(int slot) {
+  bool released = false;
+  unsigned long now = millis();
+  for (int child = 0; child < MAX_SERVICES; child++) {
+    ServiceState& state = serviceState[child];
+    if (state.parentSlot == slot && (state.flags & SERVICE_SUPPRESSED)) {
+      state.flags &= ~SERVICE_SUPPRESSED;
+      state.nextCheckDue = now;
+      publishService(child);
+      released = true;
+    }
+  }
+  return released;
 }
 
-void loadServices() {
-  File file = LittleFS.open("/services.json", "r");
-  if (!file) {
-    Serial.println("No services.json found, starting fresh");
-    return;
+StringRef arenaIntern(const char* str) {
+  size_t length = strlen(str);
+  if (length == 0) {
+    return 0;
   }
 
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, file);
-  file.close();
+  int freeEntry = -1;
+  for (int i = 0; i < STRING_ARENA_ENTRIES; i++) {
+    ArenaEntry& entry = arenaEntries[i];
+    if (entry.refs == 0) {
+      if (freeEntry == -1) {
+        freeEntry = i;
+      }
+      continue;
+    }
+    if (entry.length == length && memcmp(arenaPool + entry.offset, str, length) == 0) {
+      entry.refs++;
+      return i + 1;
+    }
+  }
 
-  if (error) {
-    Serial.println("Failed to parse services.json");
+  if (freeEntry == -1 || length > 0xFFFF) {
+    return ARENA_FULL;
+  }
+  if (arenaUsed + length + 1 > STRING_ARENA_SIZE) {
+    arenaCompact();
+    if (arenaUsed + length + 1 > STRING_ARENA_SIZE) {
+      return ARENA_FULL;
+    }
+  }
+
+  ArenaEntry& entry = arenaEntries[freeEntry];
+  entry.offset = arenaUsed;
+  entry.length = length;
+  entry.refs = 1;
+  memcpy(arenaPool + arenaUsed, str, length + 1);
+  arenaUsed += length + 1;
+  return freeEntry + 1;
+}
+
+void arenaRelease(StringRef ref) {
+  if (ref == 0 || ref == ARENA_FULL) {
     return;
   }
+  arenaEntries[ref - 1].refs--;
+}
 
-  JsonArray array = doc["services"];
-  serviceCount = 0;
+const char* arenaString(StringRef ref) {
+  if (ref == 0 || ref == ARENA_FULL) {
+    return "";
+  }
+  return arenaPool + arenaEntries[ref - 1].offset;
+}
 
-  for (JsonObject obj : array) {
-    if (serviceCount >= MAX_SERVICES) break;
+// Slides live strings down over the gaps, lowest offset first so nothing is overwritten before it moves
+void arenaCompact() {
+  uint32_t writeOffset = 0;
+
+  for (;;) {
+    int next = -1;
+    for (int i = 0; i < STRING_ARENA_ENTRIES; i++) {
+      ArenaEntry& entry = arenaEntries[i];
+      if (entry.refs > 0 && entry.offset >= writeOffset &&
+          (next == -1 || entry.offset < arenaEntries[next].offset)) {
+        next = i;
+      }
+    }
+    if (next == -1) {
+      break;
+    }
+
+    ArenaEntry& entry = arenaEntries[next];
+    if (entry.offset != writeOffset) {
+      memmove(arenaPool + writeOffset, arenaPool + entry.offset, entry.length + 1);
+      entry.offset = writeOffset;
+    }
+    writeOffset += entry.length + 1;
+  }
 
-    services[serviceCount].id = obj["id"].as<String>();
-    services[serviceCount].name = obj["name"].as<String>();
-    services[serviceCount].type = (ServiceType)obj["type"].as<int>();
-    services[serviceCount].host = obj["host"].as<String>();
-    services[serviceCount].port = obj["port"];
-    services[serviceCount].path = obj["path"].as<String>();
-    services[serviceCount].expectedResponse = obj["expectedResponse"].as<String>();
-    services[serviceCount].checkInterval = obj["checkInterval"];
-    services[serviceCount].isUp = false;
-    services[serviceCount].lastCheck = 0;
-    services[serviceCount].lastUptime = 0;
-    services[serviceCount].lastError = "";
-    services[serviceCount].secondsSinceLastCheck = -1;
+  arenaUsed = writeOffset;
+}
 
-    serviceCount++;
+// Called with servicesMutex held after any change to a slot
+void publishService(int slot) {
+  std::atomic<uint32_t>& seq = publishedSeq[slot];
+  const ServiceState& state = serviceState[slot];
+  const ServiceConfig& config = serviceConfig[slot];
+
+  // Everything is gathered outside the write window, percentiles, the DNS cache and the quorum included
+  ServiceSnapshot& data = *publishStaging;
+  data.inUse = state.flags & SERVICE_IN_USE;
+  strlcpy(data.id, config.id, sizeof(data.id));
+  strlcpy(data.name, arenaString(config.name), sizeof(data.name));
+  data.type = (ServiceType)state.type;
+  strlcpy(data.host, arenaString(config.host), sizeof(data.host));
+  data.port = config.port;
+  strlcpy(data.path, arenaString(config.path), sizeof(data.path));
+  strlcpy(data.expectedResponse, arenaString(config.expectedResponse), sizeof(data.expectedResponse));
+  strlcpy(data.rules, arenaString(config.rules), sizeof(data.rules));
+  data.hasAuthToken = config.authToken != 0;
+  strlcpy(data.parent, config.parent, sizeof(data.parent));
+  strlcpy(data.group, arenaString(config.group), sizeof(data.group));
+  data.suppressed = state.flags & SERVICE_SUPPRESSED;
+  data.checkInterval = state.intervalMs / 1000;
+  data.maxScanBytes = config.maxScanBytes;
+  data.degradedMs = config.degradedMs;
+  data.confirmChecks = config.confirmChecks;
+  data.retryInterval = config.retryInterval;
+  data.maxBackoff = config.maxBackoff;
+  data.connectTimeoutMs = effectiveConnectTimeout(config.connectTimeoutMs);
+  data.readTimeoutMs = effectiveReadTimeout((ServiceType)state.type, config.readTimeoutMs);
+  data.pingCount = effectivePingCount(config.pingCount);
+  data.isDegraded = state.flags & SERVICE_DEGRADED;
+  data.dnsStale = isDnsStale(arenaString(config.host));
+  data.failures = state.failures;
+  data.nextCheckMs = max((long)(state.nextCheckDue - millis()), 0L);
+  const ServiceLatency& latency = serviceLatency[slot];
+  data.timing = latency.last;
+  for (int i = 0; i < UPTIME_WINDOWS; i++) {
+    data.uptime[i] = uptimePercent(serviceHistory[slot].windows[i]);
   }
+  data.p50Us = latencyPercentile(latency, 50);
+  data.p95Us = latencyPercentile(latency, 95);
+  data.p99Us = latencyPercentile(latency, 99);
+  memcpy(data.latencyCounts, latency.counts, sizeof(data.latencyCounts));
+  data.latencySumUs = latency.sumUs;
+  data.counters = serviceCounters[slot];
+  data.isUp = state.flags & SERVICE_UP;
+  data.lastCheck = state.lastCheck;
+  strlcpy(data.lastError, config.lastError, sizeof(data.lastError));
+  data.certExpiry = config.certExpiry;
+  fillPeerQuorum(slot, data);
+  data.version = stateVersion.fetch_add(1, std::memory_order_relaxed) + 1;
+
+  seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&publishedServices[slot], &data, sizeof(ServiceSnapshot));
+  seq.fetch_add(1, std::memory_order_release);
+}
 
-  Serial.printf("Loaded %d services\n", serviceCount);
+// Called with servicesMutex held after a service was added or removed
+void markListChanged() {
+  listVersion.store(stateVersion.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_release);
 }
 
-String getServiceTypeString(ServiceType type) {
-  switch (type) {
-    case TYPE_HOME_ASSISTANT: return "home_assistant";
-    case TYPE_JELLYFIN: return "jellyfin";
-    case TYPE_HTTP_GET: return "http_get";
-    case TYPE_PING: return "ping";
-    default: return "unknown";
-  }
-}
-
-String getWebPage() {
-  return R"rawliteral(
-<!DOCTYPE html>
-<html lang="en">
-<head>
-    <meta charset="UTF-8">
-    <meta name="viewport" content="width=device-width, initial-scale=1.0">
-    <title>ESP32 Uptime Monitor</title>
-    <style>
-        * {
-            margin: 0;
-            padding: 0;
-            box-sizing: border-box;
-        }
+// Lock-free copy of one published slot, safe from any task. False once slot is past the end,
+// empty slots come back with inUse cleared
+bool readPublishedService(int slot, ServiceSnapshot& out) {
+  if (slot >= MAX_SERVICES) {
+    return false;
+  }
 
-        body {
-            font-family: -apple-system, BlinkMacSystemFont, 'Segoe UI', Roboto, Oxygen, Ubuntu, Cantarell, sans-serif;
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            min-height: 100vh;
-            padding: 20px;
-        }
+  std::atomic<uint32_t>& seq = publishedSeq[slot];
+  for (int attempt = 1;; attempt++) {
+    uint32_t before = seq.load(std::memory_order_acquire);
+    if (before & 1) {
+      // taskYIELD() never hands the core to a lower priority writer, a tick of sleep does
+      if (attempt % PUBLISH_READ_SPINS == 0) {
+        vTaskDelay(1);
+      } else {
+        taskYIELD();
+      }
+      continue;
+    }
+    memcpy(&out, &publishedServices[slot], sizeof(ServiceSnapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq.load(std::memory_order_relaxed) == before) {
+      return true;
+    }
+  }
+}
 
-        .container {
-            max-width: 1200px;
-            margin: 0 auto;
+AsyncWebServerResponse* beginChunkedSource(AsyncWebServerRequest* request, const char* contentType,
+    std::shared_ptr<ChunkedSource> source) {
+  source->pos = 0;
+  source->cursor = 0;
+  source->emitted = 0;
+  source->finished = false;
+
+  // The lambda keeps the source alive until the response is done with it
+  return request->beginChunkedResponse(contentType, [source](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+    size_t written = 0;
+    while (written < maxLen) {
+      if (source->pos == source->length) {
+        source->pos = 0;
+        source->length = 0;
+        if (source->finished || !source->refill(*source)) {
+          source->finished = true;
+          break;
         }
+      }
 
-        .header {
-            text-align: center;
-            color: white;
-            margin-bottom: 30px;
-        }
+      size_t chunk = min(maxLen - written, source->length - source->pos);
+      memcpy(buffer + written, source->scratch + source->pos, chunk);
+      source->pos += chunk;
+      written += chunk;
+    }
+    return written;
+  });
+}
 
-        .header h1 {
-            font-size: 2.5em;
-            margin-bottom: 10px;
-            text-shadow: 2px 2px 4px rgba(0,0,0,0.2);
-        }
+// One service per call, entries are individually consistent but the list can change between calls
+bool refillServiceList(ChunkedSource& source, uint32_t since) {
+  if (source.cursor < 0) {
+    return false;
+  }
 
-        .header p {
-            font-size: 1.1em;
-            opacity: 0.9;
-        }
+  ServiceSnapshot service;
+  for (;;) {
+    if (!readPublishedService(source.cursor, service)) {
+      source.length = strlcpy(source.scratch, "]}", sizeof(source.scratch));
+      source.cursor = -1;
+      return true;
+    }
+    source.cursor++;
+    if (service.inUse && service.version > since) {
+      break;
+    }
+  }
 
-        .card {
-            background: white;
-            border-radius: 12px;
-            padding: 25px;
-            margin-bottom: 20px;
-            box-shadow: 0 4px 6px rgba(0,0,0,0.1);
-        }
+  JsonDocument doc;
+  serializeServiceSnapshot(service, doc.to<JsonObject>());
 
-        .add-service-form {
-            display: grid;
-            gap: 15px;
-        }
+  size_t offset = 0;
+  if (source.emitted > 0) {
+    source.scratch[offset++] = ',';
+  }
+  source.length = offset + serializeJson(doc, source.scratch + offset, sizeof(source.scratch) - offset);
+  source.emitted++;
+  return true;
+}
 
-        .form-group {
-            display: flex;
-            flex-direction: column;
-        }
+void serializeServiceSnapshot(const ServiceSnapshot& service, JsonObject obj) {
+  int secondsSinceLastCheck = -1; // Never checked
+  if (service.lastCheck > 0) {
+    secondsSinceLastCheck = (millis() - service.lastCheck) / 1000;
+  }
 
-        .form-row {
-            display: grid;
-            grid-template-columns: 1fr 1fr;
-            gap: 15px;
-        }
+  obj["id"] = service.id;
+  obj["name"] = service.name;
+  obj["type"] = getServiceTypeString(service.type);
+  obj["host"] = service.host;
+  obj["port"] = service.port;
+  obj["path"] = service.path;
+  obj["expectedResponse"] = service.expectedResponse;
+  obj["rules"] = service.rules;
+  obj["hasAuthToken"] = service.hasAuthToken;
+  obj["parent"] = service.parent;
+  obj["group"] = service.group;
+  obj["checkInterval"] = service.checkInterval;
+  obj["maxScanBytes"] = service.maxScanBytes;
+  obj["degradedMs"] = service.degradedMs;
+  obj["confirmChecks"] = service.confirmChecks;
+  obj["retryInterval"] = service.retryInterval;
+  obj["maxBackoff"] = service.maxBackoff;
+  if (service.type == TYPE_PING) {
+    obj["pingCount"] = service.pingCount;
+  } else {
+    obj["connectTimeoutMs"] = service.connectTimeoutMs;
+  }
+  obj["readTimeoutMs"] = service.readTimeoutMs;
+  obj["isUp"] = service.isUp;
+  if (isTlsServiceType(service.type)) {
+    if (service.certExpiry != 0) {
+      obj["certExpiry"] = service.certExpiry;
+      // Days left needs the wall clock, leave it out until NTP has synced
+      uint32_t now = historyNow();
+      if (now != 0) {
+        obj["certDaysLeft"] = ((int64_t)service.certExpiry - now) / 86400;
+      }
+    }
+    obj["tlsResumed"] = service.timing.tlsResumed;
+  }
+  obj["isDegraded"] = service.isDegraded;
+  obj["suppressed"] = service.suppressed;
+  obj["dnsStale"] = service.dnsStale;
+  obj["consecutiveFailures"] = service.failures;
+  obj["nextCheckMs"] = service.nextCheckMs;
+  obj["secondsSinceLastCheck"] = secondsSinceLastCheck;
+  obj["lastError"] = service.lastError;
+  obj["version"] = service.version;
+  if (PEER_GROUP[0] != '\0') {
+    JsonObject peer = obj["peer"].to<JsonObject>();
+    peer["role"] = PEER_ROLE_NAMES[service.peerRole];
+    peer["primary"] = service.primary;
+    peer["quorum"] = quorumStateName((QuorumState)service.quorum);
+    peer["observers"] = service.observers;
+    peer["observersUp"] = service.observersUp;
+  }
 
-        label {
-            font-weight: 600;
-            margin-bottom: 5px;
-            color: #333;
-            font-size: 0.9em;
-        }
+  JsonObject uptime = obj["uptime"].to<JsonObject>();
+  for (int i = 0; i < UPTIME_WINDOWS; i++) {
+    if (service.uptime[i] >= 0) {
+      uptime[UPTIME_WINDOW_NAMES[i]] = service.uptime[i];
+    }
+  }
 
-        input, select {
-            padding: 10px;
-            border: 2px solid #e0e0e0;
-            border-radius: 6px;
-            font-size: 1em;
-            transition: border-color 0.3s;
-        }
+  JsonObject latency = obj["latency"].to<JsonObject>();
+  latency["dnsMs"] = service.timing.dnsUs / 1000.0f;
+  latency["connectMs"] = service.timing.connectUs / 1000.0f;
+  latency["firstByteMs"] = service.timing.firstByteUs / 1000.0f;
+  latency["totalMs"] = service.timing.totalUs / 1000.0f;
+  latency["p50Ms"] = service.p50Us / 1000.0f;
+  latency["p95Ms"] = service.p95Us / 1000.0f;
+  latency["p99Ms"] = service.p99Us / 1000.0f;
+  if (isTlsServiceType(service.type)) {
+    latency["tlsMs"] = service.timing.tlsUs / 1000.0f;
+  }
+  if (service.type == TYPE_PING) {
+    latency["jitterMs"] = service.timing.jitterUs / 1000.0f;
+    latency["lossPercent"] = service.timing.lossPercent;
+  }
+}
 
-        input:focus, select:focus {
-            outline: none;
-            border-color: #667eea;
-        }
+// Runs on the loop task, pushes whatever was published since the last call to the dashboard's event stream
+void pushServiceEvents() {
+  static uint32_t pushedVersion = 0;
+  static uint32_t pushedListVersion = 0;
 
-        .btn {
-            padding: 12px 24px;
-            border: none;
-            border-radius: 6px;
-            font-size: 1em;
-            font-weight: 600;
-            cursor: pointer;
-            transition: all 0.3s;
-        }
+  uint32_t version = stateVersion.load(std::memory_order_acquire);
+  if (version == pushedVersion) {
+    return;
+  }
 
-        .btn-primary {
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            color: white;
-        }
+  uint32_t currentListVersion = listVersion.load(std::memory_order_acquire);
+  if (events.count() == 0) {
+    pushedVersion = version;
+    pushedListVersion = currentListVersion;
+    return;
+  }
 
-        .btn-primary:hover {
-            transform: translateY(-2px);
-            box-shadow: 0 4px 12px rgba(102, 126, 234, 0.4);
-        }
+  static char message[2048];  // loop task only, kept off its stack
+  if (currentListVersion != pushedListVersion) {
+    snprintf(message, sizeof(message), "{\"version\":%lu}", (unsigned long)version);
+    events.send(message, "list", version);
+  } else {
+    ServiceSnapshot service;
+    for (int slot = 0; readPublishedService(slot, service); slot++) {
+      if (!service.inUse || service.version <= pushedVersion) {
+        continue;
+      }
+      JsonDocument doc;
+      serializeServiceSnapshot(service, doc.to<JsonObject>());
+      serializeJson(doc, message, sizeof(message));
+      events.send(message, "service", service.version);
+    }
+  }
 
-        .btn-danger {
-            background: #ef4444;
-            color: white;
-            padding: 8px 16px;
-            font-size: 0.9em;
-        }
+  pushedVersion = version;
+  pushedListVersion = currentListVersion;
+}
 
-        .btn-danger:hover {
-            background: #dc2626;
-        }
+// Dispatcher, pops every due service off the schedule and hands it to the async probe engine or the worker pool
+// Returns how long the caller can sleep before the next deadline
+unsigned long checkServices() {
+  unsigned long currentTime = millis();
+  unsigned long waitMs = SCHEDULE_IDLE;
+  CheckJob dueJobs[MAX_SERVICES];
+  AsyncProbe* dueProbes[MAX_SERVICES];
+  int dueCount = 0;
+
+  // Hold every check while offline, the GOT_IP event wakes the loop again
+  if (!wifiOnline) {
+    return SCHEDULE_IDLE;
+  }
 
-        .services-grid {
-            display: grid;
-            grid-template-columns: repeat(auto-fill, minmax(300px, 1fr));
-            gap: 20px;
-        }
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  // Everything fell due while the link was down, spread it out again instead of checking it all at once
+  if (wifiResumed.exchange(false)) {
+    spreadInitialSchedule();
+  }
+  int inFlight = countChecksInFlight();
+  while (scheduleHeap.size > 0 && dueCount < MAX_SERVICES) {
+    int slot = scheduleHeap.entries[0].slot;
+    ServiceState& state = serviceState[slot];
+    if ((long)(state.nextCheckDue - currentTime) > 0) {
+      break;
+    }
 
-        .service-card {
-            background: white;
-            border-radius: 12px;
-            padding: 20px;
-            box-shadow: 0 2px 4px rgba(0,0,0,0.1);
-            border-left: 4px solid #e0e0e0;
-            transition: all 0.3s;
-        }
+    schedulerLagMs = currentTime - state.nextCheckDue;
+    schedulerMaxLagMs = max(schedulerMaxLagMs, schedulerLagMs);
+    serviceLag[slot].lastMs = schedulerLagMs;
+    serviceLag[slot].maxMs = max(serviceLag[slot].maxMs, schedulerLagMs);
 
-        .service-card.up {
-            border-left-color: #10b981;
-        }
+    // A deferred check keeps its phase, the next deadline follows the planned one, not the late dispatch
+    uint32_t plannedDue = (state.flags & SERVICE_DEFERRED) ? state.plannedDue : state.nextCheckDue;
+    state.flags &= ~SERVICE_DEFERRED;
+    state.nextCheckDue = nextDeadline(plannedDue, state.intervalMs, currentTime);
+    rescheduleRoot(scheduleHeap, state.nextCheckDue);
 
-        .service-card.down {
-            border-left-color: #ef4444;
-        }
+    // A check slower than its interval just skips a round, and a remote service is its probers' job
+    if ((state.flags & SERVICE_CHECK_PENDING) || state.peerRole == PEER_ROLE_REMOTE) {
+      continue;
+    }
 
-        .service-card:hover {
-            transform: translateY(-4px);
-            box-shadow: 0 4px 12px rgba(0,0,0,0.15);
-        }
+    // Behind a parent that is down the check could only time out, releaseDependents() brings it back
+    if (serviceParentReach(slot) == PARENT_UNREACHABLE) {
+      if (!(state.flags & SERVICE_SUPPRESSED)) {
+        state.flags |= SERVICE_SUPPRESSED;
+        Serial.printf("Service '%s' is unreachable, holding its checks\n", arenaString(serviceConfig[slot].name));
+        publishService(slot);
+      }
+      continue;
+    }
+    state.flags &= ~SERVICE_SUPPRESSED;
+
+    // Over the budget, try again shortly instead of waiting a whole interval
+    if (!(state.flags & SERVICE_BENCHMARK)) {
+      if (inFlight >= MAX_CHECKS_IN_FLIGHT || !takeToken(checkTokens, currentTime)) {
+        state.plannedDue = plannedDue;
+        state.flags |= SERVICE_DEFERRED;
+        state.nextCheckDue = currentTime + max(msUntilToken(checkTokens, currentTime), (uint32_t)CHECK_DEFER_MS);
+        rescheduleRoot(scheduleHeap, state.nextCheckDue);
+        checksDeferred++;
+        continue;
+      }
+      inFlight++;
+    }
 
-        .service-header {
-            display: flex;
-            justify-content: space-between;
-            align-items: start;
-            margin-bottom: 15px;
-        }
+    // Published together with the result, so each check is one update for the dashboard
+    state.lastCheck = currentTime;
+    state.flags |= SERVICE_CHECK_PENDING;
 
-        .service-name {
-            font-size: 1.2em;
-            font-weight: 700;
-            color: #1f2937;
-        }
+    // Pings to a literal or cached address go straight to the ICMP engine
+    uint32_t address;
+    if (state.type == TYPE_PING && resolveCached(arenaString(serviceConfig[slot].host), address) &&
+        startPing(slot, state.generation, address, 0, effectivePingCount(serviceConfig[slot].pingCount),
+          effectiveReadTimeout(TYPE_PING, serviceConfig[slot].readTimeoutMs))) {
+      continue;
+    }
 
-        .service-status {
-            display: inline-block;
-            padding: 4px 12px;
-            border-radius: 20px;
-            font-size: 0.85em;
-            font-weight: 600;
-        }
+    dueJobs[dueCount].slot = slot;
+    dueJobs[dueCount].generation = state.generation;
+    dueProbes[dueCount] = claimAsyncProbe(slot);
+    dueCount++;
+  }
 
-        .service-status.up {
-            background: #d1fae5;
-            color: #065f46;
-        }
+  if (scheduleHeap.size > 0) {
+    long untilDue = (long)(scheduleHeap.entries[0].due - millis());
+    waitMs = untilDue > 0 ? untilDue : 0;
+  }
+  xSemaphoreGive(servicesMutex);
 
-        .service-status.down {
-            background: #fee2e2;
-            color: #991b1b;
-        }
+  // Connect outside the lock, results come back through recordCheckResult()
+  for (int i = 0; i < dueCount; i++) {
+    if (dueProbes[i] == NULL || !launchAsyncProbe(dueProbes[i])) {
+      dispatchToWorker(dueJobs[i]);
+    }
+  }
 
-        .service-info {
-            margin-bottom: 10px;
-            color: #6b7280;
-            font-size: 0.9em;
-        }
+  return waitMs;
+}
 
-        .service-info strong {
-            color: #374151;
-        }
+// Called after loading and whenever the link comes back, services sharing an interval are staggered
+// evenly across it
+void spreadInitialSchedule() {
+  unsigned long currentTime = millis();
 
-        .service-actions {
-            margin-top: 15px;
-            padding-top: 15px;
-            border-top: 1px solid #e5e7eb;
-        }
+  for (int i = 0; i < MAX_SERVICES; i++) {
+    if (!(serviceState[i].flags & SERVICE_IN_USE)) {
+      continue;
+    }
 
-        .type-badge {
-            display: inline-block;
-            padding: 4px 10px;
-            background: #e0e7ff;
-            color: #3730a3;
-            border-radius: 6px;
-            font-size: 0.8em;
-            font-weight: 600;
-            margin-bottom: 10px;
+    int position = 0;
+    int sameInterval = 0;
+    for (int j = 0; j < MAX_SERVICES; j++) {
+      if ((serviceState[j].flags & SERVICE_IN_USE) && serviceState[j].intervalMs == serviceState[i].intervalMs) {
+        if (j < i) {
+          position++;
         }
+        sameInterval++;
+      }
+    }
 
-        .empty-state {
-            text-align: center;
-            padding: 60px 20px;
-            color: white;
-        }
+    serviceState[i].nextCheckDue = currentTime + (uint64_t)serviceState[i].intervalMs * position / sameInterval;
+    serviceState[i].flags &= ~SERVICE_DEFERRED;
+  }
 
-        .empty-state h3 {
-            font-size: 1.5em;
-            margin-bottom: 10px;
-        }
+  rebuildSchedule();
+}
 
-        .hidden {
-            display: none;
-        }
+// Called with servicesMutex held
+int countChecksInFlight() {
+  int inFlight = 0;
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if ((serviceState[slot].flags & (SERVICE_CHECK_PENDING | SERVICE_BENCHMARK)) == SERVICE_CHECK_PENDING) {
+      inFlight++;
+    }
+  }
+  return inFlight;
+}
 
-        .alert {
-            padding: 12px 20px;
-            border-radius: 6px;
-            margin-bottom: 20px;
-        }
+// The longest a check can take before it times out, pings send pingCount echoes PING_INTERVAL_MS apart
+uint32_t worstCaseCheckMs(ServiceType type, uint16_t connectTimeoutMs, uint16_t readTimeoutMs, uint8_t pingCount) {
+  if (type == TYPE_PING) {
+    return (effectivePingCount(pingCount) - 1) * PING_INTERVAL_MS + effectiveReadTimeout(type, readTimeoutMs);
+  }
+  return effectiveConnectTimeout(connectTimeoutMs) + effectiveReadTimeout(type, readTimeoutMs);
+}
 
-        .alert-success {
-            background: #d1fae5;
-            color: #065f46;
-        }
+// Called with servicesMutex held. The mean of the successful checks once there are any, failures
+// are assumed to run into the timeout
+uint32_t expectedCheckMs(int slot) {
+  const ServiceLatency& latency = serviceLatency[slot];
+  const ServiceConfig& config = serviceConfig[slot];
+  uint32_t worstCase = worstCaseCheckMs((ServiceType)serviceState[slot].type, config.connectTimeoutMs,
+    config.readTimeoutMs, config.pingCount);
+  uint32_t checks = serviceCounters[slot].checks;
+  if (latency.samples == 0 || checks == 0) {
+    return worstCase;
+  }
+  uint32_t meanMs = latency.sumUs / latency.samples / 1000;
+  uint32_t failures = checks > latency.samples ? checks - latency.samples : 0;
+  return ((uint64_t)meanMs * latency.samples + (uint64_t)worstCase * failures) / (latency.samples + failures);
+}
 
-        .alert-error {
-            background: #fee2e2;
-            color: #991b1b;
-        }
+// Called with servicesMutex held. Slots marked in leaving are about to go and don't count
+CheckLoad currentCheckLoad(const bool* leaving) {
+  CheckLoad load = { 0, 0 };
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if ((serviceState[slot].flags & (SERVICE_IN_USE | SERVICE_BENCHMARK)) == SERVICE_IN_USE &&
+        (leaving == NULL || !leaving[slot])) {
+      addCheckLoad(load, serviceState[slot].intervalMs / 1000, expectedCheckMs(slot));
+    }
+  }
+  return load;
+}
 
-        @media (max-width: 768px) {
-            .form-row {
-                grid-template-columns: 1fr;
-            }
+// Called with servicesMutex held. The interval the service can have, definition.checkInterval or longer,
+// 0 when the budget has no room for it. A new service is assumed to run into its timeouts. An admitted
+// service's share is added to load, so several can be admitted in a row
+uint32_t admitServiceInterval(const ServiceDefinition& definition, CheckLoad& load) {
+  uint32_t durationMs = worstCaseCheckMs(definition.type, definition.connectTimeoutMs, definition.readTimeoutMs,
+    definition.pingCount);
+  uint32_t intervalS = admitInterval(load, max(definition.checkInterval, (uint32_t)1), durationMs,
+    CHECK_RATE_PER_SECOND * CHECK_BUDGET_HEADROOM, MAX_CHECKS_IN_FLIGHT * CHECK_BUDGET_HEADROOM,
+    max(MAX_ADMITTED_INTERVAL_S, definition.checkInterval));
+  if (intervalS > 0) {
+    addCheckLoad(load, intervalS, durationMs);
+  }
+  return intervalS;
+}
 
-            .services-grid {
-                grid-template-columns: 1fr;
-            }
+// Called with servicesMutex held whenever a service is added or removed
+void rebuildSchedule() {
+  scheduleHeap.size = 0;
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if (serviceState[slot].flags & SERVICE_IN_USE) {
+      appendDeadline(scheduleHeap, slot, serviceState[slot].nextCheckDue);
+    }
+  }
+  heapifyDeadlines(scheduleHeap);
+}
 
-            .header h1 {
-                font-size: 1.8em;
-            }
-        }
-    </style>
-</head>
-<body>
-    <div class="container">
-        <div class="header">
-            <h1>ESP32 Uptime Monitor</h1>
-            <p>Monitor your services and infrastructure health</p>
-        </div>
-
-        <div id="alertContainer"></div>
-
-        <div class="card">
-            <h2 style="margin-bottom: 20px; color: #1f2937;">Add New Service</h2>
-            <form id="addServiceForm" class="add-service-form">
-                <div class="form-group">
-                    <label for="serviceName">Service Name</label>
-                    <input type="text" id="serviceName" required placeholder="My Service">
-                </div>
-
-                <div class="form-row">
-                    <div class="form-group">
-                        <label for="serviceType">Service Type</label>
-                        <select id="serviceType" required>
-                            <option value="home_assistant">Home Assistant</option>
-                            <option value="jellyfin">Jellyfin</option>
-                            <option value="http_get">HTTP GET</option>
-                            <option value="ping">Ping</option>
-                        </select>
-                    </div>
-
-                    <div class="form-group">
-                        <label for="serviceHost">Host / IP Address</label>
-                        <input type="text" id="serviceHost" required placeholder="192.168.1.100">
-                    </div>
-                </div>
-
-                <div class="form-row">
-                    <div class="form-group">
-                        <label for="servicePort">Port</label>
-                        <input type="number" id="servicePort" value="80" required>
-                    </div>
-
-                    <div class="form-group">
-                        <label for="checkInterval">Check Interval (seconds)</label>
-                        <input type="number" id="checkInterval" value="60" required min="10">
-                    </div>
-                </div>
-
-                <div class="form-group" id="pathGroup">
-                    <label for="servicePath">Path</label>
-                    <input type="text" id="servicePath" value="/" placeholder="/">
-                </div>
-
-                <div class="form-group" id="responseGroup">
-                    <label for="expectedResponse">Expected Response (* for any)</label>
-                    <input type="text" id="expectedResponse" value="*" placeholder="*">
-                </div>
-
-                <button type="submit" class="btn btn-primary">Add Service</button>
-            </form>
-        </div>
-
-        <h2 style="color: white; margin-bottom: 20px; font-size: 1.5em;">Monitored Services</h2>
-        <div id="servicesContainer" class="services-grid"></div>
-        <div id="emptyState" class="empty-state hidden">
-            <h3>No services yet</h3>
-            <p>Add your first service using the form above</p>
-        </div>
-    </div>
-
-    <script>
-        let services = [];
-
-        // Update form fields based on service type
-        document.getElementById('serviceType').addEventListener('change', function() {
-            const type = this.value;
-            const pathGroup = document.getElementById('pathGroup');
-            const responseGroup = document.getElementById('responseGroup');
-            const portInput = document.getElementById('servicePort');
-
-            if (type === 'ping') {
-                pathGroup.classList.add('hidden');
-                responseGroup.classList.add('hidden');
-            } else {
-                pathGroup.classList.remove('hidden');
-
-                if (type === 'http_get') {
-                    responseGroup.classList.remove('hidden');
-                } else {
-                    responseGroup.classList.add('hidden');
-                }
-
-                // Set default ports
-                // Big benefit of the defined types is we can set defaults like these
-                if (type === 'home_assistant') {
-                    portInput.value = 8123;
-                } else if (type === 'jellyfin') {
-                    portInput.value = 8096;
-                } else {
-                    portInput.value = 80;
-                }
-            }
-        });
-
-        // Add service
-        document.getElementById('addServiceForm').addEventListener('submit', async function(e) {
-            e.preventDefault();
-
-            const data = {
-                name: document.getElementById('serviceName').value,
-                type: document.getElementById('serviceType').value,
-                host: document.getElementById('serviceHost').value,
-                port: parseInt(document.getElementById('servicePort').value),
-                path: document.getElementById('servicePath').value,
-                expectedResponse: document.getElementById('expectedResponse').value,
-                checkInterval: parseInt(document.getElementById('checkInterval').value)
-            };
-
-            try {
-                const response = await fetch('/api/services', {
-                    method: 'POST',
-                    headers: {'Content-Type': 'application/json'},
-                    body: JSON.stringify(data)
-                });
-
-                if (response.ok) {
-                    showAlert('Service added successfully!', 'success');
-                    this.reset();
-                    document.getElementById('serviceType').dispatchEvent(new Event('change'));
-                    loadServices();
-                } else {
-                    showAlert('Failed to add service', 'error');
-                }
-            } catch (error) {
-                showAlert('Error: ' + error.message, 'error');
-            }
-        });
-
-        // Load services
-        async function loadServices() {
-            try {
-                const response = await fetch('/api/services');
-                const data = await response.json();
-                services = data.services || [];
-                renderServices();
-            } catch (error) {
-                console.error('Error loading services:', error);
-            }
-        }
+void notifyScheduler() {
+  if (schedulerTaskHandle != NULL) {
+    xTaskNotifyGive(schedulerTaskHandle);
+  }
+}
 
-        // Render services
-        function renderServices() {
-            const container = document.getElementById('servicesContainer');
-            const emptyState = document.getElementById('emptyState');
-
-            if (services.length === 0) {
-                container.innerHTML = '';
-                emptyState.classList.remove('hidden');
-                return;
-            }
-
-            emptyState.classList.add('hidden');
-
-            container.innerHTML = services.map(service => {
-                let uptimeStr = 'Not checked yet';
-
-                if (service.secondsSinceLastCheck >= 0) {
-                    const seconds = service.secondsSinceLastCheck;
-                    if (seconds < 60) {
-                        uptimeStr = `${seconds}s ago`;
-                    } else if (seconds < 3600) {
-                        const minutes = Math.floor(seconds / 60);
-                        const secs = seconds % 60;
-                        uptimeStr = `${minutes}m ${secs}s ago`;
-                    } else {
-                        const hours = Math.floor(seconds / 3600);
-                        const minutes = Math.floor((seconds % 3600) / 60);
-                        uptimeStr = `${hours}h ${minutes}m ago`;
-                    }
-                }
-
-                return `
-                    <div class="service-card ${service.isUp ? 'up' : 'down'}">
-                        <div class="service-header">
-                            <div>
-                                <div class="service-name">${service.name}</div>
-                                <div class="type-badge">${service.type.replace('_', ' ').toUpperCase()}</div>
-                            </div>
-                            <span class="service-status ${service.isUp ? 'up' : 'down'}">
-                                ${service.isUp ? 'UP' : 'DOWN'}
-                            </span>
-                        </div>
-                        <div class="service-info">
-                            <strong>Host:</strong> ${service.host}:${service.port}
-                        </div>
-                        ${service.path && service.type !== 'ping' ? `
-                        <div class="service-info">
-                            <strong>Path:</strong> ${service.path}
-                        </div>
-                        ` : ''}
-                        <div class="service-info">
-                            <strong>Check Interval:</strong> ${service.checkInterval}s
-                        </div>
-                        <div class="service-info">
-                            <strong>Last Check:</strong> ${uptimeStr}
-                        </div>
-                        ${service.lastError ? `
-                        <div class="service-info" style="color: #ef4444;">
-                            <strong>Error:</strong> ${service.lastError}
-                        </div>
-                        ` : ''}
-                        <div class="service-actions">
-                            <button class="btn btn-danger" onclick="deleteService('${service.id}')">Delete</button>
-                        </div>
-                    </div>
-                `;
-            }).join('');
-        }
+void dispatchToWorker(const CheckJob& job) {
+  if (xQueueSend(checkQueue, &job, 0) != pdTRUE) {
+    // Queue full, skip this round and let the next deadline pick it up again
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    if (serviceState[job.slot].generation == job.generation) {
+      serviceState[job.slot].flags &= ~SERVICE_CHECK_PENDING;
+    }
+    xSemaphoreGive(servicesMutex);
+  }
+}
 
-        // Delete service
-        async function deleteService(id) {
-            if (!confirm('Are you sure you want to delete this service?')) {
-                return;
-            }
-
-            try {
-                const response = await fetch(`/api/services/${id}`, {
-                    method: 'DELETE'
-                });
-
-                if (response.ok) {
-                    showAlert('Service deleted successfully', 'success');
-                    loadServices();
-                } else {
-                    showAlert('Failed to delete service', 'error');
-                }
-            } catch (error) {
-                showAlert('Error: ' + error.message, 'error');
-            }
-        }
+// Called with servicesMutex held
+void fillCheckTarget(int slot, CheckTarget& target) {
+  const ServiceConfig& config = serviceConfig[slot];
+
+  target.slot = slot;
+  target.generation = serviceState[slot].generation;
+  target.type = (ServiceType)serviceState[slot].type;
+  target.check = serviceProbes[slot].check;
+  strlcpy(target.host, arenaString(config.host), sizeof(target.host));
+  target.port = config.port;
+  strlcpy(target.path, arenaString(config.path), sizeof(target.path));
+  memcpy(&target.matcher, &serviceProbes[slot].matcher, sizeof(ResponseMatcher));
+  memcpy(&target.rules, &serviceProbes[slot].rules, sizeof(CheckRules));
+  strlcpy(target.authToken, arenaString(config.authToken), sizeof(target.authToken));
+  target.maxScanBytes = config.maxScanBytes;
+  target.connectTimeoutMs = effectiveConnectTimeout(config.connectTimeoutMs);
+  target.readTimeoutMs = effectiveReadTimeout(target.type, config.readTimeoutMs);
+  target.pingCount = effectivePingCount(config.pingCount);
+  target.certDue = config.certCheckedMs == 0 || millis() - config.certCheckedMs >= TLS_CERT_RECHECK_MS;
+  target.lastError = "";
+}
 
-        // Show alert
-        function showAlert(message, type) {
-            const container = document.getElementById('alertContainer');
-            const alert = document.createElement('div');
-            alert.className = `alert alert-${type}`;
-            alert.textContent = message;
-            container.appendChild(alert);
-
-            setTimeout(() => {
-                alert.remove();
-            }, 3000);
-        }
+bool runCheck(CheckTarget& target) {
+  return target.check != NULL && target.check(target);
+}
 
-        // Auto-refresh services every 5 seconds
-        setInterval(loadServices, 5000);
+void checkWorkerTask(void* parameter) {
+  CheckJob job;
+  CheckTarget target;
+  WorkerConnection connection;
+  connection.host[0] = '\0';
+  connection.port = 0;
+  target.connection = &connection;
+
+  for (;;) {
+    if (xQueueReceive(checkQueue, &job, pdMS_TO_TICKS(HTTP_KEEPALIVE_IDLE_MS)) != pdTRUE) {
+      // Nothing to do for a while, don't sit on an idle socket
+      connection.client.stop();
+      continue;
+    }
 
-        // Initial load
-        loadServices();
-        document.getElementById('serviceType').dispatchEvent(new Event('change'));
-    </script>
-</body>
-</html>
-)rawliteral";
+    // Work on a private copy so the network call runs without holding the lock
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    if (serviceState[job.slot].generation != job.generation) {
+      xSemaphoreGive(servicesMutex);
+      continue; // deleted while queued
+    }
+    fillCheckTarget(job.slot, target);
+    xSemaphoreGive(servicesMutex);
+
+    target.timing = CheckTiming();
+    target.startedUs = micros();
+    target.deferred = false;
+    bool isUp = runCheck(target);
+    if (target.deferred) {
+      continue;
+    }
+    if (target.type != TYPE_PING) {
+      target.timing.totalUs = micros() - target.startedUs;
+    }
+    recordCheckResult(job.slot, job.generation, isUp, target.lastError, target.timing);
+  }
+}
+
+// Writes a finished check back into the service slot, called from the workers and the AsyncTCP task
+void recordCheckResult(int slot, uint16_t generation, bool isUp, const String& error, const CheckTiming& timing) {
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  // A different generation means the service was deleted while the check was running
+  ServiceState& state = serviceState[slot];
+  if (state.generation == generation && !isUp && !wifiOnline) {
+    // The link went down under this check, which says nothing about the service
+    state.flags &= ~SERVICE_CHECK_PENDING;
+    xSemaphoreGive(servicesMutex);
+    return;
+  }
+  ParentReach reach = state.generation == generation ? serviceParentReach(slot) : PARENT_REACHABLE;
+  if (state.generation == generation && !isUp && reach == PARENT_UNREACHABLE) {
+    // The parent went down while this check was running, the failure is the parent's
+    state.flags = (state.flags & ~SERVICE_CHECK_PENDING) | SERVICE_SUPPRESSED;
+    publishService(slot);
+    xSemaphoreGive(servicesMutex);
+    notifyScheduler();
+    return;
+  }
+  if (state.generation == generation && (state.flags & SERVICE_IN_USE)) {
+    uint8_t previous = state.flags & (SERVICE_UP | SERVICE_DEGRADED);
+    ServiceConfig& config = serviceConfig[slot];
+    ServiceLatency& latency = serviceLatency[slot];
+
+    latency.last = timing;
+    typeDurationCounts[state.type][latencyBucket(timing.totalUs)]++;
+    typeDurationMaxUs[state.type] = max(typeDurationMaxUs[state.type], timing.totalUs);
+    bool wasUp = state.flags & SERVICE_UP;
+    uint8_t previousFailures = state.failures;
+    state.failures = isUp ? 0 : min(state.failures + 1, UINT8_MAX);
+    // Still confirming, the service keeps its UP state until confirmChecks more checks have failed too,
+    // or for as long as its parent is confirming a failure of its own
+    bool confirming = !isUp && wasUp && (state.failures <= config.confirmChecks || reach == PARENT_IN_DOUBT);
+
+    state.flags &= ~(SERVICE_UP | SERVICE_DEGRADED | SERVICE_CHECK_PENDING);
+    if (confirming) {
+      state.flags |= SERVICE_UP;
+      strlcpy(config.lastError, error.c_str(), sizeof(config.lastError));
+    } else if (isUp) {
+      state.flags |= SERVICE_UP;
+      state.lastUptime = millis();
+      config.lastError[0] = '\0';
+
+      // Only successful checks go into the histogram, a timeout would just pile up in the last bucket
+      uint16_t& bucket = latency.buckets[latencyBucket(timing.totalUs)];
+      if (bucket == UINT16_MAX) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+          latency.buckets[i] /= 2;
+        }
+      }
+      bucket++;
+      latency.samples++;
+      latency.counts[latencyBucket(timing.totalUs)]++;
+      latency.sumUs += timing.totalUs;
+
+      if (config.degradedMs > 0 && timing.totalUs > config.degradedMs * 1000) {
+        state.flags |= SERVICE_DEGRADED;
+      }
+    } else {
+      strlcpy(config.lastError, error.c_str(), sizeof(config.lastError));
+    }
+
+    HistoryRecord record;
+    record.time = historyNow();
+    record.latencyMs = isUp ? min(timing.totalUs / 1000, (uint32_t)UINT16_MAX) : 0;
+    record.status = ((state.flags & SERVICE_UP) ? HISTORY_UP : 0) | ((state.flags & SERVICE_DEGRADED) ? HISTORY_DEGRADED : 0);
+    record.error = isUp ? CHECK_ERROR_NONE : classifyCheckError(error);
+    bool firstResult = serviceCounters[slot].checks == 0;
+    serviceCounters[slot].checks++;
+    serviceCounters[slot].errors[record.error]++;
+    if (record.time != 0) {
+      recordHistory(slot, record);
+    }
+
+    bool rescheduled = false;
+    // A failing child is a hint about its parent, check the parent now rather than on its own schedule
+    if (state.failures == 1 && state.parentSlot != NO_PARENT && reach == PARENT_REACHABLE) {
+      ServiceState& parent = serviceState[state.parentSlot];
+      if (!(parent.flags & SERVICE_CHECK_PENDING) && (long)(parent.nextCheckDue - millis()) > 0) {
+        parent.nextCheckDue = millis();
+        rescheduled = true;
+      }
+    }
+    if ((state.flags & SERVICE_UP) && state.failures == 0) {
+      rescheduled |= releaseDependents(slot);
+    }
+
+    // Failures and recoveries move the next check off the regular phase, a run of successes keeps it
+    if (state.failures > 0 || previousFailures > 0) {
+      state.nextCheckDue = millis() + retryDelayMs(state, config);
+      rescheduled = true;
+    }
+    if (rescheduled) {
+      rebuildSchedule();
+    }
+    publishService(slot);
+
+    uint8_t publishClass = mqttClassFor(state.flags, timing.totalUs);
+    if (publishClass != mqttClass[slot]) {
+      mqttClass[slot] = publishClass;
+      queueMqttUpdate(MQTT_STATE, slot);
+    }
+
+    // Log status changes
+    uint8_t current = state.flags & (SERVICE_UP | SERVICE_DEGRADED);
+    if (previous != current) {
+      AlertState alert = !(current & SERVICE_UP) ? ALERT_DOWN : (current & SERVICE_DEGRADED) ? ALERT_DEGRADED : ALERT_UP;
+      Serial.printf("Service '%s' is now %s\n", arenaString(config.name), alertStateName(alert));
+      // Coming up on the first check after boot or an add isn't news
+      if (!(firstResult && alert == ALERT_UP)) {
+        queueAlert(slot, alert);
+      }
+    } else if (confirming) {
+      Serial.printf("Service '%s' failed, confirming (%d/%d)\n",
+        arenaString(config.name), state.failures, config.confirmChecks);
+    }
+  }
+  xSemaphoreGive(servicesMutex);
+
+  // Wake the loop task so the result goes out on the event stream
+  notifyScheduler();
+}
+
+// How long until the next check given the failures so far, called with servicesMutex held
+uint32_t retryDelayMs(const ServiceState& state, const ServiceConfig& config) {
+  return retryDelayMs(state.failures, config.confirmChecks, state.intervalMs, config.retryInterval, config.maxBackoff);
+}
+
+int latencyBucket(uint32_t us) {
+  // Half millisecond units, bucket 1 + 2b + h covers [2^b * (2 + h), 2^b * (3 + h)) of them
+  uint32_t halfMs = us / 500;
+  if (halfMs < 2) {
+    return 0;
+  }
+  int top = 31 - __builtin_clz(halfMs);
+  int bucket = 1 + 2 * (top - 1) + ((halfMs >> (top - 1)) & 1);
+  return min(bucket, LATENCY_BUCKETS - 1);
+}
+
+uint32_t latencyBucketUpperUs(int bucket) {
+  if (bucket == 0) {
+    return 1000;
+  }
+  int octave = (bucket - 1) / 2;
+  int half = (bucket - 1) % 2;
+  return (uint32_t)500 * (3 + half) << octave;
+}
+
+// Upper edge of the bucket holding the given percentile, 0 before the first successful check
+uint32_t latencyPercentile(const ServiceLatency& latency, int percent) {
+  uint32_t total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    total += latency.buckets[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint32_t rank = (total * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += latency.buckets[i];
+    if (seen >= rank) {
+      return latencyBucketUpperUs(i);
+    }
+  }
+  return latencyBucketUpperUs(LATENCY_BUCKETS - 1);
+}
+
+// Called with servicesMutex held, the histogram is small enough to answer in one go
+void sendServiceLatency(AsyncWebServerRequest* request, int slot) {
+  const ServiceLatency& latency = serviceLatency[slot];
+  JsonDocument doc;
+  doc["id"] = serviceConfig[slot].id;
+  doc["samples"] = latency.samples;
+  doc["p50Ms"] = latencyPercentile(latency, 50) / 1000.0f;
+  doc["p95Ms"] = latencyPercentile(latency, 95) / 1000.0f;
+  doc["p99Ms"] = latencyPercentile(latency, 99) / 1000.0f;
+
+  JsonArray buckets = doc["buckets"].to<JsonArray>();
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    if (latency.buckets[i] == 0) {
+      continue;
+    }
+    JsonObject bucket = buckets.add<JsonObject>();
+    bucket["upToMs"] = latencyBucketUpperUs(i) / 1000.0f;
+    bucket["count"] = latency.buckets[i];
+  }
+
+  String response;
+  serializeJson(doc, response);
+  request->send(200, "application/json", response);
+}
+
+void initHistory() {
+  // SNTP keeps retrying in the background, history starts once the clock is set
+  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+
+  LittleFS.mkdir("/history");
+
+  // The segment whose first block has the highest sequence is the one being appended to
+  HistoryBlockHeader header;
+  bool found = false;
+  for (int segment = 0; segment < HISTORY_SEGMENTS; segment++) {
+    File file = LittleFS.open(historySegmentPath(segment), "r");
+    if (!file) {
+      continue;
+    }
+    if (file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.magic == HISTORY_BLOCK_MAGIC &&
+        (!found || header.segmentSequence > historySegmentSequence)) {
+      found = true;
+      historySegment = segment;
+      historySegmentSequence = header.segmentSequence;
+      historySegmentBlocks = file.size() / HISTORY_BLOCK_SIZE;
+    }
+    file.close();
+  }
+
+  historyLastFlush = millis();
+  replayHistory();
+  Serial.printf("History: segment %d holds %d of %d blocks\n", historySegment, historySegmentBlocks,
+    HISTORY_SEGMENT_BLOCKS);
+}
+
+uint32_t historyNow() {
+  time_t now = time(NULL);
+  return now >= HISTORY_MIN_EPOCH ? (uint32_t)now : 0;
+}
+
+// FNV-1a, only has to tell a few dozen ids apart
+uint32_t hashServiceId(const char* serviceId) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = serviceId; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint8_t classifyCheckError(const String& error) {
+  if (error.startsWith("Timeout")) return CHECK_ERROR_TIMEOUT;
+  if (error.startsWith("Connection failed")) return CHECK_ERROR_CONNECT;
+  if (error.startsWith("HTTP ")) return CHECK_ERROR_HTTP_STATUS;
+  if (error.startsWith("Response mismatch")) return CHECK_ERROR_MISMATCH;
+  if (error.startsWith("Connection closed")) return CHECK_ERROR_CLOSED;
+  if (error.startsWith("Invalid response")) return CHECK_ERROR_INVALID;
+  if (error.startsWith("Ping")) return CHECK_ERROR_PING;
+  if (error.startsWith("DNS")) return CHECK_ERROR_DNS;
+  if (error.startsWith("TLS")) return CHECK_ERROR_TLS;
+  return CHECK_ERROR_OTHER;
+}
+
+const char* checkErrorName(uint8_t error) {
+  switch (error) {
+    case CHECK_ERROR_NONE: return "";
+    case CHECK_ERROR_TIMEOUT: return "timeout";
+    case CHECK_ERROR_CONNECT: return "connect";
+    case CHECK_ERROR_HTTP_STATUS: return "http_status";
+    case CHECK_ERROR_MISMATCH: return "mismatch";
+    case CHECK_ERROR_CLOSED: return "closed";
+    case CHECK_ERROR_INVALID: return "invalid";
+    case CHECK_ERROR_PING: return "ping";
+    case CHECK_ERROR_DNS: return "dns";
+    case CHECK_ERROR_TLS: return "tls";
+    default: return "other";
+  }
+}
+
+// Called with servicesMutex held
+void recordHistory(int slot, const HistoryRecord& record) {
+  HistoryRing& ring = serviceHistory[slot].ring;
+  if (pushHistoryRecord(ring, record)) {
+    historyUnflushed++;
+  }
+
+  // Flush before a ring starts overwriting records that never made it to flash
+  if (ring.unflushed >= HISTORY_RING_SIZE * 3 / 4 || historyUnflushed >= HISTORY_RECORDS_PER_BLOCK) {
+    historyFlushWanted = true;
+  }
+
+  countUptime(serviceHistory[slot].windows, record);
+}
+
+String historySegmentPath(int segment) {
+  return "/history/" + String(segment) + ".bin";
+}
+
+// Runs on the loop task, returns how long until the next flush is due
+unsigned long flushHistoryIfDue() {
+  unsigned long sinceFlush = millis() - historyLastFlush;
+  if (historyFlushWanted || (historyUnflushed > 0 && sinceFlush >= HISTORY_FLUSH_INTERVAL_MS)) {
+    flushHistory();
+    return HISTORY_FLUSH_INTERVAL_MS;
+  }
+  return historyUnflushed > 0 ? HISTORY_FLUSH_INTERVAL_MS - sinceFlush : SCHEDULE_IDLE;
+}
+
+// Drains every ring into whole blocks, the lock is only held while copying, never across the flash write
+void flushHistory() {
+  HistoryBlockHeader* header = (HistoryBlockHeader*)historyBlock;
+  HistoryFlashRecord* records = (HistoryFlashRecord*)(historyBlock + sizeof(HistoryBlockHeader));
+
+  for (;;) {
+    memset(historyBlock, 0, HISTORY_BLOCK_SIZE);
+    int count = 0;
+
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    historyFlushWanted = false;
+    for (int slot = 0; slot < MAX_SERVICES && count < HISTORY_RECORDS_PER_BLOCK; slot++) {
+      if (!(serviceState[slot].flags & SERVICE_IN_USE)) {
+        continue;
+      }
+      HistoryRing& ring = serviceHistory[slot].ring;
+      while (ring.unflushed > 0 && count < HISTORY_RECORDS_PER_BLOCK) {
+        records[count].serviceHash = serviceHistory[slot].serviceHash;
+        records[count].record = unflushedHistoryRecord(ring, 0);
+        count++;
+        ring.unflushed--;
+        historyUnflushed--;
+      }
+    }
+    // Whatever is left belongs to deleted services
+    bool more = count == HISTORY_RECORDS_PER_BLOCK && historyUnflushed > 0;
+    if (!more) {
+      historyUnflushed = 0;
+    }
+    xSemaphoreGive(servicesMutex);
+
+    if (count == 0) {
+      break;
+    }
+
+    // Rotate into the oldest segment once the current one is full
+    const char* mode = "a";
+    if (historySegmentBlocks >= HISTORY_SEGMENT_BLOCKS) {
+      historySegment = (historySegment + 1) % HISTORY_SEGMENTS;
+      historySegmentSequence++;
+      historySegmentBlocks = 0;
+      mode = "w";
+    }
+
+    header->magic = HISTORY_BLOCK_MAGIC;
+    header->segmentSequence = historySegmentSequence;
+    header->count = count;
+
+    File file = LittleFS.open(historySegmentPath(historySegment), mode);
+    if (!file || file.write(historyBlock, HISTORY_BLOCK_SIZE) != HISTORY_BLOCK_SIZE) {
+      Serial.println("Failed to write history block");
+    } else {
+      historySegmentBlocks++;
+    }
+    file.close();
+
+    if (!more) {
+      break;
+    }
+  }
+
+  historyLastFlush = millis();
+}
+
+// Rebuilds the uptime windows from flash once at boot, afterwards they only move forward
+void replayHistory() {
+  const HistoryBlockHeader* header = (const HistoryBlockHeader*)historyBlock;
+  const HistoryFlashRecord* records = (const HistoryFlashRecord*)(historyBlock + sizeof(HistoryBlockHeader));
+  int replayed = 0;
+
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  for (int step = 1; step <= HISTORY_SEGMENTS; step++) {
+    File file = LittleFS.open(historySegmentPath((historySegment + step) % HISTORY_SEGMENTS), "r");
+    if (!file) {
+      continue;
+    }
+
+    while (file.read(historyBlock, HISTORY_BLOCK_SIZE) == HISTORY_BLOCK_SIZE) {
+      if (header->magic != HISTORY_BLOCK_MAGIC) {
+        break;
+      }
+      for (int i = 0; i < header->count && i < HISTORY_RECORDS_PER_BLOCK; i++) {
+        for (int slot = 0; slot < MAX_SERVICES; slot++) {
+          if ((serviceState[slot].flags & SERVICE_IN_USE) && serviceHistory[slot].serviceHash == records[i].serviceHash) {
+            countUptime(serviceHistory[slot].windows, records[i].record);
+            replayed++;
+            break;
+          }
+        }
+      }
+    }
+    file.close();
+  }
+
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if (serviceState[slot].flags & SERVICE_IN_USE) {
+      publishService(slot);
+    }
+  }
+  xSemaphoreGive(servicesMutex);
+
+  Serial.printf("Replayed %d history records\n", replayed);
+}
+
+// Called with servicesMutex held, only the ring is copied here, flash is read while the response streams
+void sendServiceHistory(AsyncWebServerRequest* request, int slot) {
+  uint32_t now = historyNow();
+  std::shared_ptr<HistoryCursor> cursor = std::make_shared<HistoryCursor>();
+  cursor->to = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), NULL, 10) : now;
+  cursor->from = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), NULL, 10)
+    : (cursor->to > 86400 ? cursor->to - 86400 : 0);
+  cursor->serviceHash = serviceHistory[slot].serviceHash;
+
+  const HistoryRing& ring = serviceHistory[slot].ring;
+  cursor->ringCount = ring.count;
+  cursor->ringPos = 0;
+  for (int i = 0; i < ring.count; i++) {
+    cursor->ring[i] = historyRingRecord(ring, i);
+  }
+  cursor->flashBefore = ring.count > 0 ? cursor->ring[0].time : UINT32_MAX;
+
+  // Oldest segment first
+  cursor->segment = (historySegment + 1) % HISTORY_SEGMENTS;
+  cursor->segmentsLeft = HISTORY_SEGMENTS;
+  cursor->blockRecordsLeft = 0;
+
+  std::shared_ptr<ChunkedSource> source = std::make_shared<ChunkedSource>();
+  source->length = snprintf(source->scratch, sizeof(source->scratch),
+    "{\"id\":\"%s\",\"from\":%lu,\"to\":%lu,\"records\":[", serviceConfig[slot].id,
+    (unsigned long)cursor->from, (unsigned long)cursor->to);
+  source->refill = [cursor](ChunkedSource& source) {
+    return refillHistory(source, *cursor);
+  };
+  request->send(beginChunkedSource(request, "application/json", source));
+}
+
+bool nextHistoryRecord(HistoryCursor& cursor, HistoryRecord& record) {
+  HistoryBlockHeader header;
+  HistoryFlashRecord flashRecord;
+
+  while (cursor.segmentsLeft > 0) {
+    if (!cursor.file) {
+      cursor.file = LittleFS.open(historySegmentPath(cursor.segment), "r");
+      cursor.blockStart = 0;
+      cursor.blockRecordsLeft = 0;
+      if (!cursor.file) {
+        cursor.segment = (cursor.segment + 1) % HISTORY_SEGMENTS;
+        cursor.segmentsLeft--;
+        continue;
+      }
+    }
+
+    if (cursor.blockRecordsLeft == 0) {
+      // Next block, a short read or a bad header ends the segment
+      if (!cursor.file.seek(cursor.blockStart) ||
+          cursor.file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) || header.magic != HISTORY_BLOCK_MAGIC) {
+        cursor.file.close();
+        cursor.file = File();
+        cursor.segment = (cursor.segment + 1) % HISTORY_SEGMENTS;
+        cursor.segmentsLeft--;
+        continue;
+      }
+      cursor.blockStart += HISTORY_BLOCK_SIZE;
+      cursor.blockRecordsLeft = min((int)header.count, HISTORY_RECORDS_PER_BLOCK);
+      continue;
+    }
+
+    cursor.blockRecordsLeft--;
+    if (cursor.file.read((uint8_t*)&flashRecord, sizeof(flashRecord)) != sizeof(flashRecord)) {
+      cursor.blockRecordsLeft = 0;
+      continue;
+    }
+    const HistoryRecord& candidate = flashRecord.record;
+    if (flashRecord.serviceHash == cursor.serviceHash && candidate.time < cursor.flashBefore &&
+        candidate.time >= cursor.from && candidate.time <= cursor.to) {
+      record = candidate;
+      return true;
+    }
+  }
+
+  while (cursor.ringPos < cursor.ringCount) {
+    const HistoryRecord& candidate = cursor.ring[cursor.ringPos++];
+    if (candidate.time >= cursor.from && candidate.time <= cursor.to) {
+      record = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Packs as many records as fit into the scratch buffer per chunk
+bool refillHistory(ChunkedSource& source, HistoryCursor& cursor) {
+  if (source.cursor < 0) {
+    return false;
+  }
+
+  const size_t maxRecordLength = 96;
+  size_t offset = 0;
+  HistoryRecord record;
+  while (offset + maxRecordLength < sizeof(source.scratch)) {
+    if (!nextHistoryRecord(cursor, record)) {
+      offset += strlcpy(source.scratch + offset, "]}", sizeof(source.scratch) - offset);
+      source.cursor = -1;
+      break;
+    }
+
+    offset += snprintf(source.scratch + offset, sizeof(source.scratch) - offset,
+      "%s{\"t\":%lu,\"up\":%s,\"degraded\":%s,\"latencyMs\":%u,\"error\":\"%s\"}",
+      source.emitted > 0 ? "," : "", (unsigned long)record.time,
+      (record.status & HISTORY_UP) ? "true" : "false",
+      (record.status & HISTORY_DEGRADED) ? "true" : "false",
+      record.latencyMs, checkErrorName(record.error));
+    source.emitted++;
+  }
+
+  source.length = offset;
+  return true;
+}
+
+bool refillMetrics(ChunkedSource& source, MetricsCursor& cursor) {
+  if (source.cursor < 0) {
+    return false;
+  }
+
+  size_t offset = 0;
+  while (offset + METRIC_LINE_MAX < sizeof(source.scratch)) {
+    if (cursor.family >= METRIC_FAMILY_COUNT) {
+      source.cursor = -1;
+      break;
+    }
+
+    const MetricFamily& family = METRIC_FAMILIES[cursor.family];
+    char* buffer = source.scratch + offset;
+    size_t size = sizeof(source.scratch) - offset;
+
+    // A line that didn't fit is dropped from this chunk and written again at the start of the next one
+    if (!cursor.headerWritten) {
+      size_t length = snprintf(buffer, size, "# HELP %s %s\n# TYPE %s %s\n", family.name, family.help, family.name,
+        family.type);
+      if (length >= size) {
+        break;
+      }
+      offset += length;
+      cursor.headerWritten = true;
+      continue;
+    }
+
+    if (!family.perService || cursor.slot >= MAX_SERVICES) {
+      if (!family.perService) {
+        size_t length = formatDeviceMetric(cursor.family, buffer, size);
+        if (length >= size) {
+          break;
+        }
+        offset += length;
+      }
+      cursor.family++;
+      cursor.slot = 0;
+      cursor.line = 0;
+      cursor.headerWritten = false;
+      continue;
+    }
+
+    if (cursor.line == 0) {
+      if (!readPublishedService(cursor.slot, cursor.service) || !cursor.service.inUse) {
+        cursor.slot++;
+        continue;
+      }
+      cursor.line = 1;
+    }
+
+    size_t length = formatServiceMetric(cursor.family, cursor.service, cursor.line - 1, buffer, size);
+    if (length == 0) {
+      cursor.slot++;
+      cursor.line = 0;
+      continue;
+    }
+    if (length >= size) {
+      break;
+    }
+    offset += length;
+    cursor.line++;
+  }
+
+  source.length = offset;
+  return true;
+}
+
+// Line `line` of one service's samples for a family, 0 once there are no more
+size_t formatServiceMetric(int family, const ServiceSnapshot& service, int line, char* buffer, size_t size) {
+  const char* name = METRIC_FAMILIES[family].name;
+  bool checked = service.lastCheck > 0;
+
+  switch (family) {
+    case METRIC_SERVICE_INFO: {
+      if (line > 0) {
+        return 0;
+      }
+      char escapedName[sizeof(service.name) * 2];
+      char escapedHost[sizeof(service.host) * 2];
+      escapeLabelValue(service.name, escapedName, sizeof(escapedName));
+      escapeLabelValue(service.host, escapedHost, sizeof(escapedHost));
+      return snprintf(buffer, size, "%s{service=\"%s\",name=\"%s\",type=\"%s\",host=\"%s\"} 1\n",
+        name, service.id, escapedName, getServiceTypeString(service.type).c_str(), escapedHost);
+    }
+
+    case METRIC_UP:
+    case METRIC_DEGRADED:
+      if (line > 0 || !checked) {
+        return 0;
+      }
+      return snprintf(buffer, size, "%s{service=\"%s\"} %d\n", name, service.id,
+        family == METRIC_UP ? service.isUp : service.isDegraded);
+
+    case METRIC_LAST_LATENCY:
+      if (line > 0 || !checked) {
+        return 0;
+      }
+      return snprintf(buffer, size, "%s{service=\"%s\"} %.6f\n", name, service.id, service.timing.totalUs / 1e6);
+
+    case METRIC_CHECKS:
+      if (line > 0) {
+        return 0;
+      }
+      return snprintf(buffer, size, "%s{service=\"%s\"} %lu\n", name, service.id,
+        (unsigned long)service.counters.checks);
+
+    case METRIC_CHECK_ERRORS: {
+      // One series per error class, class 0 is success
+      int error = line + 1;
+      if (error >= CHECK_ERROR_COUNT) {
+        return 0;
+      }
+      return snprintf(buffer, size, "%s{service=\"%s\",error=\"%s\"} %lu\n", name, service.id,
+        checkErrorName(error), (unsigned long)service.counters.errors[error]);
+    }
+
+    case METRIC_LATENCY: {
+      // One le per power of two, every other fine bucket edge, then +Inf, sum and count
+      const int edges = LATENCY_BUCKETS / 2;
+      uint32_t total = 0;
+      for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += service.latencyCounts[i];
+      }
+
+      if (line < edges) {
+        int lastBucket = line * 2;
+        uint32_t cumulative = 0;
+        for (int i = 0; i <= lastBucket; i++) {
+          cumulative += service.latencyCounts[i];
+        }
+        return snprintf(buffer, size, "%s_bucket{service=\"%s\",le=\"%g\"} %lu\n", name, service.id,
+          latencyBucketUpperUs(lastBucket) / 1e6, (unsigned long)cumulative);
+      }
+      switch (line - edges) {
+        case 0:
+          return snprintf(buffer, size, "%s_bucket{service=\"%s\",le=\"+Inf\"} %lu\n", name, service.id,
+            (unsigned long)total);
+        case 1:
+          return snprintf(buffer, size, "%s_sum{service=\"%s\"} %.6f\n", name, service.id,
+            service.latencySumUs / 1e6);
+        case 2:
+          return snprintf(buffer, size, "%s_count{service=\"%s\"} %lu\n", name, service.id, (unsigned long)total);
+        default:
+          return 0;
+      }
+    }
+
+    default:
+      return 0;
+  }
+}
+
+size_t formatDeviceMetric(int family, char* buffer, size_t size) {
+  const char* name = METRIC_FAMILIES[family].name;
+
+  switch (family) {
+    case METRIC_FREE_HEAP:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)ESP.getFreeHeap());
+    case METRIC_MIN_FREE_HEAP:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)ESP.getMinFreeHeap());
+    case METRIC_LARGEST_FREE_BLOCK:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)ESP.getMaxAllocHeap());
+    case METRIC_SCHEDULER_LAG:
+      return snprintf(buffer, size, "%s %.3f\n", name, schedulerLagMs / 1000.0);
+    case METRIC_SCHEDULER_MAX_LAG:
+      return snprintf(buffer, size, "%s %.3f\n", name, schedulerMaxLagMs / 1000.0);
+    case METRIC_WIFI_RSSI:
+      if (!wifiOnline) {
+        return 0;
+      }
+      return snprintf(buffer, size, "%s %d\n", name, (int)WiFi.RSSI());
+    case METRIC_WIFI_CONNECTED:
+      return snprintf(buffer, size, "%s %d\n", name, wifiOnline ? 1 : 0);
+    case METRIC_WIFI_DISCONNECTS:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)wifiDisconnects);
+    case METRIC_LINK_DOWN:
+      return snprintf(buffer, size, "%s %.3f\n", name, linkDownMs() / 1000.0);
+    case METRIC_ALERTS_SENT:
+    case METRIC_ALERTS_FAILED: {
+      // One line per destination that is turned on
+      size_t length = 0;
+      for (int i = 0; i < ALERT_DESTINATION_COUNT; i++) {
+        const AlertDestination& destination = alertDestinations[i];
+        if (alertDestinationMask & (1 << i)) {
+          length += snprintf(buffer + length, size - length, "%s{destination=\"%s\"} %lu\n", name, destination.name,
+            (unsigned long)(family == METRIC_ALERTS_SENT ? destination.sent : destination.failed));
+        }
+      }
+      return length;
+    }
+    case METRIC_ALERTS_PENDING:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)alertsPendingPublished);
+    case METRIC_ALERTS_DROPPED:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)alertsDropped);
+    case METRIC_UPTIME:
+      return snprintf(buffer, size, "%s %lu\n", name, (unsigned long)(millis() / 1000));
+    default:
+      return 0;
+  }
+}
+
+// Label values escape backslash, quote and newline, the buffer needs twice the input length
+size_t escapeLabelValue(const char* value, char* buffer, size_t size) {
+  size_t length = 0;
+  for (const char* c = value; *c != '\0' && length + 2 < size; c++) {
+    if (*c == '\\' || *c == '"') {
+      buffer[length++] = '\\';
+      buffer[length++] = *c;
+    } else if (*c == '\n') {
+      buffer[length++] = '\\';
+      buffer[length++] = 'n';
+    } else {
+      buffer[length++] = *c;
+    }
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+// Points the worker's HTTPClient at the target, keeping the open connection when host and port match
+// NULL with lastError set when the host can't be resolved or reached
+HTTPClient* beginWorkerRequest(CheckTarget& target, const char* path) {
+  WorkerConnection& connection = *target.connection;
+  if (connection.port != target.port || strcmp(connection.host, target.host) != 0) {
+    connection.client.stop();
+    strlcpy(connection.host, target.host, sizeof(connection.host));
+    connection.port = target.port;
+  }
+
+  // Resolve and connect here rather than inside GET() so both can be timed, HTTPClient picks up the open connection
+  // Failing here also keeps HTTPClient from resolving the name again on its own
+  if (!connection.client.connected()) {
+    uint32_t address;
+    uint32_t started = micros();
+    if (!resolveHost(target.host, address, target.lastError)) {
+      return NULL;
+    }
+    target.timing.dnsUs = micros() - started;
+    started = micros();
+    if (!connection.client.connect(IPAddress(address), target.port, target.connectTimeoutMs)) {
+      target.lastError = "Connection failed: " + String(HTTPC_ERROR_CONNECTION_REFUSED);
+      return NULL;
+    }
+    target.timing.connectUs = micros() - started;
+  }
+
+  connection.http.setReuse(true);
+  connection.http.begin(connection.client, target.host, target.port, path);
+  connection.http.setTimeout(target.readTimeoutMs);
+  return &connection.http;
+}
+
+// Without a token any answer from /api/ counts, with one the default rules check that the API accepted it
+bool checkHomeAssistant(CheckTarget& target) {
+  return runHttpCheck(target, "/api/");
+}
+
+bool checkJellyfin(CheckTarget& target) {
+  return runHttpCheck(target, "/health");
+}
+
+bool checkHttpGet(CheckTarget& target) {
+  return runHttpCheck(target, target.path);
+}
+
+// The worker side of every plain HTTP type, the status, header and JSON rules apply to all of them
+bool runHttpCheck(CheckTarget& target, const char* path) {
+  HTTPClient* request = beginWorkerRequest(target, path);
+  if (request == NULL) {
+    return false;
+  }
+  HTTPClient& http = *request;
+  const CheckRules& rules = target.rules;
+
+  if (target.authToken[0] != '\0') {
+    http.addHeader("Authorization", String("Bearer ") + target.authToken);
+  }
+  if (rules.http.headerCount > 0) {
+    const char* names[MAX_HEADER_RULES];
+    for (int i = 0; i < rules.http.headerCount; i++) {
+      names[i] = rules.http.headers[i].name;
+    }
+    http.collectHeaders(names, rules.http.headerCount);
+  }
+  // HTTP/1.0 rules out chunked bodies so the JSON parser can read straight off the socket
+  bool parseJson = rules.json.depth > 0;
+  http.useHTTP10(parseJson);
+
+  int httpCode = http.GET();
+  target.timing.firstByteUs = micros() - target.startedUs;
+  bool isUp = false;
+
+  if (httpCode <= 0) {
+    target.lastError = "Connection failed: " + String(httpCode);
+  } else if (!acceptsStatus(target.type, rules.http, httpCode)) {
+    target.lastError = "HTTP " + String(httpCode);
+  } else if (!collectedHeadersMatch(http, rules.http)) {
+    target.lastError = "Response mismatch: header";
+  } else if (parseJson) {
+    isUp = checkJsonBody(target, http.getStream());
+    // HTTP/1.0 closes the connection anyway
+    target.connection->client.stop();
+  } else if (target.matcher.length == 0) {
+    isUp = true;
+  } else {
+    MatchingStream body;
+    memcpy(&body.matcher, &target.matcher, sizeof(ResponseMatcher));
+    body.scanned = 0;
+    body.limit = target.maxScanBytes;
+    body.found = false;
+
+    int written = http.writeToStream(&body);
+    isUp = body.found;
+    if (!isUp) {
+      target.lastError = "Response mismatch";
+    }
+    if (written < 0) {
+      // Stopped part way through, the rest of the body is still on the socket so it can't be reused
+      target.connection->client.stop();
+    }
+  }
+
+  http.end();
+  return isUp;
+}
+
+// The service's own status ranges when it has any, otherwise what its type accepts
+bool acceptsStatus(ServiceType type, const HttpRules& rules, int status) {
+  if (rules.statusCount > 0) {
+    return statusInRanges(rules, status);
+  }
+  if (type == TYPE_HOME_ASSISTANT) {
+    // HA returns 404 for /api/ without a token, but ANY positive HTTP status means the service is alive
+    return status > 0;
+  }
+  return status == 200;
+}
+
+bool collectedHeadersMatch(HTTPClient& http, const HttpRules& rules) {
+  uint8_t matched = 0;
+  char line[MAX_RULE_NAME + 2 + 128];
+  for (int i = 0; i < rules.headerCount; i++) {
+    const char* name = rules.headers[i].name;
+    if (http.hasHeader(name)) {
+      snprintf(line, sizeof(line), "%s: %s", name, http.header(name).c_str());
+      matchHeaderLine(rules, line, matched);
+    }
+  }
+  return headersSatisfied(rules, matched);
+}
+
+// Only the asserted field is kept, so a large document costs parsing time but not memory
+bool checkJsonBody(CheckTarget& target, Stream& body) {
+  JsonDocument filter;
+  buildJsonFilter(target.rules.json, filter);
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
+  if (error) {
+    target.lastError = String("Invalid response: ") + error.c_str();
+    return false;
+  }
+  if (!jsonAssertionHolds(target.rules.json, doc.as<JsonVariantConst>())) {
+    target.lastError = "Response mismatch: JSON";
+    return false;
+  }
+  return true;
+}
+
+bool checkPing(CheckTarget& target) {
+  uint32_t address;
+  uint32_t started = micros();
+  if (!resolveHost(target.host, address, target.lastError)) {
+    return false;
+  }
+  target.timing.dnsUs = micros() - started;
+
+  if (startPing(target.slot, target.generation, address, target.timing.dnsUs, target.pingCount,
+      target.readTimeoutMs)) {
+    target.deferred = true;
+    return false;
+  }
+
+  // Every ICMP probe is busy, block this worker instead
+  bool success = Ping.ping(IPAddress(address), target.pingCount);
+  if (success) {
+    target.timing.totalUs = Ping.averageTime() * 1000;
+  } else {
+    target.lastError = "Ping timeout";
+  }
+  return success;
+}
+
+// Worker fallback for when the async engine is full or the host isn't in the DNS cache yet
+bool checkTcp(CheckTarget& target) {
+  uint32_t address;
+  uint32_t started = micros();
+  if (!resolveHost(target.host, address, target.lastError)) {
+    return false;
+  }
+  target.timing.dnsUs = micros() - started;
+
+  WiFiClient client;
+  started = micros();
+  if (!client.connect(IPAddress(address), target.port, target.connectTimeoutMs)) {
+    target.lastError = "Connection failed";
+    return false;
+  }
+  target.timing.connectUs = micros() - started;
+  client.stop();
+  return true;
+}
+
+bool checkTls(CheckTarget& target) {
+  if (!tlsReady) {
+    target.lastError = "TLS unavailable";
+    return false;
+  }
+
+  uint32_t address;
+  uint32_t started = micros();
+  if (!resolveHost(target.host, address, target.lastError)) {
+    return false;
+  }
+  target.timing.dnsUs = micros() - started;
+
+  // Waiting for a handshake slot counts into the total, not into any phase
+  if (xSemaphoreTake(tlsHandshakes, pdMS_TO_TICKS(TLS_SLOT_WAIT_MS)) != pdTRUE) {
+    target.lastError = "Timeout";
+    return false;
+  }
+
+  started = micros();
+  int sock = connectTlsSocket(target, address);
+  if (sock < 0) {
+    xSemaphoreGive(tlsHandshakes);
+    return false;
+  }
+  target.timing.connectUs = micros() - started;
+  // The handshake and the response share the read timeout
+  unsigned long deadline = millis() + target.readTimeoutMs;
+
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_init(&ssl);
+  bool isUp = false;
+  int result = mbedtls_ssl_setup(&ssl, &tlsConfig);
+  // No SNI for a literal address
+  IPAddress literal;
+  if (result == 0 && !literal.fromString(target.host)) {
+    result = mbedtls_ssl_set_hostname(&ssl, target.host);
+  }
+
+  if (result != 0) {
+    target.lastError = "TLS setup failed";
+  } else {
+    mbedtls_ssl_set_bio(&ssl, &sock, tlsSend, tlsRecv, NULL);
+    bool offered = !target.certDue && offerTlsSession(target.slot, target.generation, ssl);
+    bool fullHandshake = false;
+    started = micros();
+    if (runTlsHandshake(ssl, deadline, fullHandshake, target.lastError)) {
+      target.timing.tlsUs = micros() - started;
+      target.timing.tlsResumed = offered && !fullHandshake;
+      saveTlsSession(target.slot, target.generation, ssl);
+      if (fullHandshake) {
+        storeCertExpiry(target.slot, target.generation, mbedtls_ssl_get_peer_cert(&ssl));
+      }
+      isUp = target.type == TYPE_HTTPS ? readHttpsResponse(target, ssl, deadline) : true;
+      mbedtls_ssl_close_notify(&ssl);
+    }
+  }
+
+  mbedtls_ssl_free(&ssl);
+  lwip_close(sock);
+  xSemaphoreGive(tlsHandshakes);
+  return isUp;
+}
+
+void initTlsChecks() {
+  mbedtls_ssl_config_init(&tlsConfig);
+  if (mbedtls_ssl_config_defaults(&tlsConfig, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+      MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+    Serial.println("Failed to set up TLS, TLS checks will fail");
+    return;
+  }
+  mbedtls_ssl_conf_authmode(&tlsConfig, MBEDTLS_SSL_VERIFY_NONE);
+  mbedtls_ssl_conf_rng(&tlsConfig, tlsRandom, NULL);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&tlsConfig, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+  tlsSessions = (TlsSessionEntry*)allocCold(sizeof(TlsSessionEntry) * TLS_SESSION_CACHE_SIZE);
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    tlsSessions[i].slot = -1;
+    mbedtls_ssl_session_init(&tlsSessions[i].session);
+  }
+  tlsSessionsMutex = xSemaphoreCreateMutex();
+  tlsHandshakes = xSemaphoreCreateCounting(TLS_MAX_HANDSHAKES, TLS_MAX_HANDSHAKES);
+  tlsReady = true;
+  Serial.printf("TLS checks ready, %d saved sessions\n", TLS_SESSION_CACHE_SIZE);
+}
+
+// Connects without blocking so the attempt can time out, then switches to blocking with a short
+// socket timeout for mbedtls. -1 with lastError set on failure
+int connectTlsSocket(CheckTarget& target, uint32_t address) {
+  int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    target.lastError = "Connection failed: no socket";
+    return -1;
+  }
+
+  sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(target.port);
+  to.sin_addr.s_addr = address;
+
+  int flags = fcntl(sock, F_GETFL, 0);
+  fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+  int result = connect(sock, (sockaddr*)&to, sizeof(to));
+  if (result < 0 && errno == EINPROGRESS) {
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(sock, &writable);
+    struct timeval timeout;
+    timeout.tv_sec = target.connectTimeoutMs / 1000;
+    timeout.tv_usec = target.connectTimeoutMs % 1000 * 1000;
+    result = select(sock + 1, NULL, &writable, NULL, &timeout);
+    if (result == 0) {
+      lwip_close(sock);
+      target.lastError = "Timeout";
+      return -1;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length);
+    result = result > 0 && error == 0 ? 0 : -1;
+  }
+  if (result < 0) {
+    lwip_close(sock);
+    target.lastError = "Connection failed";
+    return -1;
+  }
+
+  fcntl(sock, F_SETFL, flags);
+  // Short, each timeout comes back to the handshake loop which watches the check's deadline
+  struct timeval timeout;
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return sock;
+}
+
+// mbedtls I/O over the plain socket, a socket timeout is reported as WANT_READ/WANT_WRITE
+int tlsSend(void* context, const unsigned char* data, size_t length) {
+  int sent = send(*(int*)context, data, length, 0);
+  if (sent < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+  }
+  return sent;
+}
+
+int tlsRecv(void* context, unsigned char* data, size_t length) {
+  int received = recv(*(int*)context, data, length, 0);
+  if (received < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+  }
+  return received;
+}
+
+int tlsRandom(void* context, unsigned char* output, size_t length) {
+  esp_fill_random(output, length);
+  return 0;
+}
+
+// Stepped one message at a time to see which way it went: the server's certificate only comes with a
+// full handshake, a resumed one goes from the ServerHello straight to ChangeCipherSpec
+bool runTlsHandshake(mbedtls_ssl_context& ssl, unsigned long deadline, bool& fullHandshake, String& error) {
+  fullHandshake = false;
+  while (ssl.MBEDTLS_PRIVATE(state) != MBEDTLS_SSL_HANDSHAKE_OVER) {
+    if (ssl.MBEDTLS_PRIVATE(state) == MBEDTLS_SSL_SERVER_CERTIFICATE) {
+      fullHandshake = true;
+    }
+    int result = mbedtls_ssl_handshake_step(&ssl);
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      if ((long)(millis() - deadline) >= 0) {
+        error = "Timeout";
+        return false;
+      }
+      continue;
+    }
+    if (result != 0) {
+      char message[32];
+      snprintf(message, sizeof(message), "TLS handshake failed: -0x%04x", -result);
+      error = message;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Hands the service's saved session to the context, false when there is none
+bool offerTlsSession(int slot, uint16_t generation, mbedtls_ssl_context& ssl) {
+  bool offered = false;
+  xSemaphoreTake(tlsSessionsMutex, portMAX_DELAY);
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    TlsSessionEntry& entry = tlsSessions[i];
+    if (entry.slot == slot && entry.generation == generation) {
+      offered = mbedtls_ssl_set_session(&ssl, &entry.session) == 0;
+      entry.lastUsed = millis();
+      break;
+    }
+  }
+  xSemaphoreGive(tlsSessionsMutex);
+  return offered;
+}
+
+// Replaces the service's entry, a free one or the least recently used, in that order
+void saveTlsSession(int slot, uint16_t generation, const mbedtls_ssl_context& ssl) {
+  xSemaphoreTake(tlsSessionsMutex, portMAX_DELAY);
+  unsigned long now = millis();
+  TlsSessionEntry* target = NULL;
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    TlsSessionEntry& entry = tlsSessions[i];
+    if (entry.slot == slot) {
+      target = &entry;
+      break;
+    }
+    if (target == NULL || (target->slot >= 0 && (entry.slot < 0 || now - entry.lastUsed > now - target->lastUsed))) {
+      target = &entry;
+    }
+  }
+
+  mbedtls_ssl_session_free(&target->session);
+  mbedtls_ssl_session_init(&target->session);
+  if (mbedtls_ssl_get_session(&ssl, &target->session) == 0) {
+    target->slot = slot;
+    target->generation = generation;
+    target->lastUsed = now;
+  } else {
+    target->slot = -1;
+  }
+  xSemaphoreGive(tlsSessionsMutex);
+}
+
+// cert is NULL when the server sent none, the check is still marked done so the next one resumes
+void storeCertExpiry(int slot, uint16_t generation, const mbedtls_x509_crt* cert) {
+  uint32_t expiry = cert != NULL ? x509TimeToEpoch(cert->MBEDTLS_PRIVATE(valid_to)) : 0;
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  if (serviceState[slot].generation == generation) {
+    serviceConfig[slot].certExpiry = expiry;
+    serviceConfig[slot].certCheckedMs = millis();
+  }
+  xSemaphoreGive(servicesMutex);
+}
+
+// Days from the civil date, certificate times are UTC
+uint32_t x509TimeToEpoch(const mbedtls_x509_time& time) {
+  int year = time.year - (time.mon <= 2 ? 1 : 0);
+  int era = year / 400;
+  int yearOfEra = year - era * 400;
+  int dayOfYear = (153 * (time.mon > 2 ? time.mon - 3 : time.mon + 9) + 2) / 5 + time.day - 1;
+  int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  int64_t days = (int64_t)era * 146097 + dayOfEra - 719468;
+  int64_t seconds = days * 86400 + time.hour * 3600 + time.min * 60 + time.sec;
+  if (seconds < 0) {
+    return 0;
+  }
+  return seconds > UINT32_MAX ? UINT32_MAX : (uint32_t)seconds;
+}
+
+// Sends the GET and wants a 200 and, when there is a pattern, a match within maxScanBytes of the body.
+// The request is HTTP/1.0, so the body can't come chunked and runs to the end of the connection,
+// which is closed after one response anyway
+bool readHttpsResponse(CheckTarget& target, mbedtls_ssl_context& ssl, unsigned long deadline) {
+  const CheckRules& rules = target.rules;
+  bool parseJson = rules.json.depth > 0;
+  char buffer[TLS_HEADER_BUFFER_SIZE];
+  int length = snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.0\r\nHost: %s\r\n", target.path, target.host);
+  if (target.authToken[0] != '\0') {
+    length += snprintf(buffer + length, sizeof(buffer) - length, "Authorization: Bearer %s\r\n", target.authToken);
+  }
+  length += snprintf(buffer + length, sizeof(buffer) - length, "Connection: close\r\n\r\n");
+  int written = 0;
+  while (written < length) {
+    int result = mbedtls_ssl_write(&ssl, (const unsigned char*)buffer + written, length - written);
+    if (result > 0) {
+      written += result;
+    } else if ((result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+        (long)(millis() - deadline) >= 0) {
+      target.lastError = "Connection closed";
+      return false;
+    }
+  }
+
+  // Status line and headers have to fit the buffer
+  size_t received = 0;
+  char* body = NULL;
+  while (body == NULL) {
+    if (received >= sizeof(buffer) - 1) {
+      target.lastError = "Invalid response";
+      return false;
+    }
+    int result = mbedtls_ssl_read(&ssl, (unsigned char*)buffer + received, sizeof(buffer) - 1 - received);
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      if ((long)(millis() - deadline) >= 0) {
+        target.lastError = "Timeout";
+        return false;
+      }
+      continue;
+    }
+    if (result <= 0) {
+      target.lastError = "Connection closed";
+      return false;
+    }
+    if (target.timing.firstByteUs == 0) {
+      target.timing.firstByteUs = micros() - target.startedUs;
+    }
+    received += result;
+    buffer[received] = '\0';
+    body = strstr(buffer, "\r\n\r\n");
+  }
+
+  int status = 0;
+  if (sscanf(buffer, "HTTP/%*d.%*d %d", &status) != 1) {
+    target.lastError = "Invalid response";
+    return false;
+  }
+  if (!acceptsStatus(target.type, rules.http, status)) {
+    target.lastError = "HTTP " + String(status);
+    return false;
+  }
+
+  if (rules.http.headerCount > 0) {
+    // Cut the headers into lines in place, the body starts after the blank line and isn't touched
+    uint8_t matched = 0;
+    *body = '\0';
+    char* line = strstr(buffer, "\r\n");
+    while (line != NULL) {
+      line += 2;
+      char* next = strstr(line, "\r\n");
+      if (next != NULL) {
+        *next = '\0';
+      }
+      matchHeaderLine(rules.http, line, matched);
+      line = next;
+    }
+    if (!headersSatisfied(rules.http, matched)) {
+      target.lastError = "Response mismatch: header";
+      return false;
+    }
+  }
+
+  body += 4;
+  if (parseJson) {
+    TlsBodyStream stream(ssl, (uint8_t*)buffer, sizeof(buffer), body - buffer, received, deadline);
+    return checkJsonBody(target, stream);
+  }
+  if (target.matcher.length == 0) {
+    return true;
+  }
+
+  size_t available = received - (body - buffer);
+  uint32_t scanned = 0;
+  target.matcher.matched = 0;
+  for (;;) {
+    size_t scan = min(available, (size_t)(target.maxScanBytes - scanned));
+    if (feedResponseMatcher(target.matcher, (const uint8_t*)body, scan)) {
+      return true;
+    }
+    scanned += scan;
+    if (scanned >= target.maxScanBytes) {
+      break;
+    }
+
+    int result = mbedtls_ssl_read(&ssl, (unsigned char*)buffer, sizeof(buffer));
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      if ((long)(millis() - deadline) >= 0) {
+        target.lastError = "Timeout";
+        return false;
+      }
+      available = 0;
+      continue;
+    }
+    if (result <= 0) {
+      break; // close_notify or the connection closing ends the body
+    }
+    body = buffer;
+    available = result;
+  }
+  target.lastError = "Response mismatch";
+  return false;
+}
+
+int TlsBodyStream::read() {
+  int c = peek();
+  if (c >= 0) {
+    pos++;
+  }
+  return c;
+}
+
+int TlsBodyStream::peek() {
+  while (pos == length && !ended) {
+    int result = mbedtls_ssl_read(&ssl, buffer, size);
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      ended = (long)(millis() - deadline) >= 0;
+      continue;
+    }
+    if (result <= 0) {
+      ended = true; // close_notify or the connection closing ends the body
+      break;
+    }
+    pos = 0;
+    length = result;
+  }
+  return pos < length ? buffer[pos] : -1;
+}
+
+void initPingEngine() {
+  pingSocket = socket(AF_INET, SOCK_RAW, IP_PROTO_ICMP);
+  if (pingSocket < 0) {
+    Serial.println("Failed to open ICMP socket, pings fall back to the workers");
+    return;
+  }
+  pingIdentifier = random(1, 0xFFFF);
+
+  xTaskCreatePinnedToCore(pingTask, "ping", PING_TASK_STACK_SIZE, NULL, PING_TASK_PRIORITY, &pingTaskHandle, 1);
+  Serial.printf("ICMP engine ready with %d probes\n", MAX_PING_PROBES);
+}
+
+// Safe to call from any task, also with servicesMutex held. False when the engine is full or not running
+// timeoutMs is how long replies are waited for after the last echo request
+bool startPing(int slot, uint16_t generation, uint32_t address, uint32_t dnsUs, uint8_t count,
+    uint16_t timeoutMs) {
+  if (pingTaskHandle == NULL) {
+    return false;
+  }
+
+  PingProbe* probe = NULL;
+  portENTER_CRITICAL(&pingProbesLock);
+  for (int i = 0; i < MAX_PING_PROBES; i++) {
+    if (!pingProbes[i].inUse) {
+      probe = &pingProbes[i];
+      probe->inUse = true;
+      probe->slot = slot;
+      probe->generation = generation;
+      probe->address = address;
+      probe->dnsUs = dnsUs;
+      probe->firstSequence = pingSequence;
+      probe->count = min(count, MAX_PING_COUNT);
+      pingSequence += probe->count;
+      probe->sent = 0;
+      probe->received = 0;
+      probe->nextSendMs = millis();
+      probe->deadlineMs = probe->nextSendMs + (probe->count - 1) * PING_INTERVAL_MS + timeoutMs;
+      memset(probe->rttUs, 0, sizeof(probe->rttUs));
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&pingProbesLock);
+
+  if (probe == NULL) {
+    return false;
+  }
+  xTaskNotifyGive(pingTaskHandle);
+  return true;
+}
+
+void pingTask(void* parameter) {
+  for (;;) {
+    unsigned long now = millis();
+    unsigned long waitMs = SCHEDULE_IDLE;
+
+    for (int i = 0; i < MAX_PING_PROBES; i++) {
+      PingProbe& probe = pingProbes[i];
+      portENTER_CRITICAL(&pingProbesLock);
+      bool inUse = probe.inUse;
+      portEXIT_CRITICAL(&pingProbesLock);
+      if (!inUse) {
+        continue;
+      }
+
+      if (probe.sent < probe.count && (long)(now - probe.nextSendMs) >= 0) {
+        sendPingEcho(probe);
+        probe.nextSendMs = now + PING_INTERVAL_MS;
+      }
+      if (probe.received == probe.count || (long)(now - probe.deadlineMs) >= 0) {
+        finishPingProbe(probe);
+        continue;
+      }
+
+      unsigned long nextEvent = probe.sent < probe.count ? probe.nextSendMs : probe.deadlineMs;
+      waitMs = min(waitMs, (unsigned long)max((long)(nextEvent - now), 0L));
+    }
+
+    if (waitMs == SCHEDULE_IDLE) {
+      // Nothing in flight, sleep until startPing() hands over work
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+
+    // Wait for replies until the next send or deadline, new probes wait at most one interval
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(pingSocket, &readable);
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = min(waitMs, PING_INTERVAL_MS) * 1000;
+    if (select(pingSocket + 1, &readable, NULL, NULL, &timeout) > 0) {
+      receivePingReplies();
+    }
+  }
+}
+
+void sendPingEcho(PingProbe& probe) {
+  uint8_t packet[sizeof(icmp_echo_hdr) + PING_PAYLOAD_SIZE];
+  icmp_echo_hdr* echo = (icmp_echo_hdr*)packet;
+  ICMPH_TYPE_SET(echo, ICMP_ECHO);
+  ICMPH_CODE_SET(echo, 0);
+  echo->id = htons(pingIdentifier);
+  echo->seqno = htons((uint16_t)(probe.firstSequence + probe.sent));
+  for (size_t i = 0; i < PING_PAYLOAD_SIZE; i++) {
+    packet[sizeof(icmp_echo_hdr) + i] = 'a' + i % 26;
+  }
+  echo->chksum = 0;
+  echo->chksum = inet_chksum(packet, sizeof(packet));
+
+  sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = probe.address;
+
+  probe.sentUs[probe.sent] = micros();
+  sendto(pingSocket, packet, sizeof(packet), 0, (sockaddr*)&to, sizeof(to));
+  probe.sent++;
+}
+
+// Drains the socket, a raw socket sees every ICMP packet so anything not ours is dropped here
+void receivePingReplies() {
+  uint8_t packet[64 + sizeof(icmp_echo_hdr) + PING_PAYLOAD_SIZE];
+  for (;;) {
+    int length = recvfrom(pingSocket, packet, sizeof(packet), MSG_DONTWAIT, NULL, NULL);
+    if (length <= 0) {
+      return;
+    }
+    uint32_t receivedUs = micros();
+
+    const ip_hdr* ip = (const ip_hdr*)packet;
+    size_t headerLength = IPH_HL(ip) * 4;
+    if ((size_t)length < headerLength + sizeof(icmp_echo_hdr)) {
+      continue;
+    }
+    const icmp_echo_hdr* echo = (const icmp_echo_hdr*)(packet + headerLength);
+    if (ICMPH_TYPE(echo) != ICMP_ER || ntohs(echo->id) != pingIdentifier) {
+      continue;
+    }
+
+    uint16_t sequence = ntohs(echo->seqno);
+    for (int i = 0; i < MAX_PING_PROBES; i++) {
+      PingProbe& probe = pingProbes[i];
+      uint16_t echoIndex = sequence - probe.firstSequence;
+      if (probe.inUse && echoIndex < probe.sent && probe.rttUs[echoIndex] == 0 &&
+          ip->src.addr == probe.address) {
+        probe.rttUs[echoIndex] = max(receivedUs - probe.sentUs[echoIndex], (uint32_t)1);
+        probe.received++;
+        break;
+      }
+    }
+  }
+}
+
+void finishPingProbe(PingProbe& probe) {
+  CheckTiming timing = CheckTiming();
+  timing.dnsUs = probe.dnsUs;
+
+  // RFC 3550 style jitter, the mean absolute difference between consecutive round trips
+  uint64_t rttSum = 0;
+  uint64_t jitterSum = 0;
+  uint32_t previous = 0;
+  int pairs = 0;
+  for (int i = 0; i < probe.sent; i++) {
+    uint32_t rtt = probe.rttUs[i];
+    if (rtt == 0) {
+      continue;
+    }
+    rttSum += rtt;
+    if (previous != 0) {
+      jitterSum += rtt > previous ? rtt - previous : previous - rtt;
+      pairs++;
+    }
+    previous = rtt;
+  }
+
+  bool isUp = probe.received > 0;
+  if (isUp) {
+    timing.totalUs = rttSum / probe.received;
+    timing.jitterUs = pairs > 0 ? jitterSum / pairs : 0;
+  }
+  timing.lossPercent = probe.sent > 0 ? (probe.sent - probe.received) * 100 / probe.sent : 100;
+
+  int16_t slot = probe.slot;
+  uint16_t generation = probe.generation;
+  portENTER_CRITICAL(&pingProbesLock);
+  probe.inUse = false;
+  portEXIT_CRITICAL(&pingProbesLock);
+
+  recordCheckResult(slot, generation, isUp, isUp ? "" : "Ping timeout", timing);
+}
+
+void initDnsCache() {
+  memset(dnsCache, 0, sizeof(dnsCache));
+  xTaskCreatePinnedToCore(dnsTask, "dns", DNS_TASK_STACK_SIZE, NULL, 1, &dnsTaskHandle, 1);
+}
+
+// Caller holds dnsCacheLock
+DnsCacheEntry* findDnsEntry(const char* host) {
+  for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+    if (dnsCache[i].inUse && strcmp(dnsCache[i].host, host) == 0) {
+      return &dnsCache[i];
+    }
+  }
+  return NULL;
+}
+
+// Never blocks. A miss registers the host with the resolver task and returns false, the caller falls
+// back to a worker that resolves it with resolveHost()
+bool resolveCached(const char* host, uint32_t& address) {
+  in_addr literal;
+  if (inet_aton(host, &literal)) {
+    address = literal.s_addr;
+    return true;
+  }
+  if (strlen(host) >= sizeof(dnsCache[0].host)) {
+    return false;
+  }
+
+  bool found = false;
+  bool added = false;
+  portENTER_CRITICAL(&dnsCacheLock);
+  DnsCacheEntry* entry = findDnsEntry(host);
+  if (entry != NULL) {
+    entry->lastUsed = millis();
+    if (entry->resolved) {
+      address = entry->address;
+      found = true;
+    }
+  } else {
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+      if (!dnsCache[i].inUse) {
+        entry = &dnsCache[i];
+        memset(entry, 0, sizeof(DnsCacheEntry));
+        entry->inUse = true;
+        strcpy(entry->host, host);
+        entry->refreshAt = millis();
+        entry->lastUsed = entry->refreshAt;
+        added = true;
+        break;
+      }
+    }
+  }
+  portEXIT_CRITICAL(&dnsCacheLock);
+
+  if (added && dnsTaskHandle != NULL) {
+    xTaskNotifyGive(dnsTaskHandle);
+  }
+  return found;
+}
+
+// Blocking variant for the workers, queries right away when the cache has nothing for the host
+bool resolveHost(const char* host, uint32_t& address, String& error) {
+  if (resolveCached(host, address)) {
+    return true;
+  }
+
+  uint32_t ttl;
+  bool ok = queryDns(host, address, ttl, error);
+  storeDnsResult(host, ok, address, ttl);
+  return ok;
+}
+
+bool isDnsStale(const char* host) {
+  portENTER_CRITICAL(&dnsCacheLock);
+  DnsCacheEntry* entry = findDnsEntry(host);
+  bool stale = entry != NULL && entry->stale;
+  portEXIT_CRITICAL(&dnsCacheLock);
+  return stale;
+}
+
+// A failed lookup keeps the previous address and only marks it stale
+void storeDnsResult(const char* host, bool ok, uint32_t address, uint32_t ttl) {
+  bool wasStale = false;
+  bool nowStale = false;
+  portENTER_CRITICAL(&dnsCacheLock);
+  DnsCacheEntry* entry = findDnsEntry(host);
+  if (entry != NULL) {
+    unsigned long now = millis();
+    wasStale = entry->stale;
+    if (ok) {
+      entry->address = address;
+      entry->resolved = true;
+      entry->stale = false;
+      entry->refreshAt = now + ttl * 1000 / 100 * DNS_REFRESH_PERCENT;
+    } else {
+      entry->stale = entry->resolved;
+      entry->refreshAt = now + DNS_RETRY_MS;
+    }
+    nowStale = entry->stale;
+  }
+  portEXIT_CRITICAL(&dnsCacheLock);
+
+  if (ok && wasStale) {
+    Serial.printf("DNS for %s recovered\n", host);
+  } else if (nowStale && !wasStale) {
+    Serial.printf("DNS refresh for %s failed, keeping the last address\n", host);
+  }
+}
+
+void dnsTask(void* parameter) {
+  for (;;) {
+    unsigned long now = millis();
+    unsigned long waitMs = SCHEDULE_IDLE;
+    char host[sizeof(dnsCache[0].host)];
+    bool due = false;
+
+    // Refreshing while offline would only mark every entry stale
+    if (!wifiOnline) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DNS_RETRY_MS));
+      continue;
+    }
+
+    portENTER_CRITICAL(&dnsCacheLock);
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+      DnsCacheEntry& entry = dnsCache[i];
+      if (!entry.inUse) {
+        continue;
+      }
+      if (now - entry.lastUsed >= DNS_IDLE_EVICT_MS) {
+        entry.inUse = false;
+        continue;
+      }
+      long untilRefresh = (long)(entry.refreshAt - now);
+      if (untilRefresh <= 0 && !due) {
+        strcpy(host, entry.host);
+        due = true;
+      } else {
+        waitMs = min(waitMs, (unsigned long)max(untilRefresh, 0L));
+      }
+    }
+    portEXIT_CRITICAL(&dnsCacheLock);
+
+    if (due) {
+      uint32_t address;
+      uint32_t ttl;
+      String error;
+      bool ok = queryDns(host, address, ttl, error);
+      storeDnsResult(host, ok, address, ttl);
+      continue;
+    }
+
+    // Idle hosts are evicted lazily, waking once an interval is enough to notice them
+    waitMs = min(waitMs, DNS_IDLE_EVICT_MS);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+  }
+}
+
+// Asks the primary server, then the secondary
+bool queryDns(const char* host, uint32_t& address, uint32_t& ttl, String& error) {
+  error = "DNS lookup failed";
+  for (uint8_t i = 0; i < 2; i++) {
+    IPAddress server = WiFi.dnsIP(i);
+    if ((uint32_t)server != 0 && queryDnsServer(server, host, address, ttl, error)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// One A query over UDP, the answer's TTL is clamped to DNS_MIN_TTL_S..DNS_MAX_TTL_S
+bool queryDnsServer(IPAddress server, const char* host, uint32_t& address, uint32_t& ttl, String& error) {
+  uint8_t packet[512];
+  uint16_t id = random(0, 0x10000);
+  memset(packet, 0, 12);
+  packet[0] = id >> 8;
+  packet[1] = id & 0xFF;
+  packet[2] = 0x01;  // recursion desired
+  packet[5] = 1;     // one question
+
+  size_t pos = 12;
+  const char* label = host;
+  while (*label) {
+    const char* dot = strchr(label, '.');
+    size_t labelLength = dot ? dot - label : strlen(label);
+    if (labelLength == 0 || labelLength > 63 || pos + labelLength + 6 > sizeof(packet)) {
+      error = "DNS invalid host name";
+      return false;
+    }
+    packet[pos++] = labelLength;
+    memcpy(packet + pos, label, labelLength);
+    pos += labelLength;
+    label += labelLength + (dot ? 1 : 0);
+  }
+  packet[pos++] = 0;
+  packet[pos++] = 0;
+  packet[pos++] = 1;  // type A
+  packet[pos++] = 0;
+  packet[pos++] = 1;  // class IN
+
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0) {
+    return false;
+  }
+  struct timeval timeout;
+  timeout.tv_sec = DNS_QUERY_TIMEOUT_MS / 1000;
+  timeout.tv_usec = DNS_QUERY_TIMEOUT_MS % 1000 * 1000;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(53);
+  to.sin_addr.s_addr = (uint32_t)server;
+  sendto(sock, packet, pos, 0, (sockaddr*)&to, sizeof(to));
+
+  // Anything that isn't the answer to this query is ignored until the timeout
+  int length;
+  do {
+    length = recvfrom(sock, packet, sizeof(packet), 0, NULL, NULL);
+  } while (length >= 12 && (packet[0] != (id >> 8) || packet[1] != (id & 0xFF)));
+  lwip_close(sock);
+
+  if (length < 12) {
+    error = "DNS timeout";
+    return false;
+  }
+  if ((packet[3] & 0x0F) == 3) {
+    error = "DNS name not found";
+    return false;
+  }
+  if ((packet[3] & 0x0F) != 0) {
+    error = "DNS server error " + String(packet[3] & 0x0F);
+    return false;
+  }
+
+  uint16_t questions = packet[4] << 8 | packet[5];
+  uint16_t answers = packet[6] << 8 | packet[7];
+  pos = 12;
+  for (uint16_t i = 0; i < questions && pos != 0; i++) {
+    pos = skipDnsName(packet, length, pos);
+    pos = pos != 0 ? pos + 4 : 0;
+  }
+
+  // CNAME records come before the address, the shortest TTL along the chain wins
+  uint32_t minTtl = DNS_MAX_TTL_S;
+  for (uint16_t i = 0; i < answers && pos != 0; i++) {
+    pos = skipDnsName(packet, length, pos);
+    if (pos == 0 || pos + 10 > (size_t)length) {
+      break;
+    }
+    uint16_t type = packet[pos] << 8 | packet[pos + 1];
+    uint32_t recordTtl = (uint32_t)packet[pos + 4] << 24 | (uint32_t)packet[pos + 5] << 16 |
+                         (uint32_t)packet[pos + 6] << 8 | packet[pos + 7];
+    uint16_t dataLength = packet[pos + 8] << 8 | packet[pos + 9];
+    pos += 10;
+    if (pos + dataLength > (size_t)length) {
+      break;
+    }
+    minTtl = min(minTtl, recordTtl);
+    if (type == 1 && dataLength == 4) {
+      memcpy(&address, packet + pos, 4);
+      ttl = max(minTtl, DNS_MIN_TTL_S);
+      return true;
+    }
+    pos += dataLength;
+  }
+
+  error = "DNS no address record";
+  return false;
+}
+
+// Position after the name at pos, 0 when the name runs past the packet
+size_t skipDnsName(const uint8_t* packet, size_t length, size_t pos) {
+  while (pos < length) {
+    uint8_t labelLength = packet[pos];
+    if ((labelLength & 0xC0) == 0xC0) {
+      return pos + 2 <= length ? pos + 2 : 0;
+    }
+    if (labelLength == 0) {
+      return pos + 1;
+    }
+    pos += labelLength + 1;
+  }
+  return 0;
+}
+
+void initAlerts() {
+  alertDestinations[ALERT_WEBHOOK] = { "webhook", ALERT_WEBHOOK_URL };
+  alertDestinations[ALERT_NTFY] = { "ntfy", ALERT_NTFY_URL };
+  for (int i = 0; i < ALERT_DESTINATION_COUNT; i++) {
+    AlertDestination& destination = alertDestinations[i];
+    destination.backoffMs = ALERT_RETRY_MIN_MS;
+    destination.tokens = ALERT_RATE_BURST;
+    destination.refilledAt = millis();
+    if (destination.url[0] != '\0') {
+      alertDestinationMask |= 1 << i;
+    }
+  }
+
+  if (alertDestinationMask == 0) {
+    Serial.println("No alert destinations configured");
+    return;
+  }
+  alertQueue = xQueueCreate(ALERT_QUEUE_LENGTH, sizeof(AlertEvent));
+  xTaskCreatePinnedToCore(alertTask, "alerts", ALERT_TASK_STACK_SIZE, NULL, 1, &alertTaskHandle, 0);
+}
+
+// Called with servicesMutex held, never blocks. A full queue drops the event
+void queueAlert(int slot, AlertState state) {
+  if (alertQueue == NULL || (serviceState[slot].flags & SERVICE_BENCHMARK) ||
+      serviceState[slot].peerRole == PEER_ROLE_SECONDARY || serviceState[slot].peerRole == PEER_ROLE_REMOTE) {
+    return;
+  }
+
+  const ServiceConfig& config = serviceConfig[slot];
+  AlertEvent event;
+  strlcpy(event.serviceId, config.id, sizeof(event.serviceId));
+  strlcpy(event.name, arenaString(config.name), sizeof(event.name));
+  event.state = state;
+  strlcpy(event.error, state == ALERT_DOWN ? config.lastError : "", sizeof(event.error));
+  event.time = historyNow();
+  if (xQueueSend(alertQueue, &event, 0) != pdTRUE) {
+    alertsDropped++;
+  }
+}
+
+void alertTask(void* parameter) {
+  loadAlertSpool();
+  bool changed = false;
+
+  for (;;) {
+    unsigned long waitMs = nextAlertAttemptMs();
+    AlertEvent event;
+    if (xQueueReceive(alertQueue, &event, waitMs == SCHEDULE_IDLE ? portMAX_DELAY : pdMS_TO_TICKS(waitMs)) == pdTRUE) {
+      addPendingAlert(event);
+      // Let the rest of a burst arrive so it goes out as one batch
+      unsigned long windowEnd = millis() + ALERT_BATCH_WINDOW_MS;
+      long remaining;
+      while ((remaining = (long)(windowEnd - millis())) > 0 &&
+             xQueueReceive(alertQueue, &event, pdMS_TO_TICKS(remaining)) == pdTRUE) {
+        addPendingAlert(event);
+      }
+      changed = true;
+    }
+
+    changed |= deliverPendingAlerts();
+    alertsPendingPublished = alertPendingCount;
+
+    // Only what is still undelivered goes to flash, a batch that went straight out costs no write
+    if (changed) {
+      saveAlertSpool();
+      changed = false;
+    }
+  }
+}
+
+void addPendingAlert(const AlertEvent& event) {
+  if (alertPendingCount == ALERT_PENDING_MAX) {
+    memmove(alertPending, alertPending + 1, sizeof(AlertPending) * (ALERT_PENDING_MAX - 1));
+    alertPendingCount--;
+    alertsDropped++;
+  }
+  alertPending[alertPendingCount].event = event;
+  alertPending[alertPendingCount].undelivered = alertDestinationMask;
+  alertPendingCount++;
+}
+
+// One batch per destination that is due and has a send left, returns whether anything was delivered
+bool deliverPendingAlerts() {
+  if (!wifiOnline) {
+    return false;
+  }
+
+  bool delivered = false;
+  for (int i = 0; i < ALERT_DESTINATION_COUNT; i++) {
+    AlertDestination& destination = alertDestinations[i];
+    uint8_t bit = 1 << i;
+    unsigned long now = millis();
+
+    if (destination.tokens < ALERT_RATE_BURST) {
+      unsigned long refills = (now - destination.refilledAt) / ALERT_RATE_REFILL_MS;
+      destination.tokens = min((unsigned long)ALERT_RATE_BURST, destination.tokens + refills);
+      destination.refilledAt += refills * ALERT_RATE_REFILL_MS;
+    } else {
+      destination.refilledAt = now;
+    }
+    if (!(alertDestinationMask & bit) || destination.tokens == 0 || (long)(destination.nextAttempt - now) > 0) {
+      continue;
+    }
+
+    AlertEvent batch[ALERT_BATCH_MAX];
+    int indexes[ALERT_BATCH_MAX];
+    int count = 0;
+    for (int j = 0; j < alertPendingCount && count < ALERT_BATCH_MAX; j++) {
+      if (alertPending[j].undelivered & bit) {
+        batch[count] = alertPending[j].event;
+        indexes[count++] = j;
+      }
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    destination.tokens--;
+    if (!sendAlertBatch(i, batch, count)) {
+      destination.failed++;
+      destination.nextAttempt = millis() + destination.backoffMs;
+      Serial.printf("Alert delivery to %s failed, retrying in %lu s\n", destination.name, destination.backoffMs / 1000);
+      destination.backoffMs = min(destination.backoffMs * 2, ALERT_RETRY_MAX_MS);
+      continue;
+    }
+    destination.sent++;
+    destination.backoffMs = ALERT_RETRY_MIN_MS;
+    for (int j = 0; j < count; j++) {
+      alertPending[indexes[j]].undelivered &= ~bit;
+    }
+    delivered = true;
+  }
+
+  // Drop whatever every destination has now
+  int kept = 0;
+  for (int j = 0; j < alertPendingCount; j++) {
+    if (alertPending[j].undelivered != 0) {
+      alertPending[kept++] = alertPending[j];
+    }
+  }
+  alertPendingCount = kept;
+  return delivered;
+}
+
+// How long the sender can sleep before a destination with pending alerts may be tried again
+unsigned long nextAlertAttemptMs() {
+  if (alertPendingCount == 0) {
+    return SCHEDULE_IDLE;
+  }
+  if (!wifiOnline) {
+    return ALERT_OFFLINE_POLL_MS;
+  }
+
+  unsigned long now = millis();
+  unsigned long waitMs = SCHEDULE_IDLE;
+  for (int i = 0; i < ALERT_DESTINATION_COUNT; i++) {
+    const AlertDestination& destination = alertDestinations[i];
+    bool waiting = false;
+    for (int j = 0; j < alertPendingCount && !waiting; j++) {
+      waiting = alertPending[j].undelivered & (1 << i);
+    }
+    if (!waiting) {
+      continue;
+    }
+
+    long untilAttempt = (long)(destination.nextAttempt - now);
+    if (destination.tokens == 0) {
+      untilAttempt = max(untilAttempt, (long)(destination.refilledAt + ALERT_RATE_REFILL_MS - now));
+    }
+    waitMs = min(waitMs, (unsigned long)max(untilAttempt, 0L));
+  }
+  return waitMs;
+}
+
+bool sendAlertBatch(int destination, const AlertEvent* events, int count) {
+  const char* url = alertDestinations[destination].url;
+  WiFiClient plainClient;
+  WiFiClientSecure secureClient;
+  bool secure = strncmp(url, "https://", 8) == 0;
+  if (secure) {
+    secureClient.setInsecure();
+  }
+
+  HTTPClient http;
+  if (!http.begin(secure ? secureClient : plainClient, url)) {
+    return false;
+  }
+  http.setTimeout(ALERT_TIMEOUT_MS);
+
+  bool anyDown = false;
+  for (int i = 0; i < count; i++) {
+    anyDown |= events[i].state == ALERT_DOWN;
+  }
+
+  String body;
+  if (destination == ALERT_WEBHOOK) {
+    JsonDocument doc;
+    JsonArray list = doc["events"].to<JsonArray>();
+    for (int i = 0; i < count; i++) {
+      JsonObject entry = list.add<JsonObject>();
+      entry["id"] = events[i].serviceId;
+      entry["name"] = events[i].name;
+      entry["state"] = alertStateName(events[i].state);
+      entry["error"] = events[i].error;
+      entry["time"] = events[i].time;
+    }
+    serializeJson(doc, body);
+    http.addHeader("Content-Type", "application/json");
+  } else {
+    // ntfy takes a plain text body, the title and priority go in headers
+    for (int i = 0; i < count; i++) {
+      body += String(events[i].name) + " is " + alertStateName(events[i].state);
+      if (events[i].error[0] != '\0') {
+        body += String(" (") + events[i].error + ")";
+      }
+      body += "\n";
+    }
+    http.addHeader("Title", count == 1
+      ? String(events[0].name) + " is " + alertStateName(events[0].state)
+      : String(count) + " services changed state");
+    http.addHeader("Priority", anyDown ? "high" : "default");
+    http.addHeader("Tags", anyDown ? "rotating_light" : "white_check_mark");
+  }
+
+  int code = http.POST(body);
+  http.end();
+  return code >= 200 && code < 300;
+}
+
+const char* alertStateName(uint8_t state) {
+  switch (state) {
+    case ALERT_DOWN: return "DOWN";
+    case ALERT_DEGRADED: return "DEGRADED";
+    default: return "UP";
+  }
+}
+
+// Rewritten whenever the pending set changes, removed once nothing is waiting
+void saveAlertSpool() {
+  if (alertPendingCount == 0) {
+    if (LittleFS.exists(ALERT_SPOOL_PATH)) {
+      LittleFS.remove(ALERT_SPOOL_PATH);
+    }
+    return;
+  }
+
+  AlertSpoolHeader header;
+  header.magic = ALERT_SPOOL_MAGIC;
+  header.count = alertPendingCount;
+  header.recordSize = sizeof(AlertPending);
+  header.crc = crc32Update(0, (const uint8_t*)alertPending, sizeof(AlertPending) * alertPendingCount);
+
+  File file = LittleFS.open(ALERT_SPOOL_TEMP_PATH, "w");
+  bool written = file && file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+    file.write((const uint8_t*)alertPending, sizeof(AlertPending) * alertPendingCount) == sizeof(AlertPending) * alertPendingCount;
+  file.close();
+  if (!written || !LittleFS.rename(ALERT_SPOOL_TEMP_PATH, ALERT_SPOOL_PATH)) {
+    Serial.println("Failed to spool alerts");
+  }
+}
+
+// Runs on the sender task before anything new is queued
+void loadAlertSpool() {
+  File file = LittleFS.open(ALERT_SPOOL_PATH, "r");
+  if (!file) {
+    return;
+  }
+
+  AlertSpoolHeader header;
+  bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.magic == ALERT_SPOOL_MAGIC &&
+    header.recordSize == sizeof(AlertPending) && header.count <= ALERT_PENDING_MAX &&
+    file.read((uint8_t*)alertPending, sizeof(AlertPending) * header.count) == sizeof(AlertPending) * header.count &&
+    header.crc == crc32Update(0, (const uint8_t*)alertPending, sizeof(AlertPending) * header.count);
+  file.close();
+
+  if (!ok) {
+    Serial.println("Discarding unreadable alert spool");
+    LittleFS.remove(ALERT_SPOOL_PATH);
+    return;
+  }
+
+  // Destinations turned off since the spool was written are dropped
+  alertPendingCount = 0;
+  for (int i = 0; i < header.count; i++) {
+    alertPending[i].undelivered &= alertDestinationMask;
+    if (alertPending[i].undelivered != 0) {
+      alertPending[alertPendingCount++] = alertPending[i];
+    }
+  }
+  alertsPendingPublished = alertPendingCount;
+  Serial.printf("Loaded %d undelivered alerts\n", alertPendingCount);
+}
+
+void initMqtt() {
+  if (MQTT_HOST[0] == '\0') {
+    return;
+  }
+  mqttQueue = xQueueCreate(MQTT_QUEUE_LENGTH, sizeof(MqttUpdate));
+  xTaskCreatePinnedToCore(mqttTask, "mqtt", MQTT_TASK_STACK_SIZE, NULL, 1, &mqttTaskHandle, 0);
+}
+
+// Called with servicesMutex held, never blocks
+void queueMqttUpdate(MqttUpdateKind kind, int slot) {
+  if (mqttQueue == NULL || (serviceState[slot].flags & SERVICE_BENCHMARK)) {
+    return;
+  }
+  MqttUpdate update;
+  update.kind = kind;
+  update.slot = slot;
+  strlcpy(update.serviceId, serviceConfig[slot].id, sizeof(update.serviceId));
+  if (xQueueSend(mqttQueue, &update, 0) != pdTRUE) {
+    mqttResync = true;
+  }
+}
+
+// 0 down, 1 + band while up, 1 + band count when degraded
+uint8_t mqttClassFor(uint8_t flags, uint32_t totalUs) {
+  const int bands = sizeof(MQTT_LATENCY_BANDS_MS) / sizeof(MQTT_LATENCY_BANDS_MS[0]);
+  if (!(flags & SERVICE_UP)) {
+    return 0;
+  }
+  if (flags & SERVICE_DEGRADED) {
+    return 2 + bands;
+  }
+  int band = 0;
+  while (band < bands && totalUs >= MQTT_LATENCY_BANDS_MS[band] * 1000) {
+    band++;
+  }
+  return 1 + band;
+}
+
+void mqttTask(void* parameter) {
+  WiFiClient client;
+  PubSubClient mqtt(client);
+  mqtt.setServer(MQTT_HOST, MQTT_PORT);
+  mqtt.setBufferSize(MQTT_BUFFER_SIZE);
+  mqtt.setCallback([](char* topic, uint8_t* payload, unsigned int length) {
+    // Home Assistant announces a restart, its discovered entities need their config again
+    if (length == 6 && memcmp(payload, "online", 6) == 0) {
+      mqttResync = true;
+    }
+  });
+
+  ServiceSnapshot service;
+  unsigned long retryAt = 0;
+  unsigned long retryMs = MQTT_RETRY_MIN_MS;
+
+  for (;;) {
+    if (!mqtt.connected()) {
+      if (!wifiOnline || (long)(retryAt - millis()) > 0) {
+        vTaskDelay(pdMS_TO_TICKS(MQTT_LOOP_MS));
+        continue;
+      }
+      if (!connectMqtt(mqtt)) {
+        Serial.printf("MQTT connect failed (state %d), retrying in %lu s\n", mqtt.state(), retryMs / 1000);
+        retryAt = millis() + retryMs;
+        retryMs = min(retryMs * 2, MQTT_RETRY_MAX_MS);
+        continue;
+      }
+      retryMs = MQTT_RETRY_MIN_MS;
+      mqttResync = true;
+    }
+
+    if (mqttResync.exchange(false)) {
+      // The queue only holds what changed since, the full pass below covers all of it
+      xQueueReset(mqttQueue);
+      for (int slot = 0; slot < MAX_SERVICES; slot++) {
+        if (readPublishedService(slot, service) && service.inUse) {
+          publishMqttDiscovery(mqtt, service);
+          publishMqttState(mqtt, service);
+        }
+        mqtt.loop();
+      }
+    }
+
+    MqttUpdate update;
+    if (xQueueReceive(mqttQueue, &update, pdMS_TO_TICKS(MQTT_LOOP_MS)) == pdTRUE) {
+      if (update.kind == MQTT_REMOVE) {
+        clearMqttService(mqtt, update.serviceId);
+      } else if (readPublishedService(update.slot, service) && service.inUse &&
+                 strcmp(service.id, update.serviceId) == 0) {
+        if (update.kind == MQTT_DISCOVERY) {
+          publishMqttDiscovery(mqtt, service);
+        }
+        publishMqttState(mqtt, service);
+      }
+    }
+    mqtt.loop();
+  }
+}
+
+// Availability goes out as a retained last will, so Home Assistant marks everything unavailable if we drop off
+bool connectMqtt(PubSubClient& mqtt) {
+  String deviceId = mqttDeviceId();
+  String availability = String(MQTT_BASE_TOPIC) + "/status";
+  bool connected = MQTT_USER[0] != '\0'
+    ? mqtt.connect(deviceId.c_str(), MQTT_USER, MQTT_PASSWORD, availability.c_str(), 1, true, "offline")
+    : mqtt.connect(deviceId.c_str(), NULL, NULL, availability.c_str(), 1, true, "offline");
+  if (!connected) {
+    return false;
+  }
+
+  mqtt.publish(availability.c_str(), "online", true);
+  mqtt.subscribe((String(MQTT_DISCOVERY_PREFIX) + "/status").c_str());
+  Serial.printf("MQTT connected to %s:%d\n", MQTT_HOST, MQTT_PORT);
+  return true;
+}
+
+void publishMqttDiscovery(PubSubClient& mqtt, const ServiceSnapshot& service) {
+  String deviceId = mqttDeviceId();
+  String objectId = deviceId + "_" + service.id;
+
+  JsonDocument doc;
+  doc["name"] = service.name;
+  doc["unique_id"] = objectId;
+  doc["device_class"] = "connectivity";
+  doc["state_topic"] = String(MQTT_BASE_TOPIC) + "/" + service.id + "/state";
+  doc["value_template"] = "{{ 'OFF' if value_json.state == 'down' else 'ON' }}";
+  doc["json_attributes_topic"] = doc["state_topic"];
+  doc["availability_topic"] = String(MQTT_BASE_TOPIC) + "/status";
+  JsonObject device = doc["device"].to<JsonObject>();
+  device["identifiers"].to<JsonArray>().add(deviceId);
+  device["name"] = "ESP32 Uptime Monitor";
+  device["model"] = "ESP32-S3";
+
+  char payload[MQTT_BUFFER_SIZE - 128];
+  serializeJson(doc, payload, sizeof(payload));
+  String topic = String(MQTT_DISCOVERY_PREFIX) + "/binary_sensor/" + objectId + "/config";
+  mqtt.publish(topic.c_str(), payload, true);
+}
+
+void publishMqttState(PubSubClient& mqtt, const ServiceSnapshot& service) {
+  JsonDocument doc;
+  doc["state"] = !service.isUp ? "down" : service.isDegraded ? "degraded" : "up";
+  doc["latencyMs"] = service.timing.totalUs / 1000.0f;
+  doc["p95Ms"] = service.p95Us / 1000.0f;
+  doc["error"] = service.lastError;
+  if (service.uptime[1] >= 0) {
+    doc["uptime24h"] = service.uptime[1];
+  }
+
+  char payload[256];
+  serializeJson(doc, payload, sizeof(payload));
+  String topic = String(MQTT_BASE_TOPIC) + "/" + service.id + "/state";
+  mqtt.publish(topic.c_str(), payload, true);
+}
+
+// Empty retained payloads delete the retained state and the discovered entity
+void clearMqttService(PubSubClient& mqtt, const char* serviceId) {
+  String objectId = mqttDeviceId() + "_" + serviceId;
+  mqtt.publish((String(MQTT_DISCOVERY_PREFIX) + "/binary_sensor/" + objectId + "/config").c_str(), "", true);
+  mqtt.publish((String(MQTT_BASE_TOPIC) + "/" + serviceId + "/state").c_str(), "", true);
+}
+
+// uptime_monitor_ plus the MAC without colons, stable across reboots
+String mqttDeviceId() {
+  String mac = WiFi.macAddress();
+  mac.replace(":", "");
+  mac.toLowerCase();
+  return "uptime_monitor_" + mac;
+}
+
+void initPeers() {
+  if (PEER_GROUP[0] == '\0') {
+    return;
+  }
+
+  String mac = WiFi.macAddress();
+  mac.replace(":", "");
+  mac.toLowerCase();
+  peerNodeId = hashServiceId(mac.c_str());
+  snprintf(peerName, sizeof(peerName), "uptime-%s", mac.substring(6).c_str());
+  peerGroupHash = hashServiceId(PEER_GROUP);
+
+  peerObservations = (PeerObservation*)allocCold(sizeof(PeerObservation) * MAX_SERVICES * PEER_MAX);
+  if (peerObservations == NULL) {
+    Serial.println("Peer mode: out of memory, running standalone");
+    return;
+  }
+  memset(peerObservations, 0, sizeof(PeerObservation) * MAX_SERVICES * PEER_MAX);
+
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  assignPeerRoles();
+  xSemaphoreGive(servicesMutex);
+
+  xTaskCreatePinnedToCore(peerTask, "peers", PEER_TASK_STACK_SIZE, NULL, 1, &peerTaskHandle, 0);
+  Serial.printf("Peer mode: %s in group %s\n", peerName, PEER_GROUP);
+}
+
+// Receives digests between its own rounds, the socket timeout paces the loop
+void peerTask(void* parameter) {
+  uint8_t packet[PEER_DIGEST_MAX_SIZE];
+  int sock = -1;
+  bool announced = false;
+  unsigned long nextDigest = 0;
+  unsigned long nextDiscovery = 0;
+
+  for (;;) {
+    if (!wifiOnline) {
+      if (sock >= 0) {
+        lwip_close(sock);
+        sock = -1;
+      }
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      continue;
+    }
+
+    if (!announced) {
+      announced = startPeerAnnouncement();
+    }
+    if (sock < 0) {
+      sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      sockaddr_in local;
+      memset(&local, 0, sizeof(local));
+      local.sin_family = AF_INET;
+      local.sin_port = htons(PEER_PORT);
+      local.sin_addr.s_addr = htonl(INADDR_ANY);
+      if (sock >= 0 && bind(sock, (sockaddr*)&local, sizeof(local)) != 0) {
+        lwip_close(sock);
+        sock = -1;
+      }
+      if (sock < 0) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        continue;
+      }
+      timeval timeout = { 0, 500000 };
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    int length = recvfrom(sock, packet, sizeof(packet), 0, (sockaddr*)&from, &fromLength);
+    if (length > 0) {
+      handlePeerDigest(packet, length, from.sin_addr.s_addr);
+    }
+
+    unsigned long now = millis();
+    if ((long)(now - nextDiscovery) >= 0) {
+      discoverPeers();
+      nextDiscovery = millis() + PEER_DISCOVERY_INTERVAL_MS;
+    }
+    if ((long)(now - nextDigest) >= 0) {
+      sendPeerDigests(sock);
+      expirePeers();
+      nextDigest = now + PEER_DIGEST_INTERVAL_MS;
+    }
+  }
+}
+
+bool startPeerAnnouncement() {
+  if (!MDNS.begin(peerName)) {
+    Serial.println("Peer mode: mDNS failed to start");
+    return false;
+  }
+  char id[9];
+  snprintf(id, sizeof(id), "%08lx", (unsigned long)peerNodeId);
+  MDNS.addService("uptime", "udp", PEER_PORT);
+  MDNS.addServiceTxt("uptime", "udp", "group", PEER_GROUP);
+  MDNS.addServiceTxt("uptime", "udp", "id", id);
+  return true;
+}
+
+// Blocks for the mDNS query, only ever called from the peer task
+void discoverPeers() {
+  int count = MDNS.queryService("uptime", "udp");
+  for (int i = 0; i < count; i++) {
+    if (MDNS.txt(i, "group") != PEER_GROUP) {
+      continue;
+    }
+    uint32_t nodeId = strtoul(MDNS.txt(i, "id").c_str(), NULL, 16);
+    if (nodeId == 0 || nodeId == peerNodeId) {
+      continue;
+    }
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    notePeer(nodeId, (uint32_t)MDNS.IP(i), MDNS.hostname(i).c_str());
+    xSemaphoreGive(servicesMutex);
+  }
+}
+
+// Called with servicesMutex held, returns the peer's index or -1 when the table is full
+int notePeer(uint32_t nodeId, uint32_t address, const char* name) {
+  int freeIndex = -1;
+  for (int i = 0; i < PEER_MAX; i++) {
+    if (peerNodes[i].active && peerNodes[i].nodeId == nodeId) {
+      peerNodes[i].address = address;
+      return i;
+    }
+    if (!peerNodes[i].active && freeIndex < 0) {
+      freeIndex = i;
+    }
+  }
+  if (freeIndex < 0) {
+    return -1;
+  }
+
+  PeerNode& peer = peerNodes[freeIndex];
+  peer.active = true;
+  peer.nodeId = nodeId;
+  peer.address = address;
+  peer.lastSeen = millis();
+  peer.digests = 0;
+  if (name != NULL && name[0] != '\0') {
+    strlcpy(peer.name, name, sizeof(peer.name));
+  } else {
+    snprintf(peer.name, sizeof(peer.name), "%08lx", (unsigned long)nodeId);
+  }
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    peerObservations[slot * PEER_MAX + freeIndex].valid = false;
+  }
+  Serial.printf("Peer joined: %s (%s)\n", peer.name, IPAddress(address).toString().c_str());
+  assignPeerRoles();
+  return freeIndex;
+}
+
+void handlePeerDigest(const uint8_t* packet, size_t length, uint32_t address) {
+  PeerDigestHeader header;
+  if (length < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, packet, sizeof(header));
+  if (header.magic != PEER_DIGEST_MAGIC || header.group != peerGroupHash || header.nodeId == peerNodeId ||
+      header.count > MAX_SERVICES || length < sizeof(header) + header.count * sizeof(PeerDigestEntry)) {
+    return;
+  }
+
+  unsigned long now = millis();
+  bool published = false;
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  int peer = notePeer(header.nodeId, address, NULL);
+  if (peer >= 0) {
+    peerNodes[peer].lastSeen = now;
+    peerNodes[peer].digests++;
+    for (int i = 0; i < header.count; i++) {
+      PeerDigestEntry entry;
+      memcpy(&entry, packet + sizeof(header) + i * sizeof(entry), sizeof(entry));
+      int slot = findPeerServiceSlot(entry.key);
+      if (slot < 0) {
+        continue;
+      }
+      PeerObservation& observation = peerObservations[slot * PEER_MAX + peer];
+      bool changed = !observation.valid || observation.status != entry.status;
+      observation.valid = true;
+      observation.status = entry.status;
+      observation.latencyMs = entry.latencyMs;
+      observation.checkedAt = now - entry.ageS * 1000UL;
+      // Remote services show the peers' latency and age, so they are republished with every digest
+      if (changed || serviceState[slot].peerRole == PEER_ROLE_REMOTE) {
+        publishService(slot);
+        published = true;
+      }
+    }
+  }
+  xSemaphoreGive(servicesMutex);
+
+  if (published) {
+    notifyScheduler();
+  }
+}
+
+// Also the heartbeat, a digest goes out even when this node probes nothing
+void sendPeerDigests(int sock) {
+  uint8_t packet[PEER_DIGEST_MAX_SIZE];
+  uint32_t addresses[PEER_MAX];
+  int peerCount = 0;
+  PeerDigestHeader header;
+  header.magic = PEER_DIGEST_MAGIC;
+  header.group = peerGroupHash;
+  header.nodeId = peerNodeId;
+  header.count = 0;
+  header.reserved = 0;
+
+  unsigned long now = millis();
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    const ServiceState& state = serviceState[slot];
+    if (!(state.flags & SERVICE_IN_USE) || (state.flags & SERVICE_BENCHMARK) ||
+        state.peerRole == PEER_ROLE_REMOTE || serviceCounters[slot].checks == 0) {
+      continue;
+    }
+    PeerDigestEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = serviceConfig[slot].peerKey;
+    entry.latencyMs = min(serviceLatency[slot].last.totalUs / 1000, (uint32_t)65535);
+    entry.ageS = min((now - state.lastCheck) / 1000, 65535UL);
+    entry.status = ((state.flags & SERVICE_UP) ? PEER_STATUS_UP : 0) |
+      ((state.flags & SERVICE_DEGRADED) ? PEER_STATUS_DEGRADED : 0);
+    memcpy(packet + sizeof(header) + header.count * sizeof(entry), &entry, sizeof(entry));
+    header.count++;
+  }
+  for (int i = 0; i < PEER_MAX; i++) {
+    if (peerNodes[i].active) {
+      addresses[peerCount++] = peerNodes[i].address;
+    }
+  }
+  xSemaphoreGive(servicesMutex);
+
+  memcpy(packet, &header, sizeof(header));
+  size_t length = sizeof(header) + header.count * sizeof(PeerDigestEntry);
+  for (int i = 0; i < peerCount; i++) {
+    sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(PEER_PORT);
+    to.sin_addr.s_addr = addresses[i];
+    sendto(sock, packet, length, 0, (sockaddr*)&to, sizeof(to));
+  }
+}
+
+void expirePeers() {
+  unsigned long now = millis();
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  bool changed = false;
+  for (int i = 0; i < PEER_MAX; i++) {
+    PeerNode& peer = peerNodes[i];
+    if (!peer.active || now - peer.lastSeen <= PEER_TIMEOUT_MS) {
+      continue;
+    }
+    Serial.printf("Peer left: %s\n", peer.name);
+    peer.active = false;
+    for (int slot = 0; slot < MAX_SERVICES; slot++) {
+      peerObservations[slot * PEER_MAX + i].valid = false;
+    }
+    changed = true;
+  }
+  if (changed) {
+    assignPeerRoles();
+  }
+  xSemaphoreGive(servicesMutex);
+}
+
+// Called with servicesMutex held whenever a peer joins or leaves
+void assignPeerRoles() {
+  uint32_t nodeIds[PEER_RING_MAX_NODES];
+  int nodeCount = 0;
+  nodeIds[nodeCount] = peerNodeId;
+  peerRingNodes[nodeCount++] = -1;
+  for (int i = 0; i < PEER_MAX; i++) {
+    if (peerNodes[i].active) {
+      nodeIds[nodeCount] = peerNodes[i].nodeId;
+      peerRingNodes[nodeCount++] = i;
+    }
+  }
+  buildPeerRing(peerRing, nodeIds, nodeCount);
+
+  bool reschedule = false;
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    ServiceState& state = serviceState[slot];
+    if (!(state.flags & SERVICE_IN_USE)) {
+      continue;
+    }
+    uint8_t role = peerRoleFor(slot);
+    if (role == state.peerRole) {
+      publishService(slot); // the primary may have changed
+      continue;
+    }
+    // Taking a service over checks it straight away, handing it off forgets what we were confirming
+    if (state.peerRole == PEER_ROLE_REMOTE) {
+      state.nextCheckDue = millis();
+      reschedule = true;
+    } else if (role == PEER_ROLE_REMOTE) {
+      state.failures = 0;
+    }
+    state.peerRole = role;
+    publishService(slot);
+  }
+  if (reschedule) {
+    rebuildSchedule();
+  }
+  notifyScheduler();
+}
+
+// Called with servicesMutex held
+uint8_t peerRoleFor(int slot) {
+  if (peerRing.size == 0 || (serviceState[slot].flags & SERVICE_BENCHMARK)) {
+    return PEER_ROLE_STANDALONE;
+  }
+  int primary, secondary;
+  peerRingOwners(peerRing, serviceConfig[slot].peerKey, primary, secondary);
+  if (secondary < 0) {
+    return PEER_ROLE_STANDALONE;
+  }
+  if (peerRingNodes[primary] < 0) {
+    return PEER_ROLE_PRIMARY;
+  }
+  return peerRingNodes[secondary] < 0 ? PEER_ROLE_SECONDARY : PEER_ROLE_REMOTE;
+}
+
+// Called with servicesMutex held, the first match wins if a target is configured twice
+int findPeerServiceSlot(uint32_t key) {
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if ((serviceState[slot].flags & SERVICE_IN_USE) && !(serviceState[slot].flags & SERVICE_BENCHMARK) &&
+        serviceConfig[slot].peerKey == key) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+// Called from publishService(), a remote service takes its state from the freshest peer observation
+void fillPeerQuorum(int slot, ServiceSnapshot& data) {
+  const ServiceState& state = serviceState[slot];
+  data.peerRole = state.peerRole;
+  data.primary[0] = '\0';
+
+  int observers = 0;
+  int up = 0;
+  if (state.peerRole != PEER_ROLE_REMOTE && serviceCounters[slot].checks > 0) {
+    observers++;
+    up += (state.flags & SERVICE_UP) ? 1 : 0;
+  }
+
+  const PeerObservation* freshest = NULL;
+  if (peerObservations != NULL) {
+    unsigned long now = millis();
+    for (int i = 0; i < PEER_MAX; i++) {
+      const PeerObservation& observation = peerObservations[slot * PEER_MAX + i];
+      if (!observation.valid || !peerNodes[i].active || now - observation.checkedAt > PEER_OBSERVATION_MAX_AGE_MS) {
+        continue;
+      }
+      observers++;
+      up += (observation.status & PEER_STATUS_UP) ? 1 : 0;
+      if (freshest == NULL || (long)(observation.checkedAt - freshest->checkedAt) > 0) {
+        freshest = &observation;
+      }
+    }
+  }
+  data.observers = observers;
+  data.observersUp = up;
+  data.quorum = quorumState(observers, up);
+
+  int primary, secondary;
+  peerRingOwners(peerRing, serviceConfig[slot].peerKey, primary, secondary);
+  if (primary >= 0) {
+    strlcpy(data.primary, peerRingNodes[primary] < 0 ? peerName : peerNodes[peerRingNodes[primary]].name,
+      sizeof(data.primary));
+  }
+
+  if (state.peerRole == PEER_ROLE_REMOTE) {
+    data.isUp = data.quorum == QUORUM_UP;
+    data.isDegraded = freshest != NULL && (freshest->status & PEER_STATUS_DEGRADED);
+    data.failures = 0;
+    data.nextCheckMs = 0;
+    memset(&data.timing, 0, sizeof(data.timing));
+    data.timing.totalUs = freshest != NULL ? freshest->latencyMs * 1000UL : 0;
+    data.lastCheck = freshest != NULL ? freshest->checkedAt : 0;
+    data.lastError[0] = '\0';
+  }
+}
+
+void sendPeerStatus(AsyncWebServerRequest* request) {
+  JsonDocument doc;
+  doc["enabled"] = PEER_GROUP[0] != '\0';
+  if (PEER_GROUP[0] != '\0') {
+    int roles[4] = { 0, 0, 0, 0 };
+    unsigned long now = millis();
+    char id[9];
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    doc["group"] = PEER_GROUP;
+    doc["node"] = peerName;
+    snprintf(id, sizeof(id), "%08lx", (unsigned long)peerNodeId);
+    doc["nodeId"] = id;
+    JsonArray list = doc["peers"].to<JsonArray>();
+    for (int i = 0; i < PEER_MAX; i++) {
+      const PeerNode& peer = peerNodes[i];
+      if (!peer.active) {
+        continue;
+      }
+      JsonObject entry = list.add<JsonObject>();
+      entry["node"] = peer.name;
+      snprintf(id, sizeof(id), "%08lx", (unsigned long)peer.nodeId);
+      entry["nodeId"] = id;
+      entry["ip"] = IPAddress(peer.address).toString();
+      entry["lastSeenSeconds"] = (now - peer.lastSeen) / 1000;
+      entry["digests"] = peer.digests;
+    }
+    for (int slot = 0; slot < MAX_SERVICES; slot++) {
+      if (serviceState[slot].flags & SERVICE_IN_USE) {
+        roles[serviceState[slot].peerRole]++;
+      }
+    }
+    xSemaphoreGive(servicesMutex);
+
+    JsonObject services = doc["services"].to<JsonObject>();
+    for (int i = 0; i < 4; i++) {
+      services[PEER_ROLE_NAMES[i]] = roles[i];
+    }
+  }
+
+  String response;
+  serializeJson(doc, response);
+  request->send(200, "application/json", response);
+}
+
+HandlerTimer::~HandlerTimer() {
+  uint32_t elapsedUs = micros() - startedUs;
+  HandlerStats& stats = handlerStats[route];
+  stats.count++;
+  stats.totalUs += elapsedUs;
+  stats.maxUs = max(stats.maxUs, elapsedUs);
+}
+
+// Upper edge of the latencyBucket() bucket holding the percentile, 0 without samples
+uint32_t bucketPercentile(const uint32_t* counts, int percent) {
+  uint64_t total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (total * percent + 99) / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return latencyBucketUpperUs(i);
+    }
+  }
+  return latencyBucketUpperUs(LATENCY_BUCKETS - 1);
+}
+
+// Runs on the loop task
+unsigned long sampleHeapIfDue() {
+  unsigned long now = millis();
+  long untilSample = (long)(nextHeapSample - now);
+  if (heapSampleNewest >= 0 && untilSample > 0) {
+    return untilSample;
+  }
+
+  HeapSample sample;
+  sample.uptimeS = now / 1000;
+  sample.freeHeap = ESP.getFreeHeap();
+  sample.largestBlock = ESP.getMaxAllocHeap();
+  portENTER_CRITICAL(&heapSamplesLock);
+  heapSampleNewest = (heapSampleNewest + 1) % HEAP_SAMPLES;
+  heapSamples[heapSampleNewest] = sample;
+  heapSampleCount = min(heapSampleCount + 1, HEAP_SAMPLES);
+  portEXIT_CRITICAL(&heapSamplesLock);
+
+  // Sampled together so low-power mode doesn't gain another wakeup
+  samplePower();
+
+  nextHeapSample = now + HEAP_SAMPLE_MS;
+  return HEAP_SAMPLE_MS;
+}
+
+void initPower() {
+  for (int cpu = 0; cpu < portNUM_PROCESSORS; cpu++) {
+    powerIdleTasks[cpu] = xTaskGetIdleTaskHandleForCPU(cpu);
+    esp_register_freertos_tick_hook_for_cpu(powerTickHook, cpu);
+  }
+  powerLastUs = esp_timer_get_time();
+
+  if (!LOW_POWER_MODE) {
+    return;
+  }
+  esp_pm_config_esp32s3_t config;
+  config.max_freq_mhz = POWER_MAX_FREQ_MHZ;
+  config.min_freq_mhz = POWER_MIN_FREQ_MHZ;
+  config.light_sleep_enable = true;
+  esp_err_t result = esp_pm_configure(&config);
+  if (result != ESP_OK) {
+    // Most likely an IDF without tickless idle, frequency scaling alone still helps
+    config.light_sleep_enable = false;
+    esp_err_t fallback = esp_pm_configure(&config);
+    Serial.printf("Light sleep unavailable (%s), %s\n", esp_err_to_name(result),
+      fallback == ESP_OK ? "scaling the CPU clock only" : "running at full clock");
+    return;
+  }
+  powerLightSleep = true;
+  Serial.printf("Low-power mode on, CPU %d-%d MHz with light sleep\n", POWER_MIN_FREQ_MHZ, POWER_MAX_FREQ_MHZ);
+}
+
+// Runs in the tick interrupt of each core
+void powerTickHook() {
+  int cpu = xPortGetCoreID();
+  powerTicks[cpu]++;
+  if (xTaskGetCurrentTaskHandle() != powerIdleTasks[cpu]) {
+    powerBusyTicks[cpu]++;
+  }
+}
+
+// Closes the current measurement window
+void samplePower() {
+  int64_t now = esp_timer_get_time();
+  uint32_t elapsedMs = (now - powerLastUs) / 1000;
+  if (elapsedMs == 0) {
+    return;
+  }
+
+  uint32_t ticks = 0;
+  uint32_t busyTicks = 0;
+  for (int cpu = 0; cpu < portNUM_PROCESSORS; cpu++) {
+    uint32_t coreTicks = powerTicks[cpu];
+    uint32_t coreBusyTicks = powerBusyTicks[cpu];
+    ticks += coreTicks - powerLastTicks[cpu];
+    busyTicks += coreBusyTicks - powerLastBusyTicks[cpu];
+    powerLastTicks[cpu] = coreTicks;
+    powerLastBusyTicks[cpu] = coreBusyTicks;
+  }
+  powerLastUs = now;
+
+  float coreMs = (float)elapsedMs * portNUM_PROCESSORS;
+  PowerWindow window;
+  window.awakeFraction = min(ticks * portTICK_PERIOD_MS / coreMs, 1.0f);
+  window.busyFraction = min(busyTicks * portTICK_PERIOD_MS / coreMs, window.awakeFraction);
+  window.durationMs = elapsedMs;
+  portENTER_CRITICAL(&powerLock);
+  powerWindow = window;
+  portEXIT_CRITICAL(&powerLock);
+}
+
+float estimatedCurrentMa(const PowerWindow& window, bool modemSleep) {
+  float idleAwake = window.awakeFraction - window.busyFraction;
+  float asleep = 1.0f - window.awakeFraction;
+  return window.busyFraction * POWER_ACTIVE_MA + idleAwake * (modemSleep ? POWER_MODEM_SLEEP_MA : POWER_IDLE_MA) +
+    asleep * POWER_LIGHT_SLEEP_MA;
+}
+
+void sendDiagnostics(AsyncWebServerRequest* request) {
+  JsonDocument doc;
+  doc["uptimeSeconds"] = millis() / 1000;
+
+  JsonObject scheduler = doc["scheduler"].to<JsonObject>();
+  scheduler["lastLagMs"] = schedulerLagMs;
+  scheduler["maxLagMs"] = schedulerMaxLagMs;
+  JsonArray lags = scheduler["services"].to<JsonArray>();
+
+  JsonObject durations = doc["checkDurations"].to<JsonObject>();
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if (!(serviceState[slot].flags & SERVICE_IN_USE)) {
+      continue;
+    }
+    JsonObject lag = lags.add<JsonObject>();
+    lag["id"] = serviceConfig[slot].id;
+    lag["lastMs"] = serviceLag[slot].lastMs;
+    lag["maxMs"] = serviceLag[slot].maxMs;
+  }
+  for (int type = 0; type < SERVICE_TYPE_COUNT; type++) {
+    uint32_t count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      count += typeDurationCounts[type][i];
+    }
+    if (count == 0) {
+      continue;
+    }
+    JsonObject entry = durations[getServiceTypeString((ServiceType)type)].to<JsonObject>();
+    entry["count"] = count;
+    entry["p50Ms"] = bucketPercentile(typeDurationCounts[type], 50) / 1000.0f;
+    entry["p95Ms"] = bucketPercentile(typeDurationCounts[type], 95) / 1000.0f;
+    entry["p99Ms"] = bucketPercentile(typeDurationCounts[type], 99) / 1000.0f;
+    entry["maxMs"] = typeDurationMaxUs[type] / 1000.0f;
+  }
+  serializeBenchmark(doc["benchmark"].to<JsonObject>());
+  xSemaphoreGive(servicesMutex);
+
+  // ESP-IDF reports the high-water mark in bytes
+  JsonArray stacks = doc["stacks"].to<JsonArray>();
+  addTaskStack(stacks, "loop", schedulerTaskHandle);
+  for (int i = 0; i < CHECK_WORKER_COUNT; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "check%d", i);
+    addTaskStack(stacks, name, checkWorkerHandles[i]);
+  }
+  addTaskStack(stacks, "ping", pingTaskHandle);
+  addTaskStack(stacks, "dns", dnsTaskHandle);
+  addTaskStack(stacks, "alerts", alertTaskHandle);
+  addTaskStack(stacks, "mqtt", mqttTaskHandle);
+  addTaskStack(stacks, "async_tcp", xTaskGetCurrentTaskHandle());
+
+  JsonObject heap = doc["heap"].to<JsonObject>();
+  heap["free"] = ESP.getFreeHeap();
+  heap["minFree"] = ESP.getMinFreeHeap();
+  heap["largestBlock"] = ESP.getMaxAllocHeap();
+  HeapSample samples[HEAP_SAMPLES];
+  portENTER_CRITICAL(&heapSamplesLock);
+  int sampleCount = heapSampleCount;
+  int newest = heapSampleNewest;
+  memcpy(samples, heapSamples, sizeof(samples));
+  portEXIT_CRITICAL(&heapSamplesLock);
+  // Oldest first
+  JsonArray history = heap["history"].to<JsonArray>();
+  for (int i = sampleCount - 1; i >= 0; i--) {
+    const HeapSample& sample = samples[(newest - i + HEAP_SAMPLES) % HEAP_SAMPLES];
+    JsonObject entry = history.add<JsonObject>();
+    entry["uptimeSeconds"] = sample.uptimeS;
+    entry["free"] = sample.freeHeap;
+    entry["largestBlock"] = sample.largestBlock;
+  }
+
+  // Over the last heap sample interval
+  portENTER_CRITICAL(&powerLock);
+  PowerWindow window = powerWindow;
+  portEXIT_CRITICAL(&powerLock);
+  bool modemSleep = WiFi.getSleep() != WIFI_PS_NONE;
+  JsonObject power = doc["power"].to<JsonObject>();
+  power["lowPowerMode"] = LOW_POWER_MODE;
+  power["modemSleep"] = modemSleep;
+  power["lightSleep"] = powerLightSleep;
+  if (window.durationMs > 0) {
+    power["windowSeconds"] = window.durationMs / 1000;
+    power["busyPercent"] = window.busyFraction * 100;
+    power["awakePercent"] = window.awakeFraction * 100;
+    power["estimatedCurrentMa"] = estimatedCurrentMa(window, modemSleep);
+  }
+
+  JsonObject handlers = doc["handlers"].to<JsonObject>();
+  for (int i = 0; i < ROUTE_COUNT; i++) {
+    const HandlerStats& stats = handlerStats[i];
+    JsonObject entry = handlers[HANDLER_ROUTE_NAMES[i]].to<JsonObject>();
+    entry["count"] = stats.count;
+    entry["avgMs"] = stats.count > 0 ? stats.totalUs / stats.count / 1000.0f : 0;
+    entry["maxMs"] = stats.maxUs / 1000.0f;
+  }
+
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  serializeJson(doc, *response);
+  request->send(response);
+}
+
+void addTaskStack(JsonArray stacks, const char* name, TaskHandle_t handle) {
+  if (handle == NULL) {
+    return;
+  }
+  JsonObject entry = stacks.add<JsonObject>();
+  entry["task"] = name;
+  entry["freeBytes"] = uxTaskGetStackHighWaterMark(handle);
+}
+
+void startBenchmark(AsyncWebServerRequest* request, const char* body, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, body, length)) {
+    request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+    return;
+  }
+  int services = doc["services"] | 0;
+  uint32_t intervalS = max(doc["interval"] | 1, 1);
+  uint32_t durationS = doc["duration"] | 60;
+  if (services <= 0 || durationS == 0 || durationS > BENCHMARK_MAX_DURATION_S) {
+    sendJsonError(request, 400, "Invalid benchmark parameters");
+    return;
+  }
+  startBenchmarkServer();
+
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  if (benchmark.running) {
+    xSemaphoreGive(servicesMutex);
+    sendJsonError(request, 409, "Benchmark already running");
+    return;
+  }
+
+  unsigned long now = millis();
+  int added = 0;
+  for (; added < services; added++) {
+    char id[16];
+    char name[24];
+    snprintf(id, sizeof(id), "bench-%d", added);
+    snprintf(name, sizeof(name), "Benchmark %d", added);
+    ServiceDefinition definition;
+    definition.id = id;
+    definition.name = name;
+    definition.type = TYPE_HTTP_GET;
+    definition.host = "127.0.0.1";
+    definition.port = BENCHMARK_PORT;
+    definition.path = "/";
+    definition.expectedResponse = "*";
+    definition.rules = "";
+    definition.authToken = "";
+    definition.parent = "";
+    definition.group = "";
+    definition.connectTimeoutMs = 0;
+    definition.readTimeoutMs = 0;
+    definition.pingCount = 0;
+    definition.checkInterval = intervalS;
+    definition.maxScanBytes = DEFAULT_MAX_SCAN_BYTES;
+    definition.degradedMs = 0;
+    definition.confirmChecks = 0;
+    definition.retryInterval = DEFAULT_RETRY_INTERVAL;
+    definition.maxBackoff = 0;
+    int slot = addService(definition, SERVICE_BENCHMARK);
+    if (slot < 0) {
+      break;
+    }
+    // Staggered over one interval like a freshly booted device
+    serviceState[slot].nextCheckDue = now + (uint64_t)intervalS * 1000 * added / services;
+  }
+
+  memset(&benchmark, 0, sizeof(benchmark));
+  benchmark.running = added > 0;
+  benchmark.services = added;
+  benchmark.intervalS = intervalS;
+  benchmark.startedMs = now;
+  benchmark.endsMs = now + durationS * 1000;
+  rebuildSchedule();
+  xSemaphoreGive(servicesMutex);
+
+  if (added == 0) {
+    sendJsonError(request, 400, "No free service slots");
+    return;
+  }
+  notifyScheduler();
+  Serial.printf("Benchmark started with %d services every %lu s for %lu s\n", added,
+    (unsigned long)intervalS, (unsigned long)durationS);
+
+  JsonDocument response;
+  response["success"] = true;
+  response["services"] = added;
+  String responseStr;
+  serializeJson(response, responseStr);
+  request->send(200, "application/json", responseStr);
+}
+
+// Runs on the loop task, collects the result and removes the benchmark services once the run is over
+unsigned long finishBenchmarkIfDue() {
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  if (!benchmark.running) {
+    xSemaphoreGive(servicesMutex);
+    return SCHEDULE_IDLE;
+  }
+  long untilEnd = (long)(benchmark.endsMs - millis());
+  if (untilEnd > 0) {
+    xSemaphoreGive(servicesMutex);
+    return untilEnd;
+  }
+
+  uint32_t durations[LATENCY_BUCKETS] = {};
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if (!(serviceState[slot].flags & SERVICE_BENCHMARK)) {
+      continue;
+    }
+    const ServiceCounters& counters = serviceCounters[slot];
+    benchmark.checks += counters.checks;
+    for (int i = 1; i < CHECK_ERROR_COUNT; i++) {
+      benchmark.failures += counters.errors[i];
+    }
+    benchmark.maxLagMs = max(benchmark.maxLagMs, serviceLag[slot].maxMs);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      durations[i] += serviceLatency[slot].counts[i];
+    }
+    removeService(slot);
+  }
+  rebuildSchedule();
+
+  benchmark.elapsedMs = max(millis() - benchmark.startedMs, 1UL);
+  benchmark.p50Us = bucketPercentile(durations, 50);
+  benchmark.p95Us = bucketPercentile(durations, 95);
+  benchmark.running = false;
+  benchmark.finished = true;
+  Serial.printf("Benchmark done: %lu checks in %lu ms, %.1f/s\n", (unsigned long)benchmark.checks,
+    (unsigned long)benchmark.elapsedMs, benchmark.checks * 1000.0f / benchmark.elapsedMs);
+  xSemaphoreGive(servicesMutex);
+  return SCHEDULE_IDLE;
+}
+
+// Called with servicesMutex held
+void serializeBenchmark(JsonObject obj) {
+  obj["running"] = benchmark.running;
+  if (benchmark.running) {
+    obj["services"] = benchmark.services;
+    obj["intervalSeconds"] = benchmark.intervalS;
+    obj["remainingSeconds"] = max((long)(benchmark.endsMs - millis()), 0L) / 1000;
+    return;
+  }
+  if (!benchmark.finished) {
+    return;
+  }
+
+  float planned = benchmark.services * 1.0f / benchmark.intervalS;
+  float achieved = benchmark.checks * 1000.0f / benchmark.elapsedMs;
+  obj["services"] = benchmark.services;
+  obj["intervalSeconds"] = benchmark.intervalS;
+  obj["elapsedSeconds"] = benchmark.elapsedMs / 1000.0f;
+  obj["checks"] = benchmark.checks;
+  obj["failures"] = benchmark.failures;
+  obj["plannedPerSecond"] = planned;
+  obj["checksPerSecond"] = achieved;
+  // Kept up if nine in ten planned checks completed and nothing fell a whole interval behind
+  obj["sustained"] = achieved >= planned * 0.9f && benchmark.maxLagMs < benchmark.intervalS * 1000;
+  obj["maxLagMs"] = benchmark.maxLagMs;
+  obj["p50Ms"] = benchmark.p50Us / 1000.0f;
+  obj["p95Ms"] = benchmark.p95Us / 1000.0f;
+}
+
+// A minimal keep-alive HTTP/1.1 server for the benchmark to check. The probe engine sends each request
+// in one write, so every request ends inside a single packet and no state is kept between them
+void startBenchmarkServer() {
+  if (benchmarkServer != NULL) {
+    return;
+  }
+  benchmarkServer = new AsyncServer(BENCHMARK_PORT);
+  benchmarkServer->onClient([](void* arg, AsyncClient* client) {
+    client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+      static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: keep-alive\r\n\r\nok";
+      const char* bytes = (const char*)data;
+      for (size_t i = 0; i + 3 < len; i++) {
+        if (memcmp(bytes + i, "\r\n\r\n", 4) == 0) {
+          client->write(response, sizeof(response) - 1);
+        }
+      }
+    }, NULL);
+    // Accepted clients belong to us, AsyncTCP is done with them once disconnected
+    client->onDisconnect([](void* arg, AsyncClient* client) {
+      delete client;
+    }, NULL);
+  }, NULL);
+  benchmarkServer->begin();
+}
+
+void initAsyncProbes() {
+  // Clients live as long as their slot and are reconnected when needed, nothing is freed inside a callback
+  for (int i = 0; i < MAX_ASYNC_PROBES; i++) {
+    AsyncProbe* probe = &asyncProbes[i];
+    probe->state = SLOT_FREE;
+    probe->client = new AsyncClient();
+
+    probe->client->onConnect([](void* arg, AsyncClient* client) {
+      AsyncProbe* probe = (AsyncProbe*)arg;
+      probe->connectedUs = micros();
+      probe->deadline = millis() + probe->readTimeoutMs;
+      if (probe->type == TYPE_TCP) {
+        finishAsyncProbe(probe, true, "");
+        probe->phase = PROBE_COMPLETE;
+        client->close(true);
+        return;
+      }
+      client->write(probe->request, probe->requestLength);
+    }, probe);
+
+    probe->client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+      AsyncProbe* probe = (AsyncProbe*)arg;
+      if (probe->state != SLOT_BUSY || probe->phase == PROBE_COMPLETE) {
+        return; // nothing should arrive on a parked connection
+      }
+      if (probe->firstByteUs == 0) {
+        probe->firstByteUs = micros();
+      }
+      handleAsyncProbeData(probe, (const uint8_t*)data, len);
+      if (probe->phase == PROBE_COMPLETE) {
+        completeAsyncProbe(probe, client);
+      }
+    }, probe);
+
+    // Always followed by onDisconnect, which reports the failure
+    probe->client->onError([](void* arg, AsyncClient* client, int8_t error) {
+      AsyncProbe* probe = (AsyncProbe*)arg;
+      probe->errorCode = error;
+    }, probe);
+
+    // lwIP polls roughly every 500 ms, timeouts are only as exact as that
+    probe->client->onPoll([](void* arg, AsyncClient* client) {
+      AsyncProbe* probe = (AsyncProbe*)arg;
+      unsigned long now = millis();
+      if (probe->state == SLOT_BUSY && (long)(now - probe->deadline) >= 0) {
+        if (!probe->finished) {
+          finishAsyncProbe(probe, false, "Timeout");
+        }
+        client->close(true);
+      } else if (probe->state == SLOT_IDLE && now - probe->idleSince >= HTTP_KEEPALIVE_IDLE_MS) {
+        client->close(true);
+      }
+    }, probe);
+
+    probe->client->onDisconnect([](void* arg, AsyncClient* client) {
+      AsyncProbe* probe = (AsyncProbe*)arg;
+      bool retry = false;
+
+      portENTER_CRITICAL(&asyncProbesLock);
+      if (probe->state == SLOT_BUSY && !probe->finished && probe->reused && probe->bytesReceived == 0 &&
+          !probe->redispatched) {
+        // The server dropped the parked connection just as we reused it, that says nothing about the service
+        probe->redispatched = true;
+        probe->finished = true;
+        retry = true;
+      }
+      portEXIT_CRITICAL(&asyncProbesLock);
+
+      if (retry) {
+        CheckJob job = { probe->slot, probe->generation };
+        dispatchToWorker(job);
+      } else if (probe->state == SLOT_BUSY && !probe->finished) {
+        if (probe->phase >= PROBE_BODY) {
+          finishAsyncProbe(probe, false, "Response mismatch");
+        } else if (probe->errorCode != 0) {
+          finishAsyncProbe(probe, false, "Connection failed: " + String(probe->errorCode));
+        } else {
+          finishAsyncProbe(probe, false, "Connection closed");
+        }
+      }
+      releaseAsyncProbe(probe);
+    }, probe);
+  }
+
+  Serial.printf("Async probe engine ready with %d slots\n", MAX_ASYNC_PROBES);
+}
+
+// Called with servicesMutex held, copies what the probe needs so it never touches the service storage again
+AsyncProbe* claimAsyncProbe(int slot) {
+  ServiceType type = (ServiceType)serviceState[slot].type;
+  const ServiceConfig& config = serviceConfig[slot];
+  const ServiceProbe& descriptor = serviceProbes[slot];
+
+  // TLS and JSON rules run on the workers
+  if (type == TYPE_PING || isTlsServiceType(type) || descriptor.rules.json.depth > 0) {
+    return NULL;
+  }
+
+  // A new connection needs a cached address, otherwise a worker resolves the name and the next round comes back here
+  uint32_t address = 0;
+  bool resolved = resolveCached(arenaString(config.host), address);
+
+  // A parked connection to the same host and port wins, otherwise any slot without a connection
+  AsyncProbe* probe = NULL;
+  portENTER_CRITICAL(&asyncProbesLock);
+  for (int i = 0; i < MAX_ASYNC_PROBES; i++) {
+    AsyncProbe& candidate = asyncProbes[i];
+    // A TCP check has to open its own connection, that is all it measures
+    if (candidate.state == SLOT_IDLE && resolved && type != TYPE_TCP && candidate.address == address &&
+        candidate.port == config.port) {
+      probe = &candidate;
+      probe->reused = true;
+      break;
+    }
+    if (candidate.state == SLOT_FREE && probe == NULL && resolved) {
+      probe = &candidate;
+      probe->reused = false;
+    }
+  }
+  if (probe != NULL) {
+    // Reset before the lock drops so the poll callback doesn't act on the previous probe's deadline
+    probe->state = SLOT_BUSY;
+    probe->finished = false;
+    probe->redispatched = false;
+    probe->readTimeoutMs = effectiveReadTimeout(type, config.readTimeoutMs);
+    probe->deadline = millis() + probe->readTimeoutMs +
+      (probe->reused ? 0 : effectiveConnectTimeout(config.connectTimeoutMs));
+  }
+  portEXIT_CRITICAL(&asyncProbesLock);
+
+  if (probe == NULL) {
+    return NULL;
+  }
+
+  probe->slot = slot;
+  probe->generation = serviceState[slot].generation;
+  probe->type = type;
+  if (!probe->reused) {
+    probe->port = config.port;
+    probe->address = address;
+  }
+  probe->maxScanBytes = config.maxScanBytes;
+  probe->requestLength = descriptor.requestLength;
+  memcpy(probe->request, descriptor.request, descriptor.requestLength);
+  memcpy(&probe->matcher, &descriptor.matcher, sizeof(ResponseMatcher));
+  memcpy(&probe->rules, &descriptor.rules.http, sizeof(HttpRules));
+  return probe;
+}
+
+bool launchAsyncProbe(AsyncProbe* probe) {
+  probe->errorCode = 0;
+  probe->phase = PROBE_STATUS_LINE;
+  probe->lineLength = 0;
+  probe->bytesReceived = 0;
+  probe->statusCode = 0;
+  probe->keepAlive = false;
+  probe->chunked = false;
+  probe->contentLength = -1;
+  probe->remaining = -1;
+  probe->drained = 0;
+  probe->scanned = 0;
+  probe->startedUs = micros();
+  probe->connectedUs = 0;
+  probe->firstByteUs = 0;
+  probe->matcher.matched = 0;
+  probe->headersMatched = 0;
+
+  if (probe->reused) {
+    if (probe->client->connected() && probe->client->write(probe->request, probe->requestLength) > 0) {
+      return true;
+    }
+
+    // The parked connection died under us, whoever gets here first hands the check on
+    bool alreadyHandled;
+    portENTER_CRITICAL(&asyncProbesLock);
+    alreadyHandled = probe->redispatched;
+    probe->redispatched = true;
+    probe->finished = true;
+    portEXIT_CRITICAL(&asyncProbesLock);
+    // The slot is freed by the disconnect callback or, if the write simply failed, by the deadline
+    return alreadyHandled;
+  }
+
+  // The address comes from the DNS cache, false means the handshake couldn't be started
+  if (!probe->client->connect(IPAddress(probe->address), probe->port)) {
+    releaseAsyncProbe(probe);
+    return false;
+  }
+  return true;
+}
+
+void releaseAsyncProbe(AsyncProbe* probe) {
+  portENTER_CRITICAL(&asyncProbesLock);
+  probe->state = SLOT_FREE;
+  portEXIT_CRITICAL(&asyncProbesLock);
+}
+
+// A response was read to its end, park the connection if the server allows it or close it
+void completeAsyncProbe(AsyncProbe* probe, AsyncClient* client) {
+  if (!probe->finished) {
+    finishAsyncProbe(probe, false, "Response mismatch");
+  }
+
+  bool parked = false;
+  if (probe->keepAlive) {
+    portENTER_CRITICAL(&asyncProbesLock);
+    int idle = 0;
+    for (int i = 0; i < MAX_ASYNC_PROBES; i++) {
+      if (asyncProbes[i].state == SLOT_IDLE) {
+        idle++;
+      }
+    }
+    if (idle < MAX_IDLE_CONNECTIONS) {
+      probe->state = SLOT_IDLE;
+      probe->idleSince = millis();
+      parked = true;
+    }
+    portEXIT_CRITICAL(&asyncProbesLock);
+  }
+
+  if (!parked) {
+    client->close(true);
+  }
+}
+
+void finishAsyncProbe(AsyncProbe* probe, bool isUp, const String& error) {
+  probe->finished = true;
+
+  CheckTiming timing = CheckTiming();
+  uint32_t now = micros();
+  if (probe->connectedUs != 0) {
+    timing.connectUs = probe->connectedUs - probe->startedUs;
+  }
+  if (probe->firstByteUs != 0) {
+    timing.firstByteUs = probe->firstByteUs - probe->startedUs;
+  }
+  timing.totalUs = now - probe->startedUs;
+  recordCheckResult(probe->slot, probe->generation, isUp, error, timing);
+}
+
+void handleAsyncProbeData(AsyncProbe* probe, const uint8_t* data, size_t len) {
+  size_t pos = 0;
+  probe->bytesReceived += len;
+
+  while (pos < len && probe->phase != PROBE_COMPLETE) {
+    if (probe->phase == PROBE_BODY || probe->phase == PROBE_CHUNK_DATA) {
+      size_t take = len - pos;
+      if (probe->remaining >= 0 && take > (size_t)probe->remaining) {
+        take = probe->remaining;
+      }
+      handleAsyncProbeBody(probe, data + pos, take);
+      pos += take;
+
+      if (probe->remaining >= 0) {
+        probe->remaining -= take;
+        if (probe->remaining == 0) {
+          probe->phase = probe->phase == PROBE_BODY ? PROBE_COMPLETE : PROBE_CHUNK_END;
+        }
+      }
+      continue;
+    }
+
+    // Everything else is line oriented
+    char c = data[pos++];
+    if (c != '\n') {
+      if (probe->lineLength < sizeof(probe->line) - 1) {
+        probe->line[probe->lineLength++] = c;
+      }
+      continue;
+    }
+    if (probe->lineLength > 0 && probe->line[probe->lineLength - 1] == '\r') {
+      probe->lineLength--;
+    }
+    probe->line[probe->lineLength] = '\0';
+    probe->lineLength = 0;
+    handleAsyncProbeLine(probe);
+  }
+}
+
+void handleAsyncProbeLine(AsyncProbe* probe) {
+  const char* line = probe->line;
+
+  switch (probe->phase) {
+    case PROBE_STATUS_LINE: {
+      // Status line, e.g. "HTTP/1.1 200 OK"
+      const char* space = strchr(line, ' ');
+      probe->statusCode = space != NULL ? atoi(space + 1) : 0;
+
+      if (strncmp(line, "HTTP/", 5) != 0 || probe->statusCode <= 0) {
+        finishAsyncProbe(probe, false, "Invalid response");
+        probe->phase = PROBE_COMPLETE;
+        return;
+      }
+      // HTTP/1.1 keeps the connection unless told otherwise, 1.0 closes it
+      probe->keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+      probe->phase = PROBE_HEADERS;
+
+      // Header rules and the body matcher decide later
+      if (!acceptsStatus(probe->type, probe->rules, probe->statusCode)) {
+        finishAsyncProbe(probe, false, "HTTP " + String(probe->statusCode));
+      } else if (probe->rules.headerCount == 0 && probe->matcher.length == 0) {
+        finishAsyncProbe(probe, true, "");
+      }
+      return;
+    }
+
+    case PROBE_HEADERS:
+      if (line[0] != '\0') {
+        if (probe->rules.headerCount > 0) {
+          matchHeaderLine(probe->rules, line, probe->headersMatched);
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+          probe->contentLength = atol(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+          probe->chunked = strcasestr(line + 18, "chunked") != NULL;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+          if (strcasestr(line + 11, "close") != NULL) {
+            probe->keepAlive = false;
+          } else if (strcasestr(line + 11, "keep-alive") != NULL) {
+            probe->keepAlive = true;
+          }
+        }
+        return;
+      }
+
+      if (!probe->finished && probe->rules.headerCount > 0) {
+        if (!headersSatisfied(probe->rules, probe->headersMatched)) {
+          finishAsyncProbe(probe, false, "Response mismatch: header");
+        } else if (probe->matcher.length == 0) {
+          finishAsyncProbe(probe, true, "");
+        }
+      }
+
+      // Blank line, work out how the body is framed
+      if (probe->statusCode == 204 || probe->statusCode == 304 || probe->statusCode < 200) {
+        probe->phase = PROBE_COMPLETE;
+      } else if (probe->chunked) {
+        probe->phase = PROBE_CHUNK_SIZE;
+      } else if (probe->contentLength >= 0) {
+        probe->remaining = probe->contentLength;
+        probe->phase = probe->contentLength == 0 ? PROBE_COMPLETE : PROBE_BODY;
+      } else {
+        // Body runs until the server closes, so the connection can't be reused
+        probe->keepAlive = false;
+        probe->phase = PROBE_BODY;
+      }
+
+      // Already decided and nothing to gain from reading on
+      if (probe->finished && (!probe->keepAlive || probe->contentLength > (long)HTTP_KEEPALIVE_MAX_DRAIN)) {
+        probe->keepAlive = false;
+        probe->phase = PROBE_COMPLETE;
+      }
+      return;
+
+    case PROBE_CHUNK_SIZE:
+      probe->remaining = strtol(line, NULL, 16);
+      probe->phase = probe->remaining > 0 ? PROBE_CHUNK_DATA : PROBE_TRAILERS;
+      return;
+
+    case PROBE_CHUNK_END:
+      probe->phase = PROBE_CHUNK_SIZE;
+      return;
+
+    case PROBE_TRAILERS:
+      if (line[0] == '\0') {
+        probe->phase = PROBE_COMPLETE;
+      }
+      return;
+
+    default:
+      return;
+  }
+}
+
+void handleAsyncProbeBody(AsyncProbe* probe, const uint8_t* data, size_t len) {
+  if (!probe->finished) {
+    size_t take = min(len, (size_t)(probe->maxScanBytes - probe->scanned));
+    probe->scanned += take;
+    if (feedResponseMatcher(probe->matcher, data, take)) {
+      finishAsyncProbe(probe, true, "");
+    } else if (probe->scanned >= probe->maxScanBytes) {
+      finishAsyncProbe(probe, false, "Response mismatch");
+    }
+    return;
+  }
+
+  // Only reading on to keep the connection, give up on it if the body is too long to be worth it
+  probe->drained += len;
+  if (probe->drained > HTTP_KEEPALIVE_MAX_DRAIN) {
+    probe->keepAlive = false;
+    probe->phase = PROBE_COMPLETE;
+  }
+}
+
+size_t MatchingStream::write(const uint8_t* data, size_t len) {
+  if (found || scanned >= limit) {
+    return 0;
+  }
+  size_t take = min(len, (size_t)(limit - scanned));
+  scanned += take;
+  found = feedResponseMatcher(matcher, data, take);
+  // Reporting a short write stops writeToStream once there is nothing left to learn
+  return found ? 0 : take;
+}
+
+// Called with servicesMutex held, the actual write happens later on the loop task
+void markConfigDirty() {
+  configDirty = true;
+  configDirtySince = millis();
+}
+
+// Runs on the loop task, returns how long until a pending save is due
+unsigned long saveServicesIfDue() {
+  if (!configDirty) {
+    return SCHEDULE_IDLE;
+  }
+  unsigned long quietFor = millis() - configDirtySince;
+  if (quietFor < CONFIG_SAVE_DELAY_MS) {
+    return CONFIG_SAVE_DELAY_MS - quietFor;
+  }
+  saveServices();
+  return SCHEDULE_IDLE;
+}
+
+// Copies the config into one buffer under the lock, then writes and renames it without holding anything
+bool saveServices() {
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  configDirty = false;
+  ConfigWriter measure = { NULL, 0 };
+  writeServiceRecords(measure);
+  size_t payloadLength = measure.pos;
+
+  uint8_t* buffer = (uint8_t*)malloc(sizeof(ConfigHeader) + payloadLength);
+  if (buffer == NULL) {
+    // Try again on the next pass rather than lose the change
+    markConfigDirty();
+    xSemaphoreGive(servicesMutex);
+    Serial.println("No memory to save services");
+    return false;
+  }
+  ConfigWriter writer = { buffer + sizeof(ConfigHeader), 0 };
+  ConfigHeader header;
+  header.magic = CONFIG_MAGIC;
+  header.version = CONFIG_VERSION;
+  header.count = writeServiceRecords(writer);
+  xSemaphoreGive(servicesMutex);
+
+  header.payloadLength = payloadLength;
+  header.crc = crc32Update(0, buffer + sizeof(ConfigHeader), payloadLength);
+  memcpy(buffer, &header, sizeof(header));
+
+  File file = LittleFS.open(CONFIG_TEMP_PATH, "w");
+  size_t total = sizeof(ConfigHeader) + payloadLength;
+  bool written = file && file.write(buffer, total) == total;
+  file.close();
+  free(buffer);
+
+  if (!written || !LittleFS.rename(CONFIG_TEMP_PATH, CONFIG_PATH)) {
+    // Same as running out of memory, the debounced save tries again
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+    markConfigDirty();
+    xSemaphoreGive(servicesMutex);
+    Serial.println("Failed to save services");
+    return false;
+  }
+  Serial.println("Services saved");
+  return true;
+}
+
+// Called with servicesMutex held, returns the number of records
+int writeServiceRecords(ConfigWriter& writer) {
+  int count = 0;
+  for (int slot = 0; slot < MAX_SERVICES; slot++) {
+    if ((serviceState[slot].flags & (SERVICE_IN_USE | SERVICE_BENCHMARK)) != SERVICE_IN_USE) {
+      continue;
+    }
+    const ServiceState& state = serviceState[slot];
+    const ServiceConfig& config = serviceConfig[slot];
+
+    // Record length first, patched once the record is written
+    size_t start = writer.pos;
+    uint16_t recordLength = 0;
+    configWrite(writer, &recordLength, sizeof(recordLength));
+
+    uint8_t type = state.type;
+    uint32_t checkInterval = state.intervalMs / 1000;
+    configWrite(writer, &type, sizeof(type));
+    configWrite(writer, &config.port, sizeof(config.port));
+    configWrite(writer, &checkInterval, sizeof(checkInterval));
+    configWrite(writer, &config.maxScanBytes, sizeof(config.maxScanBytes));
+    configWrite(writer, &config.degradedMs, sizeof(config.degradedMs));
+    configWriteString(writer, config.id);
+    configWriteString(writer, arenaString(config.name));
+    configWriteString(writer, arenaString(config.host));
+    configWriteString(writer, arenaString(config.path));
+    configWriteString(writer, arenaString(config.expectedResponse));
+    configWrite(writer, &config.confirmChecks, sizeof(config.confirmChecks));
+    configWrite(writer, &config.retryInterval, sizeof(config.retryInterval));
+    configWrite(writer, &config.maxBackoff, sizeof(config.maxBackoff));
+    configWriteString(writer, arenaString(config.rules));
+    configWriteString(writer, arenaString(config.authToken));
+    configWriteString(writer, config.parent);
+    configWriteString(writer, arenaString(config.group));
+    configWrite(writer, &config.connectTimeoutMs, sizeof(config.connectTimeoutMs));
+    configWrite(writer, &config.readTimeoutMs, sizeof(config.readTimeoutMs));
+    configWrite(writer, &config.pingCount, sizeof(config.pingCount));
+
+    if (writer.data != NULL) {
+      recordLength = writer.pos - start;
+      memcpy(writer.data + start, &recordLength, sizeof(recordLength));
+    }
+    count++;
+  }
+  return count;
+}
+
+void configWrite(ConfigWriter& writer, const void* value, size_t length) {
+  if (writer.data != NULL) {
+    memcpy(writer.data + writer.pos, value, length);
+  }
+  writer.pos += length;
+}
+
+// Length prefixed and NUL terminated, so the loader can point straight into its buffer
+void configWriteString(ConfigWriter& writer, const char* value) {
+  uint16_t length = strlen(value);
+  configWrite(writer, &length, sizeof(length));
+  configWrite(writer, value, length + 1);
+}
+
+bool configRead(ConfigReader& reader, void* value, size_t length) {
+  if (!reader.ok || reader.pos + length > reader.length) {
+    reader.ok = false;
+    return false;
+  }
+  memcpy(value, reader.data + reader.pos, length);
+  reader.pos += length;
+  return true;
+}
+
+const char* configReadString(ConfigReader& reader) {
+  uint16_t length;
+  if (!configRead(reader, &length, sizeof(length)) || reader.pos + length + 1 > reader.length ||
+      reader.data[reader.pos + length] != '\0') {
+    reader.ok = false;
+    return "";
+  }
+  const char* value = (const char*)reader.data + reader.pos;
+  reader.pos += length + 1;
+  return value;
+}
+
+// Standard reflected CRC32 (poly 0xEDB88320), bitwise since it only runs on save and boot
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void loadServices() {
+  // A temp file only survives a power cut between writing it and the rename, it is used when the real one is unusable
+  const char* paths[] = { CONFIG_PATH, CONFIG_TEMP_PATH };
+  bool found = false;
+  for (const char* path : paths) {
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+      continue;
+    }
+    found = true;
+
+    size_t size = file.size();
+    uint8_t* buffer = (uint8_t*)malloc(size);
+    bool read = buffer != NULL && file.read(buffer, size) == size;
+    file.close();
+    // Validate every record before adding any, so a bad file can't leave half a list behind
+    bool parsed = read && parseServiceConfig(buffer, size, false) && parseServiceConfig(buffer, size, true);
+    free(buffer);
+
+    if (parsed) {
+      Serial.printf("Loaded %d services from %s\n", serviceCount, path);
+      return;
+    }
+    Serial.printf("%s is corrupt, ignoring it\n", path);
+  }
+
+  // Older firmware kept the services as JSON, move them over once
+  if (!found && loadLegacyServices()) {
+    if (saveServices()) {
+      LittleFS.remove(LEGACY_CONFIG_PATH);
+    }
+    Serial.printf("Migrated %d services from services.json\n", serviceCount);
+    return;
+  }
+  Serial.println("No saved services found, starting fresh");
+}
+
+bool parseServiceConfig(const uint8_t* data, size_t length, bool apply) {
+  ConfigHeader header;
+  if (length < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != CONFIG_MAGIC || header.version > CONFIG_VERSION ||
+      header.payloadLength != length - sizeof(header) ||
+      header.crc != crc32Update(0, data + sizeof(header), header.payloadLength)) {
+    return false;
+  }
+
+  bool ok = true;
+  size_t pos = sizeof(header);
+  if (apply) {
+    xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  }
+  for (int i = 0; i < header.count; i++) {
+    uint16_t recordLength;
+    if (pos + sizeof(recordLength) > length) {
+      ok = false;
+      break;
+    }
+    memcpy(&recordLength, data + pos, sizeof(recordLength));
+    if (recordLength < sizeof(recordLength) || pos + recordLength > length) {
+      ok = false;
+      break;
+    }
+
+    // Each record is read on its own, fields added by newer versions at the end are skipped
+    ConfigReader reader = { data + pos, recordLength, sizeof(recordLength), true };
+    pos += recordLength;
+
+    uint8_t type;
+    ServiceDefinition definition;
+    configRead(reader, &type, sizeof(type));
+    configRead(reader, &definition.port, sizeof(definition.port));
+    configRead(reader, &definition.checkInterval, sizeof(definition.checkInterval));
+    configRead(reader, &definition.maxScanBytes, sizeof(definition.maxScanBytes));
+    configRead(reader, &definition.degradedMs, sizeof(definition.degradedMs));
+    definition.type = (ServiceType)type;
+    definition.id = configReadString(reader);
+    definition.name = configReadString(reader);
+    definition.host = configReadString(reader);
+    definition.path = configReadString(reader);
+    definition.expectedResponse = configReadString(reader);
+    // Version 2, records written before it get the default policy
+    definition.confirmChecks = DEFAULT_CONFIRM_CHECKS;
+    definition.retryInterval = DEFAULT_RETRY_INTERVAL;
+    definition.maxBackoff = DEFAULT_MAX_BACKOFF;
+    if (reader.pos < reader.length) {
+      configRead(reader, &definition.confirmChecks, sizeof(definition.confirmChecks));
+      configRead(reader, &definition.retryInterval, sizeof(definition.retryInterval));
+      configRead(reader, &definition.maxBackoff, sizeof(definition.maxBackoff));
+    }
+    // Version 3
+    definition.rules = "";
+    definition.authToken = "";
+    if (reader.pos < reader.length) {
+      definition.rules = configReadString(reader);
+      definition.authToken = configReadString(reader);
+    }
+    // Version 4
+    definition.parent = "";
+    definition.group = "";
+    if (reader.pos < reader.length) {
+      definition.parent = configReadString(reader);
+      definition.group = configReadString(reader);
+    }
+    // Version 5, 0 keeps the defaults
+    definition.connectTimeoutMs = 0;
+    definition.readTimeoutMs = 0;
+    definition.pingCount = 0;
+    if (reader.pos < reader.length) {
+      configRead(reader, &definition.connectTimeoutMs, sizeof(definition.connectTimeoutMs));
+      configRead(reader, &definition.readTimeoutMs, sizeof(definition.readTimeoutMs));
+      configRead(reader, &definition.pingCount, sizeof(definition.pingCount));
+    }
+    if (!reader.ok) {
+      ok = false;
+      break;
+    }
+    const char* tooLong = checkServiceLengths(definition);
+    if (tooLong != NULL) {
+      Serial.printf("Skipping saved service '%s': %s\n", definition.name, tooLong);
+      continue;
+    }
+
+    if (apply && addService(definition) < 0) {
+      Serial.printf("No room for service '%s', skipping the rest\n", definition.name);
+      break;
+    }
+  }
+  if (apply) {
+    xSemaphoreGive(servicesMutex);
+  }
+  return ok;
+}
+
+bool loadLegacyServices() {
+  File file = LittleFS.open(LEGACY_CONFIG_PATH, "r");
+  if (!file) {
+    return false;
+  }
+
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+
+  if (error) {
+    Serial.println("Failed to parse services.json");
+    return false;
+  }
+
+  JsonArray array = doc["services"];
+
+  xSemaphoreTake(servicesMutex, portMAX_DELAY);
+  for (JsonObject obj : array) {
+    ServiceDefinition definition;
+    definition.id = obj["id"] | "";
+    definition.name = obj["name"] | "";
+    definition.type = (ServiceType)obj["type"].as<int>();
+    definition.host = obj["host"] | "";
+    definition.port = obj["port"];
+    definition.path = obj["path"] | "";
+    definition.expectedResponse = obj["expectedResponse"] | "";
+    definition.checkInterval = obj["checkInterval"];
+    definition.maxScanBytes = obj["maxScanBytes"] | DEFAULT_MAX_SCAN_BYTES;
+    definition.degradedMs = obj["degradedMs"] | 0;
+    definition.confirmChecks = DEFAULT_CONFIRM_CHECKS;
+    definition.retryInterval = DEFAULT_RETRY_INTERVAL;
+    definition.maxBackoff = DEFAULT_MAX_BACKOFF;
+    definition.rules = "";
+    definition.authToken = "";
+    definition.parent = "";
+    definition.group = "";
+    definition.connectTimeoutMs = 0;
+    definition.readTimeoutMs = 0;
+    definition.pingCount = 0;
+
+    // The old format had no limits at all
+    const char* tooLong = checkServiceLengths(definition);
+    if (tooLong != NULL) {
+      Serial.printf("Skipping service '%s': %s\n", definition.name, tooLong);
+      continue;
+    }
+    if (addService(definition) < 0) {
+      Serial.printf("No room for service '%s', skipping the rest\n", definition.name);
+      break;
+    }
+  }
+  xSemaphoreGive(servicesMutex);
+  return true;
+}
+
+String getServiceTypeString(ServiceType type) {
+  return serviceTypeName(type);
 }
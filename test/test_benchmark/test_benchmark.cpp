@@ -0,0 +1,195 @@
+#include <unity.h>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ArduinoJson.h>
+#include "History.h"
+#include "ResponseMatcher.h"
+#include "Scheduler.h"
+#include "ServiceDefinition.h"
+
+// Micro-benchmarks for the code every check runs through
+// Allocations are exact and always asserted: the check path must not allocate at all, device heaps
+// fragment from it. Timings are only reported, a loaded runner or a sanitizer build says nothing about
+// the code. Build with -DBENCHMARK_TIME_BOUNDS to also fail on them; the bounds sit about ten times
+// above what a desktop machine does, enough to catch an accidental O(n) in a hot path
+const int BENCH_SERVICES = 64;
+const int SCHEDULE_ROUNDS = 1000000;
+const double MIN_DISPATCHES_PER_SECOND = 2e6;
+const int CHECK_ROUNDS = 10000;
+const int SERIALIZE_ROUNDS = 20000;
+const double MAX_ROUND_TRIP_US = 50;
+const double MAX_ROUND_TRIP_ALLOCATIONS = 48;
+
+static size_t newCalls = 0;
+
+void* operator new(size_t size) {
+  newCalls++;
+  void* ptr = malloc(size ? size : 1);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+// ArduinoJson goes through malloc, so the documents get their own counter
+struct CountingAllocator : ArduinoJson::Allocator {
+  size_t calls = 0;
+
+  void* allocate(size_t size) override {
+    calls++;
+    return malloc(size);
+  }
+  void deallocate(void* ptr) override {
+    free(ptr);
+  }
+  void* reallocate(void* ptr, size_t size) override {
+    calls++;
+    return realloc(ptr, size);
+  }
+};
+
+static double elapsedUs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* format, double value) {
+  char message[96];
+  snprintf(message, sizeof(message), format, value);
+  TEST_MESSAGE(message);
+}
+
+DeadlineEntry entries[BENCH_SERVICES];
+DeadlineHeap heap;
+
+void setUp() {
+  initDeadlineHeap(heap, entries, BENCH_SERVICES);
+  for (int slot = 0; slot < BENCH_SERVICES; slot++) {
+    appendDeadline(heap, slot, (slot * 7919) % 60000);
+  }
+  heapifyDeadlines(heap);
+}
+
+void tearDown() {}
+
+// What the loop task does for every due check: take the root, move it to its next deadline
+void test_scheduling_throughput() {
+  uint32_t now = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < SCHEDULE_ROUNDS; i++) {
+    DeadlineEntry& root = heap.entries[0];
+    now = root.due;
+    rescheduleRoot(heap, nextDeadline(root.due, 30000 + root.slot * 1000, now));
+  }
+  double us = elapsedUs(start);
+
+  double perSecond = SCHEDULE_ROUNDS / (us / 1e6);
+  report("scheduler: %.0f dispatches/s", perSecond);
+#ifdef BENCHMARK_TIME_BOUNDS
+  TEST_ASSERT_TRUE(perSecond >= MIN_DISPATCHES_PER_SECOND);
+#endif
+}
+
+// Dispatch, body match, retry policy and history for one check, the way the probe engines drive them
+void test_check_path_does_not_allocate() {
+  ResponseMatcher compiled;
+  initResponseMatcher(compiled, "\"state\":\"running\"");
+  const char* chunks[] = { "{\"version\":\"2024.1\",\"sta", "te\":\"runn", "ing\",\"components\":[]}" };
+  HistoryRing ring;
+  UptimeWindow windows[UPTIME_WINDOWS];
+  memset(&ring, 0, sizeof(ring));
+  memset(windows, 0, sizeof(windows));
+
+  size_t before = newCalls;
+  int found = 0;
+  for (int i = 0; i < CHECK_ROUNDS; i++) {
+    DeadlineEntry& root = heap.entries[0];
+    rescheduleRoot(heap, nextDeadline(root.due, 60000, root.due));
+
+    ResponseMatcher matcher;
+    memcpy(&matcher, &compiled, sizeof(ResponseMatcher));
+    for (const char* chunk : chunks) {
+      if (feedResponseMatcher(matcher, (const uint8_t*)chunk, strlen(chunk))) {
+        found++;
+        break;
+      }
+    }
+
+    uint8_t failures = i % 5;
+    volatile uint32_t delay = retryDelayMs(failures, DEFAULT_CONFIRM_CHECKS, 60000, DEFAULT_RETRY_INTERVAL,
+      DEFAULT_MAX_BACKOFF);
+    (void)delay;
+
+    HistoryRecord record = { 1700000000u + i * 60, 42, HISTORY_UP, 0 };
+    pushHistoryRecord(ring, record);
+    countUptime(windows, record);
+  }
+  size_t allocations = newCalls - before;
+
+  report("check path: %.0f allocations", (double)allocations);
+  TEST_ASSERT_EQUAL(CHECK_ROUNDS, found);
+  TEST_ASSERT_EQUAL(0, allocations);
+}
+
+// One service through the API and back out of the export
+void test_serialization_cost() {
+  const char* json = "{\"type\":\"http_get\",\"name\":\"Grafana\",\"host\":\"grafana.lan\",\"port\":3000,"
+    "\"path\":\"/api/health\",\"expectedResponse\":\"\\\"database\\\":\\\"ok\\\"\",\"checkInterval\":30,"
+    "\"maxScanBytes\":2048,\"degradedMs\":750,\"confirmChecks\":2,\"retryInterval\":5,\"maxBackoff\":600}";
+  CountingAllocator allocator;
+  char out[512];
+  size_t written = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < SERIALIZE_ROUNDS; i++) {
+    JsonDocument in(&allocator);
+    TEST_ASSERT_FALSE(deserializeJson(in, json));
+    ServiceDefinition definition;
+    TEST_ASSERT_NULL(parseServiceJson(in.as<JsonObjectConst>(), definition));
+    definition.id = "0123456789abcdef";
+
+    JsonDocument doc(&allocator);
+    serializeServiceDefinition(definition, doc.to<JsonObject>());
+    written = serializeJson(doc, out, sizeof(out));
+  }
+  double perRoundUs = elapsedUs(start) / SERIALIZE_ROUNDS;
+  double perRoundAllocations = (double)allocator.calls / SERIALIZE_ROUNDS;
+
+  report("serialization: %.2f us per round trip", perRoundUs);
+  report("serialization: %.1f allocations per round trip", perRoundAllocations);
+  TEST_ASSERT_TRUE(written > 0 && written < sizeof(out) - 1);
+#ifdef BENCHMARK_TIME_BOUNDS
+  TEST_ASSERT_TRUE(perRoundUs <= MAX_ROUND_TRIP_US);
+#endif
+  TEST_ASSERT_TRUE(perRoundAllocations <= MAX_ROUND_TRIP_ALLOCATIONS);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_scheduling_throughput);
+  RUN_TEST(test_check_path_does_not_allocate);
+  RUN_TEST(test_serialization_cost);
+  return UNITY_END();
+}
@@ -0,0 +1,81 @@
+#include <unity.h>
+#include "CheckBudget.h"
+
+TokenBucket bucket;
+
+void setUp() {}
+void tearDown() {}
+
+void test_bucket_allows_a_burst_then_the_rate() {
+  initTokenBucket(bucket, 10, 3, 1000);
+  TEST_ASSERT_TRUE(takeToken(bucket, 1000));
+  TEST_ASSERT_TRUE(takeToken(bucket, 1000));
+  TEST_ASSERT_TRUE(takeToken(bucket, 1000));
+  TEST_ASSERT_FALSE(takeToken(bucket, 1000));
+  TEST_ASSERT_EQUAL_UINT32(100, msUntilToken(bucket, 1000));
+  TEST_ASSERT_EQUAL_UINT32(40, msUntilToken(bucket, 1060));
+  TEST_ASSERT_FALSE(takeToken(bucket, 1099));
+  TEST_ASSERT_TRUE(takeToken(bucket, 1100));
+}
+
+void test_bucket_refills_only_to_its_burst() {
+  initTokenBucket(bucket, 10, 2, 0);
+  TEST_ASSERT_TRUE(takeToken(bucket, 0));
+  TEST_ASSERT_TRUE(takeToken(bucket, 0));
+  TEST_ASSERT_EQUAL_UINT32(0, msUntilToken(bucket, 60000));
+  TEST_ASSERT_TRUE(takeToken(bucket, 60000));
+  TEST_ASSERT_TRUE(takeToken(bucket, 60000));
+  TEST_ASSERT_FALSE(takeToken(bucket, 60000));
+}
+
+void test_bucket_survives_millis_wrap() {
+  initTokenBucket(bucket, 5, 1, 0xFFFFFF00u);
+  TEST_ASSERT_TRUE(takeToken(bucket, 0xFFFFFF00u));
+  TEST_ASSERT_FALSE(takeToken(bucket, 0xFFFFFF10u));
+  TEST_ASSERT_TRUE(takeToken(bucket, 0x000000C8u));
+}
+
+void test_load_adds_rate_and_concurrency() {
+  CheckLoad load = { 0, 0 };
+  addCheckLoad(load, 10, 500);
+  addCheckLoad(load, 20, 2000);
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.15f, load.checksPerSecond);
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.15f, load.concurrency);
+}
+
+void test_admits_within_budget_unchanged() {
+  CheckLoad load = { 1.0f, 1.0f };
+  TEST_ASSERT_EQUAL_UINT32(30, admitInterval(load, 30, 1000, 10.0f, 8.0f, 3600));
+}
+
+void test_stretches_to_fit_the_rate() {
+  // 0.5 checks a second left, so nothing shorter than 2 s
+  CheckLoad load = { 9.5f, 0.0f };
+  TEST_ASSERT_EQUAL_UINT32(2, admitInterval(load, 1, 100, 10.0f, 8.0f, 3600));
+}
+
+void test_stretches_to_fit_the_connections() {
+  // A 5 s timeout with a quarter of a connection left needs 20 s between checks
+  CheckLoad load = { 0.0f, 7.75f };
+  TEST_ASSERT_EQUAL_UINT32(20, admitInterval(load, 10, 5000, 10.0f, 8.0f, 3600));
+}
+
+void test_refuses_when_nothing_fits() {
+  CheckLoad full = { 10.0f, 0.0f };
+  TEST_ASSERT_EQUAL_UINT32(0, admitInterval(full, 60, 100, 10.0f, 8.0f, 3600));
+  CheckLoad tight = { 0.0f, 7.999f };
+  TEST_ASSERT_EQUAL_UINT32(0, admitInterval(tight, 60, 5000, 10.0f, 8.0f, 3600));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_bucket_allows_a_burst_then_the_rate);
+  RUN_TEST(test_bucket_refills_only_to_its_burst);
+  RUN_TEST(test_bucket_survives_millis_wrap);
+  RUN_TEST(test_load_adds_rate_and_concurrency);
+  RUN_TEST(test_admits_within_budget_unchanged);
+  RUN_TEST(test_stretches_to_fit_the_rate);
+  RUN_TEST(test_stretches_to_fit_the_connections);
+  RUN_TEST(test_refuses_when_nothing_fits);
+  return UNITY_END();
+}
@@ -0,0 +1,117 @@
+#include <unity.h>
+#include <string.h>
+#include <ArduinoJson.h>
+#include "CheckRules.h"
+
+CheckRules rules;
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty_text_has_no_rules() {
+  TEST_ASSERT_NULL(compileCheckRules("", rules));
+  TEST_ASSERT_EQUAL(0, rules.http.statusCount);
+  TEST_ASSERT_EQUAL(0, rules.http.headerCount);
+  TEST_ASSERT_EQUAL(0, rules.json.depth);
+}
+
+void test_compiles_status_ranges() {
+  TEST_ASSERT_NULL(compileCheckRules("status=200-299, 304", rules));
+  TEST_ASSERT_EQUAL(2, rules.http.statusCount);
+  TEST_ASSERT_TRUE(statusInRanges(rules.http, 200));
+  TEST_ASSERT_TRUE(statusInRanges(rules.http, 204));
+  TEST_ASSERT_TRUE(statusInRanges(rules.http, 304));
+  TEST_ASSERT_FALSE(statusInRanges(rules.http, 301));
+  TEST_ASSERT_FALSE(statusInRanges(rules.http, 500));
+}
+
+void test_rejects_bad_status() {
+  TEST_ASSERT_EQUAL_STRING("Invalid status range", compileCheckRules("status=299-200", rules));
+  TEST_ASSERT_EQUAL_STRING("Invalid status range", compileCheckRules("status=2xx", rules));
+  TEST_ASSERT_EQUAL_STRING("Invalid status range", compileCheckRules("status=99", rules));
+  TEST_ASSERT_EQUAL_STRING("Too many status ranges", compileCheckRules("status=200,201,202,203,204", rules));
+}
+
+void test_rejects_unknown_and_oversized_rules() {
+  TEST_ASSERT_EQUAL_STRING("Unknown rule", compileCheckRules("body=ok", rules));
+  char text[MAX_RULES_LENGTH + 16];
+  memset(text, ' ', sizeof(text) - 1);
+  text[sizeof(text) - 1] = '\0';
+  TEST_ASSERT_EQUAL_STRING("Rules too long", compileCheckRules(text, rules));
+}
+
+void test_matches_headers_case_insensitively() {
+  TEST_ASSERT_NULL(compileCheckRules("header:Content-Type=json; header:X-Status=ready", rules));
+  TEST_ASSERT_EQUAL(2, rules.http.headerCount);
+
+  uint8_t matched = 0;
+  matchHeaderLine(rules.http, "content-type: Application/JSON; charset=utf-8", matched);
+  TEST_ASSERT_FALSE(headersSatisfied(rules.http, matched));
+  matchHeaderLine(rules.http, "X-Status-Detail: ready", matched);
+  TEST_ASSERT_FALSE(headersSatisfied(rules.http, matched));
+  matchHeaderLine(rules.http, "X-Status: ready", matched);
+  TEST_ASSERT_TRUE(headersSatisfied(rules.http, matched));
+}
+
+void test_compiles_json_path() {
+  TEST_ASSERT_NULL(compileCheckRules("status=200;json:$.data[2].state = on", rules));
+  TEST_ASSERT_EQUAL(3, rules.json.depth);
+  TEST_ASSERT_EQUAL_STRING("data", rules.json.path[0].key);
+  TEST_ASSERT_EQUAL(2, rules.json.path[1].index);
+  TEST_ASSERT_EQUAL_STRING("state", rules.json.path[2].key);
+  TEST_ASSERT_TRUE(rules.json.hasValue);
+  TEST_ASSERT_EQUAL_STRING("on", rules.json.value);
+
+  TEST_ASSERT_NULL(compileCheckRules("json:message", rules));
+  TEST_ASSERT_EQUAL(1, rules.json.depth);
+  TEST_ASSERT_FALSE(rules.json.hasValue);
+
+  TEST_ASSERT_EQUAL_STRING("Invalid JSON path", compileCheckRules("json:$.a[x]", rules));
+  TEST_ASSERT_EQUAL_STRING("JSON path too deep", compileCheckRules("json:a.b.c.d.e.f.g", rules));
+  TEST_ASSERT_EQUAL_STRING("Only one JSON rule is allowed", compileCheckRules("json:a;json:b", rules));
+}
+
+void test_filter_keeps_only_the_asserted_field() {
+  TEST_ASSERT_NULL(compileCheckRules("json:$[1].state=on", rules));
+  JsonDocument filter;
+  buildJsonFilter(rules.json, filter);
+
+  const char* body = "[{\"entity_id\":\"light.a\",\"state\":\"off\",\"attributes\":{\"brightness\":10}},"
+    "{\"entity_id\":\"light.b\",\"state\":\"on\",\"attributes\":{\"brightness\":200}}]";
+  JsonDocument doc;
+  TEST_ASSERT_FALSE(deserializeJson(doc, body, strlen(body), DeserializationOption::Filter(filter)));
+  TEST_ASSERT_TRUE(doc[1]["entity_id"].isNull());
+  TEST_ASSERT_TRUE(doc[1]["attributes"].isNull());
+  TEST_ASSERT_TRUE(jsonAssertionHolds(rules.json, doc.as<JsonVariantConst>()));
+
+  TEST_ASSERT_NULL(compileCheckRules("json:$[0].state=on", rules));
+  TEST_ASSERT_FALSE(jsonAssertionHolds(rules.json, doc.as<JsonVariantConst>()));
+}
+
+void test_compares_numbers_and_booleans() {
+  const char* body = "{\"ok\":true,\"version\":3,\"load\":0.5}";
+  JsonDocument doc;
+  TEST_ASSERT_FALSE(deserializeJson(doc, body, strlen(body)));
+
+  TEST_ASSERT_NULL(compileCheckRules("json:ok=true", rules));
+  TEST_ASSERT_TRUE(jsonAssertionHolds(rules.json, doc.as<JsonVariantConst>()));
+  TEST_ASSERT_NULL(compileCheckRules("json:version=3.0", rules));
+  TEST_ASSERT_TRUE(jsonAssertionHolds(rules.json, doc.as<JsonVariantConst>()));
+  TEST_ASSERT_NULL(compileCheckRules("json:load=1", rules));
+  TEST_ASSERT_FALSE(jsonAssertionHolds(rules.json, doc.as<JsonVariantConst>()));
+  TEST_ASSERT_NULL(compileCheckRules("json:missing", rules));
+  TEST_ASSERT_FALSE(jsonAssertionHolds(rules.json, doc.as<JsonVariantConst>()));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_text_has_no_rules);
+  RUN_TEST(test_compiles_status_ranges);
+  RUN_TEST(test_rejects_bad_status);
+  RUN_TEST(test_rejects_unknown_and_oversized_rules);
+  RUN_TEST(test_matches_headers_case_insensitively);
+  RUN_TEST(test_compiles_json_path);
+  RUN_TEST(test_filter_keeps_only_the_asserted_field);
+  RUN_TEST(test_compares_numbers_and_booleans);
+  return UNITY_END();
+}
@@ -0,0 +1,58 @@
+#include <unity.h>
+#include "Dependencies.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_chains_are_kept() {
+  int16_t parents[] = { NO_PARENT, 0, 1, 1, NO_PARENT };
+  TEST_ASSERT_EQUAL(0, breakDependencyCycles(parents, 5));
+  TEST_ASSERT_EQUAL(NO_PARENT, parents[0]);
+  TEST_ASSERT_EQUAL(0, parents[1]);
+  TEST_ASSERT_EQUAL(1, parents[2]);
+  TEST_ASSERT_EQUAL(1, parents[3]);
+}
+
+void test_self_parent_is_cleared() {
+  int16_t parents[] = { 0, 0 };
+  TEST_ASSERT_EQUAL(1, breakDependencyCycles(parents, 2));
+  TEST_ASSERT_EQUAL(NO_PARENT, parents[0]);
+  TEST_ASSERT_EQUAL(0, parents[1]);
+}
+
+void test_one_link_per_loop_is_cleared() {
+  // 0 -> 1 -> 2 -> 0, and 4 hangs off the loop
+  int16_t parents[] = { 1, 2, 0, NO_PARENT, 2 };
+  TEST_ASSERT_EQUAL(1, breakDependencyCycles(parents, 5));
+  TEST_ASSERT_EQUAL(NO_PARENT, parents[0]);
+  TEST_ASSERT_EQUAL(2, parents[1]);
+  TEST_ASSERT_EQUAL(0, parents[2]);
+  TEST_ASSERT_EQUAL(2, parents[4]);
+
+  // Every chain ends now
+  for (int i = 0; i < 5; i++) {
+    int node = i;
+    int steps = 0;
+    while (parents[node] != NO_PARENT && steps++ < 5) {
+      node = parents[node];
+    }
+    TEST_ASSERT_EQUAL(NO_PARENT, parents[node]);
+  }
+}
+
+void test_parent_reach() {
+  TEST_ASSERT_EQUAL(PARENT_REACHABLE, parentReach(false, false, 0, false));
+  TEST_ASSERT_EQUAL(PARENT_REACHABLE, parentReach(true, true, 0, false));
+  TEST_ASSERT_EQUAL(PARENT_IN_DOUBT, parentReach(true, true, 1, false));
+  TEST_ASSERT_EQUAL(PARENT_UNREACHABLE, parentReach(true, false, 3, false));
+  TEST_ASSERT_EQUAL(PARENT_UNREACHABLE, parentReach(true, true, 0, true));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_chains_are_kept);
+  RUN_TEST(test_self_parent_is_cleared);
+  RUN_TEST(test_one_link_per_loop_is_cleared);
+  RUN_TEST(test_parent_reach);
+  return UNITY_END();
+}
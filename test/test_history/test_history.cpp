@@ -0,0 +1,86 @@
+#include <unity.h>
+#include <string.h>
+#include "History.h"
+
+HistoryRing ring;
+UptimeWindow windows[UPTIME_WINDOWS];
+
+static HistoryRecord makeRecord(uint32_t time, bool up) {
+  HistoryRecord record = { time, 10, (uint8_t)(up ? HISTORY_UP : 0), 0 };
+  return record;
+}
+
+void setUp() {
+  memset(&ring, 0, sizeof(ring));
+  memset(windows, 0, sizeof(windows));
+}
+
+void tearDown() {}
+
+void test_ring_keeps_newest_in_order() {
+  const int total = HISTORY_RING_SIZE + 10;
+  for (int i = 0; i < total; i++) {
+    pushHistoryRecord(ring, makeRecord(1000 + i, true));
+  }
+  TEST_ASSERT_EQUAL(HISTORY_RING_SIZE, ring.count);
+  TEST_ASSERT_EQUAL_UINT32(1000 + total - HISTORY_RING_SIZE, historyRingRecord(ring, 0).time);
+  TEST_ASSERT_EQUAL_UINT32(1000 + total - 1, historyRingRecord(ring, HISTORY_RING_SIZE - 1).time);
+}
+
+void test_push_reports_lost_unflushed_records() {
+  for (int i = 0; i < HISTORY_RING_SIZE; i++) {
+    TEST_ASSERT_TRUE(pushHistoryRecord(ring, makeRecord(i, true)));
+  }
+  TEST_ASSERT_FALSE(pushHistoryRecord(ring, makeRecord(HISTORY_RING_SIZE, true)));
+
+  // After a flush drains some, the ring counts up again
+  ring.unflushed = 2;
+  TEST_ASSERT_EQUAL_UINT32(HISTORY_RING_SIZE - 1, unflushedHistoryRecord(ring, 0).time);
+  TEST_ASSERT_TRUE(pushHistoryRecord(ring, makeRecord(HISTORY_RING_SIZE + 1, true)));
+  TEST_ASSERT_EQUAL(3, ring.unflushed);
+}
+
+void test_uptime_empty_window() {
+  TEST_ASSERT_EQUAL_FLOAT(-1, uptimePercent(windows[0]));
+}
+
+void test_uptime_counts_every_window() {
+  uint32_t start = 1700000000;
+  for (int i = 0; i < 10; i++) {
+    countUptime(windows, makeRecord(start + i * 10, i != 3));
+  }
+  for (int i = 0; i < UPTIME_WINDOWS; i++) {
+    TEST_ASSERT_EQUAL_UINT32(10, windows[i].checks);
+    TEST_ASSERT_EQUAL_FLOAT(90, uptimePercent(windows[i]));
+  }
+}
+
+void test_uptime_expires_old_buckets() {
+  uint32_t start = 1700000000;
+  countUptime(windows, makeRecord(start, false));
+  // Two hours later the 1h window only holds the new check, the 24h one still has both
+  countUptime(windows, makeRecord(start + 7200, true));
+  TEST_ASSERT_EQUAL_UINT32(1, windows[0].checks);
+  TEST_ASSERT_EQUAL_FLOAT(100, uptimePercent(windows[0]));
+  TEST_ASSERT_EQUAL_UINT32(2, windows[1].checks);
+  TEST_ASSERT_EQUAL_FLOAT(50, uptimePercent(windows[1]));
+}
+
+void test_uptime_ignores_records_older_than_window() {
+  uint32_t start = 1700000000;
+  countUptime(windows, makeRecord(start, true));
+  countUptime(windows, makeRecord(start - 7200, false));
+  TEST_ASSERT_EQUAL_UINT32(1, windows[0].checks);
+  TEST_ASSERT_EQUAL_UINT32(2, windows[1].checks);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_ring_keeps_newest_in_order);
+  RUN_TEST(test_push_reports_lost_unflushed_records);
+  RUN_TEST(test_uptime_empty_window);
+  RUN_TEST(test_uptime_counts_every_window);
+  RUN_TEST(test_uptime_expires_old_buckets);
+  RUN_TEST(test_uptime_ignores_records_older_than_window);
+  return UNITY_END();
+}
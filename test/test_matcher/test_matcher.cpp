@@ -0,0 +1,84 @@
+#include <unity.h>
+#include <string.h>
+#include "ResponseMatcher.h"
+
+static bool feed(ResponseMatcher& matcher, const char* text) {
+  return feedResponseMatcher(matcher, (const uint8_t*)text, strlen(text));
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty_pattern_accepts_any_body() {
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, "");
+  TEST_ASSERT_EQUAL(0, matcher.length);
+  TEST_ASSERT_TRUE(feed(matcher, ""));
+  TEST_ASSERT_TRUE(feed(matcher, "anything"));
+}
+
+void test_finds_pattern_in_one_chunk() {
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, "\"status\":\"ok\"");
+  TEST_ASSERT_TRUE(feed(matcher, "{\"status\":\"ok\",\"version\":3}"));
+}
+
+void test_reports_missing_pattern() {
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, "healthy");
+  TEST_ASSERT_FALSE(feed(matcher, "unhealth"));
+  TEST_ASSERT_FALSE(feed(matcher, "ier days"));
+}
+
+void test_finds_pattern_split_across_chunks() {
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, "Jellyfin Server");
+  TEST_ASSERT_FALSE(feed(matcher, "<title>Jelly"));
+  TEST_ASSERT_FALSE(feed(matcher, "fin Ser"));
+  TEST_ASSERT_TRUE(feed(matcher, "ver</title>"));
+}
+
+void test_falls_back_on_partial_prefix() {
+  // "aab" inside "aaab" only matches when the failure table is followed
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, "aab");
+  TEST_ASSERT_TRUE(feed(matcher, "aaab"));
+
+  initResponseMatcher(matcher, "abab");
+  TEST_ASSERT_FALSE(feed(matcher, "aba"));
+  TEST_ASSERT_TRUE(feed(matcher, "bab"));
+}
+
+void test_one_byte_at_a_time() {
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, "ababc");
+  const char* body = "abababababc";
+  bool found = false;
+  for (size_t i = 0; body[i] != '\0' && !found; i++) {
+    found = feedResponseMatcher(matcher, (const uint8_t*)&body[i], 1);
+  }
+  TEST_ASSERT_TRUE(found);
+}
+
+void test_long_pattern_is_cut() {
+  char pattern[MAX_EXPECTED_RESPONSE + 20];
+  memset(pattern, 'x', sizeof(pattern) - 1);
+  pattern[sizeof(pattern) - 1] = '\0';
+
+  ResponseMatcher matcher;
+  initResponseMatcher(matcher, pattern);
+  TEST_ASSERT_EQUAL(MAX_EXPECTED_RESPONSE, matcher.length);
+  TEST_ASSERT_EQUAL('\0', matcher.pattern[MAX_EXPECTED_RESPONSE]);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_pattern_accepts_any_body);
+  RUN_TEST(test_finds_pattern_in_one_chunk);
+  RUN_TEST(test_reports_missing_pattern);
+  RUN_TEST(test_finds_pattern_split_across_chunks);
+  RUN_TEST(test_falls_back_on_partial_prefix);
+  RUN_TEST(test_one_byte_at_a_time);
+  RUN_TEST(test_long_pattern_is_cut);
+  return UNITY_END();
+}
@@ -0,0 +1,94 @@
+#include <unity.h>
+#include "PeerRing.h"
+
+const int KEYS = 2000;
+PeerRing ring;
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty_ring_has_no_owner() {
+  ring.size = 0;
+  int primary, secondary;
+  peerRingOwners(ring, 1234, primary, secondary);
+  TEST_ASSERT_EQUAL(-1, primary);
+  TEST_ASSERT_EQUAL(-1, secondary);
+}
+
+void test_single_node_owns_everything() {
+  const uint32_t nodes[] = { 0xA1B2C3 };
+  buildPeerRing(ring, nodes, 1);
+  for (uint32_t key = 0; key < 100; key++) {
+    int primary, secondary;
+    peerRingOwners(ring, key * 0x9E3779B9u, primary, secondary);
+    TEST_ASSERT_EQUAL(0, primary);
+    TEST_ASSERT_EQUAL(-1, secondary);
+  }
+}
+
+void test_owners_are_distinct_and_spread() {
+  const uint32_t nodes[] = { 0x100001, 0x100002, 0x100003 };
+  buildPeerRing(ring, nodes, 3);
+  int primaries[3] = { 0, 0, 0 };
+  for (uint32_t key = 0; key < KEYS; key++) {
+    int primary, secondary;
+    peerRingOwners(ring, key * 0x9E3779B9u, primary, secondary);
+    TEST_ASSERT_TRUE(primary >= 0 && primary < 3);
+    TEST_ASSERT_TRUE(secondary >= 0 && secondary < 3);
+    TEST_ASSERT_TRUE(primary != secondary);
+    primaries[primary]++;
+  }
+  // Sixteen points per node keep the split within a loose factor of even
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT_TRUE(primaries[i] > KEYS / 6);
+  }
+}
+
+void test_leaving_node_only_moves_its_services() {
+  const uint32_t before[] = { 0x100001, 0x100002, 0x100003 };
+  const uint32_t after[] = { 0x100001, 0x100002 };
+  PeerRing shrunk;
+  buildPeerRing(ring, before, 3);
+  buildPeerRing(shrunk, after, 2);
+
+  for (uint32_t key = 0; key < KEYS; key++) {
+    int primary, secondary, newPrimary, newSecondary;
+    peerRingOwners(ring, key * 0x9E3779B9u, primary, secondary);
+    peerRingOwners(shrunk, key * 0x9E3779B9u, newPrimary, newSecondary);
+    if (primary != 2) {
+      TEST_ASSERT_EQUAL(primary, newPrimary);
+    } else {
+      // The secondary takes over
+      TEST_ASSERT_EQUAL(secondary, newPrimary);
+    }
+  }
+}
+
+void test_service_key_depends_on_target() {
+  uint32_t key = peerServiceKey(2, "nas.local", 80, "/health");
+  TEST_ASSERT_EQUAL_UINT32(key, peerServiceKey(2, "nas.local", 80, "/health"));
+  TEST_ASSERT_TRUE(key != peerServiceKey(3, "nas.local", 80, "/health"));
+  TEST_ASSERT_TRUE(key != peerServiceKey(2, "nas.local", 8080, "/health"));
+  TEST_ASSERT_TRUE(key != peerServiceKey(2, "nas.loca", 80, "l/health"));
+}
+
+void test_quorum() {
+  TEST_ASSERT_EQUAL(QUORUM_UNKNOWN, quorumState(0, 0));
+  TEST_ASSERT_EQUAL(QUORUM_UP, quorumState(2, 2));
+  TEST_ASSERT_EQUAL(QUORUM_DOWN, quorumState(1, 0));
+  TEST_ASSERT_EQUAL(QUORUM_DISPUTED, quorumState(2, 1));
+  TEST_ASSERT_EQUAL(QUORUM_DOWN, quorumState(3, 1));
+  TEST_ASSERT_EQUAL(QUORUM_DISPUTED, quorumState(3, 2));
+  TEST_ASSERT_EQUAL_STRING("disputed", quorumStateName(QUORUM_DISPUTED));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_ring_has_no_owner);
+  RUN_TEST(test_single_node_owns_everything);
+  RUN_TEST(test_owners_are_distinct_and_spread);
+  RUN_TEST(test_leaving_node_only_moves_its_services);
+  RUN_TEST(test_service_key_depends_on_target);
+  RUN_TEST(test_quorum);
+  return UNITY_END();
+}
@@ -0,0 +1,89 @@
+#include <unity.h>
+#include "Scheduler.h"
+
+const int CAPACITY = 16;
+DeadlineEntry entries[CAPACITY];
+DeadlineHeap heap;
+
+void setUp() {
+  initDeadlineHeap(heap, entries, CAPACITY);
+}
+
+void tearDown() {}
+
+void test_root_is_earliest_deadline() {
+  const uint32_t due[] = { 500, 100, 900, 300, 700, 200 };
+  for (int slot = 0; slot < 6; slot++) {
+    TEST_ASSERT_TRUE(appendDeadline(heap, slot, due[slot]));
+  }
+  heapifyDeadlines(heap);
+
+  // Pushing each root far out walks the slots in deadline order
+  const int order[] = { 1, 5, 3, 0, 4, 2 };
+  for (int i = 0; i < 6; i++) {
+    TEST_ASSERT_EQUAL(order[i], heap.entries[0].slot);
+    rescheduleRoot(heap, 100000 + i);
+  }
+}
+
+void test_append_refuses_past_capacity() {
+  for (int slot = 0; slot < CAPACITY; slot++) {
+    TEST_ASSERT_TRUE(appendDeadline(heap, slot, slot));
+  }
+  TEST_ASSERT_FALSE(appendDeadline(heap, CAPACITY, 0));
+  TEST_ASSERT_EQUAL(CAPACITY, heap.size);
+}
+
+void test_orders_across_millis_wrap() {
+  appendDeadline(heap, 0, 0x00000010);
+  appendDeadline(heap, 1, 0xFFFFFFF0);
+  heapifyDeadlines(heap);
+  TEST_ASSERT_EQUAL(1, heap.entries[0].slot);
+}
+
+void test_next_deadline_keeps_phase() {
+  TEST_ASSERT_EQUAL_UINT32(61000, nextDeadline(1000, 60000, 1500));
+  // Wrapping millis() keeps the phase too
+  TEST_ASSERT_EQUAL_UINT32(0xFFFFFFF0u + 1000, nextDeadline(0xFFFFFFF0u, 1000, 0xFFFFFFF5u));
+}
+
+void test_next_deadline_restarts_when_behind() {
+  TEST_ASSERT_EQUAL_UINT32(250000, nextDeadline(1000, 60000, 190000));
+}
+
+void test_retry_delay_normal_interval_without_failures() {
+  TEST_ASSERT_EQUAL_UINT32(60000, retryDelayMs(0, 2, 60000, 5, 600));
+}
+
+void test_retry_delay_confirms_quickly() {
+  TEST_ASSERT_EQUAL_UINT32(5000, retryDelayMs(1, 2, 60000, 5, 600));
+  TEST_ASSERT_EQUAL_UINT32(5000, retryDelayMs(2, 2, 60000, 5, 600));
+  // Never slower than the normal interval
+  TEST_ASSERT_EQUAL_UINT32(3000, retryDelayMs(1, 2, 3000, 5, 600));
+}
+
+void test_retry_delay_backs_off_to_cap() {
+  TEST_ASSERT_EQUAL_UINT32(60000, retryDelayMs(3, 2, 60000, 5, 600));
+  TEST_ASSERT_EQUAL_UINT32(120000, retryDelayMs(4, 2, 60000, 5, 600));
+  TEST_ASSERT_EQUAL_UINT32(240000, retryDelayMs(5, 2, 60000, 5, 600));
+  TEST_ASSERT_EQUAL_UINT32(600000, retryDelayMs(7, 2, 60000, 5, 600));
+  TEST_ASSERT_EQUAL_UINT32(600000, retryDelayMs(255, 2, 60000, 5, 600));
+}
+
+void test_retry_delay_cap_below_interval() {
+  TEST_ASSERT_EQUAL_UINT32(60000, retryDelayMs(10, 2, 60000, 5, 0));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_root_is_earliest_deadline);
+  RUN_TEST(test_append_refuses_past_capacity);
+  RUN_TEST(test_orders_across_millis_wrap);
+  RUN_TEST(test_next_deadline_keeps_phase);
+  RUN_TEST(test_next_deadline_restarts_when_behind);
+  RUN_TEST(test_retry_delay_normal_interval_without_failures);
+  RUN_TEST(test_retry_delay_confirms_quickly);
+  RUN_TEST(test_retry_delay_backs_off_to_cap);
+  RUN_TEST(test_retry_delay_cap_below_interval);
+  return UNITY_END();
+}
@@ -0,0 +1,203 @@
+#include <unity.h>
+#include <string.h>
+#include <ArduinoJson.h>
+#include "ServiceDefinition.h"
+
+JsonDocument doc;
+ServiceDefinition definition;
+
+static const char* parse(const char* json) {
+  doc.clear();
+  if (deserializeJson(doc, json)) {
+    return "Invalid JSON";
+  }
+  return parseServiceJson(doc.as<JsonObjectConst>(), definition);
+}
+
+void setUp() {
+  memset(&definition, 0, sizeof(definition));
+}
+
+void tearDown() {}
+
+void test_fills_defaults() {
+  TEST_ASSERT_NULL(parse("{\"type\":\"http_get\",\"name\":\"NAS\",\"host\":\"nas.local\"}"));
+  TEST_ASSERT_EQUAL(TYPE_HTTP_GET, definition.type);
+  TEST_ASSERT_EQUAL_STRING("", definition.id);
+  TEST_ASSERT_EQUAL_STRING("NAS", definition.name);
+  TEST_ASSERT_EQUAL_STRING("nas.local", definition.host);
+  TEST_ASSERT_EQUAL(80, definition.port);
+  TEST_ASSERT_EQUAL_STRING("/", definition.path);
+  TEST_ASSERT_EQUAL_STRING("*", definition.expectedResponse);
+  TEST_ASSERT_EQUAL_UINT32(60, definition.checkInterval);
+  TEST_ASSERT_EQUAL_UINT32(DEFAULT_MAX_SCAN_BYTES, definition.maxScanBytes);
+  TEST_ASSERT_EQUAL_UINT32(0, definition.degradedMs);
+  TEST_ASSERT_EQUAL(DEFAULT_CONFIRM_CHECKS, definition.confirmChecks);
+  TEST_ASSERT_EQUAL(DEFAULT_RETRY_INTERVAL, definition.retryInterval);
+  TEST_ASSERT_EQUAL_UINT32(DEFAULT_MAX_BACKOFF, definition.maxBackoff);
+  TEST_ASSERT_EQUAL_STRING("", definition.rules);
+  TEST_ASSERT_EQUAL_STRING("", definition.authToken);
+  TEST_ASSERT_EQUAL_STRING("", definition.parent);
+  TEST_ASSERT_EQUAL_STRING("", definition.group);
+  TEST_ASSERT_EQUAL(DEFAULT_CONNECT_TIMEOUT_MS, effectiveConnectTimeout(definition.connectTimeoutMs));
+  TEST_ASSERT_EQUAL(DEFAULT_READ_TIMEOUT_MS, effectiveReadTimeout(definition.type, definition.readTimeoutMs));
+}
+
+void test_ping_defaults_and_timeouts() {
+  TEST_ASSERT_NULL(parse("{\"type\":\"ping\",\"host\":\"router\"}"));
+  TEST_ASSERT_EQUAL(DEFAULT_PING_COUNT, effectivePingCount(definition.pingCount));
+  TEST_ASSERT_EQUAL(DEFAULT_PING_TIMEOUT_MS, effectiveReadTimeout(definition.type, definition.readTimeoutMs));
+  TEST_ASSERT_NULL(parse("{\"type\":\"ping\",\"pingCount\":5,\"readTimeoutMs\":2500}"));
+  TEST_ASSERT_EQUAL(5, effectivePingCount(definition.pingCount));
+  TEST_ASSERT_EQUAL(2500, effectiveReadTimeout(definition.type, definition.readTimeoutMs));
+
+  TEST_ASSERT_EQUAL_STRING("Too many pings", parse("{\"type\":\"ping\",\"pingCount\":11}"));
+  TEST_ASSERT_EQUAL_STRING("Timeout out of range", parse("{\"type\":\"tcp\",\"connectTimeoutMs\":50}"));
+  TEST_ASSERT_EQUAL_STRING("Timeout out of range", parse("{\"type\":\"https\",\"readTimeoutMs\":60000}"));
+}
+
+void test_reads_every_field() {
+  TEST_ASSERT_NULL(parse("{\"type\":\"jellyfin\",\"name\":\"Media\",\"host\":\"10.0.0.5\",\"port\":8096,"
+    "\"path\":\"/web\",\"expectedResponse\":\"Jellyfin\",\"checkInterval\":30,\"maxScanBytes\":1024,"
+    "\"degradedMs\":800,\"confirmChecks\":3,\"retryInterval\":10,\"maxBackoff\":120}"));
+  TEST_ASSERT_EQUAL(TYPE_JELLYFIN, definition.type);
+  TEST_ASSERT_EQUAL(8096, definition.port);
+  TEST_ASSERT_EQUAL_STRING("/web", definition.path);
+  TEST_ASSERT_EQUAL_STRING("Jellyfin", definition.expectedResponse);
+  TEST_ASSERT_EQUAL_UINT32(30, definition.checkInterval);
+  TEST_ASSERT_EQUAL_UINT32(1024, definition.maxScanBytes);
+  TEST_ASSERT_EQUAL_UINT32(800, definition.degradedMs);
+  TEST_ASSERT_EQUAL(3, definition.confirmChecks);
+  TEST_ASSERT_EQUAL(10, definition.retryInterval);
+  TEST_ASSERT_EQUAL_UINT32(120, definition.maxBackoff);
+}
+
+void test_tls_types_default_to_443() {
+  TEST_ASSERT_NULL(parse("{\"type\":\"https\",\"host\":\"example.org\"}"));
+  TEST_ASSERT_EQUAL(TYPE_HTTPS, definition.type);
+  TEST_ASSERT_EQUAL(443, definition.port);
+  TEST_ASSERT_NULL(parse("{\"type\":\"tls\",\"host\":\"mail.lan\",\"port\":993}"));
+  TEST_ASSERT_EQUAL(993, definition.port);
+  TEST_ASSERT_NULL(parse("{\"type\":\"tcp\",\"host\":\"db.lan\"}"));
+  TEST_ASSERT_EQUAL(80, definition.port);
+}
+
+void test_rejects_unknown_type() {
+  TEST_ASSERT_EQUAL_STRING("Invalid service type", parse("{\"type\":\"gopher\"}"));
+  TEST_ASSERT_EQUAL_STRING("Invalid service type", parse("{\"name\":\"no type\"}"));
+}
+
+void test_rejects_oversized_fields() {
+  char json[768];
+  // Longer than a DNS label but still a valid name, and a health path with a query string
+  TEST_ASSERT_NULL(parse("{\"type\":\"http_get\",\"host\":\"grafana-dashboards-primary.monitoring.stack.internal."
+    "homelab.example.com\",\"path\":\"/api/health?checks=database,cache,queue,storage,scheduler,mail,search,"
+    "metrics&verbose=true&format=json\"}"));
+  char host[MAX_HOST_LENGTH + 2];
+  memset(host, 'h', sizeof(host) - 1);
+  host[sizeof(host) - 1] = '\0';
+  snprintf(json, sizeof(json), "{\"type\":\"ping\",\"host\":\"%s\"}", host);
+  TEST_ASSERT_EQUAL_STRING("Host too long", parse(json));
+
+  char path[MAX_PATH_LENGTH + 2];
+  memset(path, 'p', sizeof(path) - 1);
+  path[sizeof(path) - 1] = '\0';
+  snprintf(json, sizeof(json), "{\"type\":\"http_get\",\"path\":\"/%s\"}", path);
+  TEST_ASSERT_EQUAL_STRING("Path too long", parse(json));
+
+  TEST_ASSERT_EQUAL_STRING("Too many confirmation checks", parse("{\"type\":\"ping\",\"confirmChecks\":11}"));
+
+  char token[MAX_AUTH_TOKEN_LENGTH + 2];
+  memset(token, 't', sizeof(token) - 1);
+  token[sizeof(token) - 1] = '\0';
+  snprintf(json, sizeof(json), "{\"type\":\"http_get\",\"authToken\":\"%s\"}", token);
+  TEST_ASSERT_EQUAL_STRING("Auth token too long", parse(json));
+
+  TEST_ASSERT_EQUAL_STRING("Parent id too long", parse("{\"type\":\"ping\",\"parent\":\"0123456789abcdef\"}"));
+  TEST_ASSERT_EQUAL_STRING("Group too long",
+    parse("{\"type\":\"ping\",\"group\":\"Rack two, the one behind the old switch\"}"));
+}
+
+// What the config loaders run on records that never went through parseServiceJson()
+void test_checks_lengths_of_loaded_services() {
+  TEST_ASSERT_NULL(parse("{\"type\":\"http_get\",\"host\":\"nas.local\"}"));
+  TEST_ASSERT_NULL(checkServiceLengths(definition));
+
+  char host[MAX_HOST_LENGTH + 2];
+  memset(host, 'h', sizeof(host) - 1);
+  host[sizeof(host) - 1] = '\0';
+  definition.host = host;
+  TEST_ASSERT_EQUAL_STRING("Host too long", checkServiceLengths(definition));
+
+  char token[MAX_AUTH_TOKEN_LENGTH + 2];
+  memset(token, 't', sizeof(token) - 1);
+  token[sizeof(token) - 1] = '\0';
+  definition.host = "nas.local";
+  definition.authToken = token;
+  TEST_ASSERT_EQUAL_STRING("Auth token too long", checkServiceLengths(definition));
+}
+
+void test_rejects_invalid_rules() {
+  TEST_ASSERT_NULL(parse("{\"type\":\"http_get\",\"rules\":\"status=200-399;header:Server=nginx\"}"));
+  TEST_ASSERT_EQUAL_STRING("status=200-399;header:Server=nginx", definition.rules);
+  TEST_ASSERT_EQUAL_STRING("Invalid status range", parse("{\"type\":\"http_get\",\"rules\":\"status=ok\"}"));
+  TEST_ASSERT_EQUAL_STRING("Unknown rule", parse("{\"type\":\"http_get\",\"rules\":\"cookie=1\"}"));
+}
+
+void test_type_names_round_trip() {
+  const ServiceType types[] = { TYPE_HOME_ASSISTANT, TYPE_JELLYFIN, TYPE_HTTP_GET, TYPE_PING, TYPE_TCP, TYPE_TLS,
+    TYPE_HTTPS };
+  for (ServiceType type : types) {
+    ServiceType parsed;
+    TEST_ASSERT_TRUE(parseServiceType(serviceTypeName(type), parsed));
+    TEST_ASSERT_EQUAL(type, parsed);
+  }
+  TEST_ASSERT_EQUAL_STRING("unknown", serviceTypeName((ServiceType)99));
+}
+
+void test_serialize_then_parse_is_identity() {
+  ServiceDefinition original = { "a1b2c3", "Home", TYPE_HOME_ASSISTANT, "ha.local", 8123, "/api/", "running",
+    45, 4096, 500, 1, 7, 300, "json:message=API running.", "eyJhbGciOi", "9f00aa01", "Proxmox",
+    1500, 8000, 0 };
+  JsonDocument out;
+  serializeServiceDefinition(original, out.to<JsonObject>());
+  char json[512];
+  serializeJson(out, json, sizeof(json));
+
+  TEST_ASSERT_NULL(parse(json));
+  TEST_ASSERT_EQUAL_STRING("a1b2c3", doc["id"] | "");
+  TEST_ASSERT_EQUAL(original.type, definition.type);
+  TEST_ASSERT_EQUAL_STRING(original.name, definition.name);
+  TEST_ASSERT_EQUAL_STRING(original.host, definition.host);
+  TEST_ASSERT_EQUAL(original.port, definition.port);
+  TEST_ASSERT_EQUAL_STRING(original.path, definition.path);
+  TEST_ASSERT_EQUAL_STRING(original.expectedResponse, definition.expectedResponse);
+  TEST_ASSERT_EQUAL_UINT32(original.checkInterval, definition.checkInterval);
+  TEST_ASSERT_EQUAL_UINT32(original.maxScanBytes, definition.maxScanBytes);
+  TEST_ASSERT_EQUAL_UINT32(original.degradedMs, definition.degradedMs);
+  TEST_ASSERT_EQUAL(original.confirmChecks, definition.confirmChecks);
+  TEST_ASSERT_EQUAL(original.retryInterval, definition.retryInterval);
+  TEST_ASSERT_EQUAL(original.connectTimeoutMs, definition.connectTimeoutMs);
+  TEST_ASSERT_EQUAL(original.readTimeoutMs, definition.readTimeoutMs);
+  TEST_ASSERT_TRUE(doc["pingCount"].isNull());
+  TEST_ASSERT_EQUAL_UINT32(original.maxBackoff, definition.maxBackoff);
+  TEST_ASSERT_EQUAL_STRING(original.rules, definition.rules);
+  TEST_ASSERT_EQUAL_STRING(original.authToken, definition.authToken);
+  TEST_ASSERT_EQUAL_STRING(original.parent, definition.parent);
+  TEST_ASSERT_EQUAL_STRING(original.group, definition.group);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fills_defaults);
+  RUN_TEST(test_reads_every_field);
+  RUN_TEST(test_tls_types_default_to_443);
+  RUN_TEST(test_ping_defaults_and_timeouts);
+  RUN_TEST(test_rejects_unknown_type);
+  RUN_TEST(test_rejects_oversized_fields);
+  RUN_TEST(test_checks_lengths_of_loaded_services);
+  RUN_TEST(test_rejects_invalid_rules);
+  RUN_TEST(test_type_names_round_trip);
+  RUN_TEST(test_serialize_then_parse_is_identity);
+  return UNITY_END();
+}